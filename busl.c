@@ -45,8 +45,6 @@ int main(int argc, char *argv[]) {
 	if (argc<2) {
 		changed = busl_usage(&s, *argv); /* prevent de "no sources modified" message */
 	}
-	while (--argc) {
-		changed |= busl_beautify(&s, *(++argv));
-	}
+	changed |= busl_beautify_batch(&s, argc-1, (const char *const *) &argv[1]);
 	return busl_finish(&s, changed);
 }
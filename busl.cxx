@@ -33,8 +33,6 @@ int main(int argc, char *argv[]) {
 	if (argc<2) {
 		changed = s.usage(*argv); /* prevent de "no sources modified" message */
 	}
-	while (--argc) {
-		changed |= s.beautify(*(++argv));
-	}
+	changed |= s.beautify(argc-1, &argv[1]);
 	return s.finish(changed);
 }
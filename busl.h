@@ -19,6 +19,9 @@
 #ifndef BUSL_H
 #   define BUSL_H
 
+#   include <stddef.h>
+#   include <stdio.h>
+
 #   ifdef __cplusplus
 #       include <iostream>
 extern "C" {
@@ -66,13 +69,25 @@ extern "C" {
 		/** Last character was a * (C-comment) or %, # or ? (XML): This might be almost the end of a comment block */
 		ALMOSTEND = 1024,
 		/** Potential extra indent */
-		EXTRAINDENT = 2048
+		EXTRAINDENT = 2048,
+		/** Don't keep the original file as <file>~ */
+		NOBACKUP = 4096, /* defaultflags only */
+		/** Skip files which were clean last time, see Busl.cache */
+		USECACHE = 8192 /* defaultflags only */
+	};
+
+	/* Kept apart from the flags above, which must fit in 16 bits */
+	enum {
+		/** Show the changes as unified diff instead of writing them */
+		DIFFMODE = 1, /* report only */
+		/** Stop at the first line which is not beautified already */
+		CHECKMODE = 2 /* report only */
 	};
 
 	enum {
-		/** Size of input and output buffer */
+		/** Initial size of input and output buffer */
 		BUFSIZE = 8192,
-		/** Size of level stack */
+		/** Number of indent levels kept inside the BUSL status, deeper levels are allocated */
 		STACKSIZE = 256
 	};
 
@@ -91,9 +106,17 @@ extern "C" {
 #   endif
 
 	struct Busl;
+	struct buslbatch;
+	struct buslcache;
+	struct busldiff;
+	struct buslcheckpoints;
 	BUSL_EXPORT struct Busl *__stdcall busl_create(struct Busl *s, void (__stdcall* wrt)(void *, const char *), void *output);
 	BUSL_EXPORT int __stdcall busl_usage(struct Busl *s, const char *argv0);
 	BUSL_EXPORT int __stdcall busl_beautify(struct Busl *s, const char *filename);
+	BUSL_EXPORT int __stdcall busl_beautify_batch(struct Busl *s, int argc, const char *const *argv);
+	BUSL_EXPORT int __stdcall busl_beautify_buffer(struct Busl *s, const char *filename, const char *input, size_t inputlen, char *output, size_t *outputlen, char *messages, size_t *messageslen);
+	BUSL_EXPORT int __stdcall busl_beautify_sink(struct Busl *s, const char *filename, const char *input, size_t inputlen, void (__stdcall *sink)(void *, const char *, size_t), void *data, char *messages, size_t *messageslen);
+	BUSL_EXPORT int __stdcall busl_beautify_range(struct Busl *s, const char *filename, const char *input, size_t inputlen, int *firstline, int *lastline, char *output, size_t *outputlen, char *messages, size_t *messageslen);
 	BUSL_EXPORT int __stdcall busl_finish(struct Busl *s, int changed);
 	BUSL_EXPORT void __stdcall busl_delete(struct Busl *s);
 
@@ -114,6 +137,18 @@ extern "C" {
 		bool __stdcall beautify(const char *filename) {
 			return busl_beautify(this, filename)>0;
 		}
+		bool __stdcall beautify(int argc, const char *const *argv) {
+			return (busl_beautify_batch(this, argc, argv)&CHANGED)!=0;
+		}
+		bool __stdcall beautify(const char *filename, const char *input, size_t inputlen, char *output, size_t *outputlen, char *messages = 0, size_t *messageslen = 0) {
+			return (busl_beautify_buffer(this, filename, input, inputlen, output, outputlen, messages, messageslen)&CHANGED)!=0;
+		}
+		bool __stdcall beautify(const char *filename, const char *input, size_t inputlen, void (__stdcall *sink)(void *, const char *, size_t), void *data, char *messages = 0, size_t *messageslen = 0) {
+			return (busl_beautify_sink(this, filename, input, inputlen, sink, data, messages, messageslen)&CHANGED)!=0;
+		}
+		bool __stdcall beautify(const char *filename, const char *input, size_t inputlen, int *firstline, int *lastline, char *output, size_t *outputlen, char *messages = 0, size_t *messageslen = 0) {
+			return (busl_beautify_range(this, filename, input, inputlen, firstline, lastline, output, outputlen, messages, messageslen)&CHANGED)!=0;
+		}
 		int __stdcall finish(bool changed) {
 			return busl_finish(this, changed? 1: 0);
 		}
@@ -130,6 +165,8 @@ extern "C" {
 		toberemoved *first;
 		/** flags are reset to this value at every file begin */
 		int defaultflags;
+		/** what test mode reports besides the files which would be changed: DIFFMODE and/or CHECKMODE */
+		int report;
 		/** number of spaces used for indenting (<0 = use tabs) */
 		int tabs;
 		/** Current quoting mode. */
@@ -153,27 +190,105 @@ extern "C" {
 		 *  `  string
 		 */
 		char commentquoted;
+		/** type of XML processing command: '%', '#' or '?' (\0 if none) */
+		char cmdtype;
 
-		char inbuf[BUFSIZE];
-		char outbuf[BUFSIZE];
+		/** input line buffer (grows when needed) */
+		char *inbuf;
+		/** output line buffer (grows when needed) */
+		char *outbuf;
+		/** size of inbuf and outbuf */
+		int bufsize;
 		/** position of opening bracket in outbuf for each indent level */
-		int indentpos[STACKSIZE];
+		int *indentpos;
 		/** store indent level type. */
 		/*  )}]    as you would expect
 		 *  (      same as ')', but follows if/for/while
 		 *  :;     used for ?: ternary operator
 		 *  space  additional indent for case statements.
 		 */
-		char indentstack[STACKSIZE];
+		char *indentstack;
 		/** flags for each indent level */
-		int indentflags[STACKSIZE];
+		int *indentflags;
+		/** number of indent levels in indentpos, indentstack and indentflags (0 = not set up yet) */
+		int stacksize;
+		/** indentpos, as long as the nesting is not deeper than STACKSIZE */
+		int stackpos[STACKSIZE];
+		/** indentstack, as long as the nesting is not deeper than STACKSIZE */
+		char stacktype[STACKSIZE];
+		/** indentflags, as long as the nesting is not deeper than STACKSIZE */
+		int stackflags[STACKSIZE];
 
 		/** current position in input buffer */
 		int inpos;
 		/** current position in output buffer */
 		int outpos;
+		/** no "case" starts in the output line before this position, except at casefound */
+		int casescan;
+		/** position in the output line where "case" starts before casescan (-1 if none) */
+		int casefound;
+		/** the input line before this position is scanned for "//" and "-->" */
+		int slashscan;
+		/** position after the first "//" in the input line (0 if none) */
+		int slashpos;
 		/** output directory */
 		const char *outdir;
+		/** number of files beautified in parallel by busl_beautify_batch(), or of threads for a single large file */
+		int jobs;
+		/** 1 when busl_beautify_batch() stops at the first file which is not clean, see the "e" option */
+		int failfast;
+		/** files collected by busl_beautify_batch() (0 when not collecting) */
+		struct buslbatch *batch;
+		/** files which were clean in earlier runs, kept in .buslcache (0 if not loaded) */
+		struct buslcache *cache;
+		/** directory of the content-addressed output cache, see "+<dir>" (0 if not used) */
+		char *outcache;
+		/** line start states kept by busl_beautify_range() (0 if none) */
+		struct buslcheckpoints *checkpoints;
+		/** called at input line starts where nothing is pending, returns 1 to stop beautifying (0 if none) */
+		int (__stdcall *linestart)(struct Busl *s);
+		/** number of messages given so far */
+		unsigned long int msgcount;
+		/** function receiving the output, chosen for each file, see writeout() (0 in test mode) */
+		void (__stdcall *sink)(void *, const char *, size_t);
+		/** first argument of sink */
+		void *sinkdata;
+		/** unified diff of the current file, see the "d" option (0 if not used) */
+		struct busldiff *diff;
+		/** output file (0 in test mode or when writing to memory) */
+		FILE *fout;
+		/** output file which is created as soon as the output differs from the input (0 if none) */
+		const char *outname;
+		/** 1 when LF is written as CRLF to the output file, see writefile() */
+		char outcrlf;
+		/** caller-owned output memory, see busl_beautify_buffer() */
+		char *outmem;
+		/** size of caller-owned output memory */
+		size_t outmemsize;
+		/** number of characters written to the output so far */
+		size_t outlen;
+		/** next character in input memory */
+		const char *inptr;
+		/** end of input memory */
+		const char *inend;
+		/** input file which is read block by block (0 if the input is in memory) */
+		FILE *fin;
+		/** memory for input blocks or converted input, owned by BUSL (0 if none) */
+		char *inblock;
+		/** size of inblock */
+		size_t inblocksize;
+		/** memory mapped input file (0 if none) */
+		void *inmap;
+		/** size of memory mapped input file */
+		size_t inmaplen;
+		/** file descriptor of the memory mapped input file */
+		int inmapfd;
+		/** 1 when a CR at the end of the previous input block is not converted yet */
+		char incr;
+		/** 1 when <CTRL>-Z is found: the remaining input is not converted */
+		char inraw;
+		/** the whole (converted) input, when it is in memory at once (0 if read block by block) */
+		const char *inbase;
 		/** the number of characters to be stripped in C-type comment */
 		int numstrip;
 		/** various flags during beautify process */
@@ -182,6 +297,8 @@ extern "C" {
 		int indent;
 		/** keeps track of output line number */
 		int linenum;
+		/** line number of the first change, see the "k" option (0 if none) */
+		int changedline;
 		/** indent level at start of current line */
 		int curindent;
 		/** return value for main program
@@ -0,0 +1,867 @@
+/** @file buslbench.c
+ * Throughput benchmark for BUSL: generates a reproducible corpus of sources
+ * and measures how fast busl_beautify() handles them.
+ * Copyright (c) 2003-2009, Jan Nijtmans. All rights reserved.
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32) || defined(_WIN64)
+#   include <windows.h>
+#   include <direct.h>
+#   define mkdir(dir, mode) _mkdir(dir)
+#else
+#   include <sys/stat.h>
+#   include <sys/time.h>
+#endif
+#include "busl.h"
+
+/** default size of the generated corpus, in MB */
+#define DEFAULTSIZE 8
+
+/** default seed of the random generator */
+#define DEFAULTSEED 1
+
+/** default size of the pathological inputs, in MB */
+#define ADVERSARIALSIZE 1
+
+/** time ratio for twice the input size above which the time is not linear */
+#define MAXRATIO 3.0
+
+/** maximum nesting of generated statements */
+#define MAXDEPTH 4
+
+/** benchkind.extra: CRLF line ends */
+#define CRLF 1
+
+/** benchkind.extra: <CTRL>-Z followed by binary data */
+#define CTRLZ 2
+
+/**
+ * Contents of a generated file
+ */
+typedef struct benchbuf {
+	/** characters */
+	char *p;
+	/** number of characters */
+	size_t len;
+	/** size of p memory */
+	size_t size;
+	/** state of the random generator */
+	unsigned long seed;
+} benchbuf;
+
+/**
+ * A kind of generated file
+ */
+typedef struct benchkind {
+	/** description, used in the report */
+	const char *name;
+	/** file extension, which determines the mode */
+	const char *ext;
+	/** options given to busl_beautify() before the file */
+	const char *options;
+	/** generator of the contents, called until the file is large enough */
+	void (__stdcall *gen)(benchbuf *b);
+	/** end of the file */
+	const char *tail;
+	/** CRLF and/or CTRLZ */
+	int extra;
+} benchkind;
+
+/**
+ * A generated file, and its measurements
+ */
+typedef struct benchfile {
+	/** filename */
+	char name[64];
+	/** kind of file */
+	const benchkind *kind;
+	/** size in bytes */
+	size_t size;
+	/** number of lines */
+	unsigned long lines;
+	/** flags returned by busl_beautify() in the last pass */
+	int flags;
+} benchfile;
+
+/**
+ * A pathological input for the adversarial benchmark: a unit repeated until the
+ * input has the requested size, optionally split into lines
+ */
+typedef struct benchcase {
+	/** description, used in the report */
+	const char *name;
+	/** filename, which determines the mode */
+	const char *filename;
+	/** options given to busl_beautify() before the input */
+	const char *options;
+	/** start of the input */
+	const char *head;
+	/** repeated part */
+	const char *unit;
+	/** number of units per line, 0 if unit contains the line ends */
+	int perline;
+	/** end of each line of units */
+	const char *lineend;
+	/** repeated after all units as often as unit, e.g. closing brackets */
+	const char *close;
+	/** end of the input */
+	const char *tail;
+} benchcase;
+
+/** identifiers used in generated code */
+static const char *const words[] = {
+	"count", "index", "value", "result", "buffer", "length", "offset", "node", "item", "total", "flags", "name"
+};
+
+/** indenting of generated lines: mostly wrong, so the first pass has work to do */
+static const char *const indents[] = {
+	"", "\t", "  ", "    ", "\t\t", " \t", "        ", "\t  "
+};
+
+/**
+ * Next pseudo-random number. The generator is the same on all platforms,
+ * so a seed always gives the same corpus.
+ *
+ * @param b generated file, containing the state
+ * @param n number of possible results
+ * @return number from 0 to n-1
+ */
+static unsigned long __stdcall rnd(benchbuf *b, unsigned long n) {
+	b->seed = (b->seed*1103515245UL+12345UL)&0xFFFFFFFFUL;
+	return ((b->seed>>16)&0x7FFF)%n;
+}
+
+/**
+ * Append characters to a generated file.
+ *
+ * @param b generated file
+ * @param str characters
+ */
+static void __stdcall put(benchbuf *b, const char *str) {
+	size_t len = strlen(str);
+	if (b->len+len>=b->size) {
+		size_t size = 2*b->size+len+4096;
+		char *p = (char *) realloc(b->p, size);
+		if (!p) {
+			fprintf(stderr, "busl_bench: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		b->p = p;
+		b->size = size;
+	}
+	memcpy(&b->p[b->len], str, len+1);
+	b->len += len;
+}
+
+/**
+ * Append a line start with random indenting.
+ *
+ * @param b generated file
+ */
+static void __stdcall indent(benchbuf *b) {
+	put(b, indents[rnd(b, sizeof(indents)/sizeof(indents[0]))]);
+}
+
+/**
+ * Append an identifier.
+ *
+ * @param b generated file
+ * @param prefix prefix of variables, e.g. "$" for php
+ */
+static void __stdcall ident(benchbuf *b, const char *prefix) {
+	char buf[32];
+	sprintf(buf, "%d", (int) rnd(b, 10));
+	put(b, prefix);
+	put(b, words[rnd(b, sizeof(words)/sizeof(words[0]))]);
+	put(b, buf);
+}
+
+/**
+ * Append an expression, with random spacing.
+ *
+ * @param b generated file
+ * @param prefix prefix of variables
+ */
+static void __stdcall expression(benchbuf *b, const char *prefix) {
+	static const char *const ops[] = {" + ", "+", " - ", "*", " * ", " / ", "<<", " & ", " == ", "!=", " < ", ">="};
+	ident(b, prefix);
+	while (!rnd(b, 2)) {
+		put(b, ops[rnd(b, sizeof(ops)/sizeof(ops[0]))]);
+		ident(b, prefix);
+	}
+}
+
+/**
+ * Append a statement in a C-like language, possibly containing nested blocks.
+ *
+ * @param b generated file
+ * @param prefix prefix of variables
+ * @param depth nesting level
+ */
+static void __stdcall statement(benchbuf *b, const char *prefix, int depth) {
+	int i;
+	int n;
+	indent(b);
+	switch ((depth<MAXDEPTH)? rnd(b, 9): 5+rnd(b, 4)) {
+		case 0:
+			put(b, "if (");
+			expression(b, prefix);
+			put(b, rnd(b, 2)? ") {\n": "){\n");
+			for (n = 1+(int) rnd(b, 3), i=0; i<n; ++i) statement(b, prefix, depth+1);
+			indent(b);
+			put(b, "} else {\n");
+			statement(b, prefix, depth+1);
+			indent(b);
+			put(b, "}\n");
+			break;
+		case 1:
+			put(b, "for (");
+			ident(b, prefix);
+			put(b, "=0; ");
+			expression(b, prefix);
+			put(b, "; ++");
+			ident(b, prefix);
+			put(b, ") {\n");
+			for (n = 1+(int) rnd(b, 3), i=0; i<n; ++i) statement(b, prefix, depth+1);
+			indent(b);
+			put(b, "}\n");
+			break;
+		case 2:
+			put(b, "while (");
+			expression(b, prefix);
+			put(b, ")\n");
+			indent(b);
+			put(b, "{\n");
+			statement(b, prefix, depth+1);
+			indent(b);
+			put(b, "}\n");
+			break;
+		case 3:
+			put(b, "switch (");
+			ident(b, prefix);
+			put(b, ") {\n");
+			for (n = 1+(int) rnd(b, 3), i=0; i<n; ++i) {
+				char buf[32];
+				sprintf(buf, "case %d:\n", i);
+				indent(b);
+				put(b, buf);
+				statement(b, prefix, depth+1);
+				indent(b);
+				put(b, "break;\n");
+			}
+			indent(b);
+			put(b, "default:\n");
+			statement(b, prefix, depth+1);
+			indent(b);
+			put(b, "}\n");
+			break;
+		case 4:
+			put(b, "do {\n");
+			statement(b, prefix, depth+1);
+			indent(b);
+			put(b, "} while (");
+			expression(b, prefix);
+			put(b, ");\n");
+			break;
+		case 5:
+			ident(b, prefix);
+			put(b, " = ");
+			expression(b, prefix);
+			put(b, " ? ");
+			ident(b, prefix);
+			put(b, " : ");
+			ident(b, prefix);
+			put(b, ";\n");
+			break;
+		case 6:
+			ident(b, "");
+			put(b, "(");
+			ident(b, prefix);
+			put(b, rnd(b, 2)? ", \"a string, with (parentheses) and {braces}\", ": ",'x',");
+			expression(b, prefix);
+			put(b, ");\n");
+			break;
+		case 7:
+			put(b, rnd(b, 2)? "/* a comment, with some words in it */\n": "// a line comment: if (x) {\n");
+			break;
+		default:
+			ident(b, prefix);
+			put(b, rnd(b, 2)? "=": " = ");
+			expression(b, prefix);
+			put(b, rnd(b, 2)? ";\n": ";   \n");
+			break;
+	}
+}
+
+/**
+ * Append a function body: statements followed by the closing brace.
+ *
+ * @param b generated file
+ * @param prefix prefix of variables
+ */
+static void __stdcall body(benchbuf *b, const char *prefix) {
+	int n = 2+(int) rnd(b, 8);
+	while (n--) {
+		statement(b, prefix, 1);
+	}
+	indent(b);
+	put(b, "return ");
+	expression(b, prefix);
+	put(b, ";\n}\n\n");
+}
+
+/**
+ * Generate C code.
+ *
+ * @param b generated file
+ */
+static void __stdcall genc(benchbuf *b) {
+	if (!b->len) {
+		put(b, "/*\n * Generated by busl_bench.\n */\n#include <stdio.h>\n#include \"busl.h\"\n\n#define MAX(a, b) ((a)>(b)? (a): (b))\n\n");
+	}
+	put(b, "static int ");
+	ident(b, "");
+	put(b, "(int ");
+	ident(b, "");
+	put(b, ", const char *");
+	ident(b, "");
+	put(b, rnd(b, 2)? ") {\n": ")\n{\n");
+	body(b, "");
+}
+
+/**
+ * Generate C++ code.
+ *
+ * @param b generated file
+ */
+static void __stdcall gencpp(benchbuf *b) {
+	if (!b->len) {
+		put(b, "// Generated by busl_bench.\n#include <vector>\n\nnamespace bench {\n\n");
+	}
+	put(b, "class Item");
+	ident(b, "");
+	put(b, " {\npublic:\n");
+	indent(b);
+	put(b, "int get() const { return value; }\n");
+	indent(b);
+	put(b, "int run(int count, std::vector<int> &items) {\n");
+	body(b, "");
+	put(b, "private:\n\tint value;\n};\n\n");
+}
+
+/**
+ * Generate Java code.
+ *
+ * @param b generated file
+ */
+static void __stdcall genjava(benchbuf *b) {
+	if (!b->len) {
+		put(b, "/**\n * Generated by busl_bench.\n */\npackage org.tigris.busl.bench;\n\nimport java.util.*;\n\n");
+	}
+	put(b, "class Bench");
+	ident(b, "");
+	put(b, " {\n");
+	indent(b);
+	put(b, "public int ");
+	ident(b, "");
+	put(b, "(int count, String name) throws Exception {\n");
+	body(b, "");
+	put(b, "}\n\n");
+}
+
+/**
+ * Generate JavaScript code.
+ *
+ * @param b generated file
+ */
+static void __stdcall genjs(benchbuf *b) {
+	if (!b->len) {
+		put(b, "// Generated by busl_bench.\n\n");
+	}
+	put(b, "var options = {\n");
+	indent(b);
+	put(b, "name: 'bench',\n");
+	indent(b);
+	put(b, "size: 42\n};\n\nfunction ");
+	ident(b, "");
+	put(b, "(count, name) {\n");
+	body(b, "");
+}
+
+/**
+ * Generate PHP code inside HTML (xml/html/sgml mode).
+ *
+ * @param b generated file
+ */
+static void __stdcall genphp(benchbuf *b) {
+	int n = 2+(int) rnd(b, 6);
+	put(b, "<html>\n<body>\n<p>Generated by busl_bench.</p>\n<?php\n");
+	while (n--) {
+		statement(b, "$", 1);
+	}
+	put(b, "?>\n<table>\n<tr><td>value</td></tr>\n</table>\n</body>\n</html>\n");
+}
+
+/**
+ * Generate JSP code (xml/html/sgml mode).
+ *
+ * @param b generated file
+ */
+static void __stdcall genjsp(benchbuf *b) {
+	int n = 2+(int) rnd(b, 6);
+	put(b, "<%@ page import=\"java.util.*\" %>\n<html>\n<body>\n<%\n");
+	while (n--) {
+		statement(b, "", 1);
+	}
+	put(b, "%>\n<p><%= count %></p>\n</body>\n</html>\n");
+}
+
+/**
+ * Generate HTML with embedded JavaScript (beautified in strip mode).
+ *
+ * @param b generated file
+ */
+static void __stdcall genhtml(benchbuf *b) {
+	put(b, "<html>\n<head>\n<script type=\"text/javascript\">\n    function ");
+	ident(b, "");
+	put(b, "(count, name) {\n");
+	body(b, "");
+	put(b, "</script>\n</head>\n<body>\n    <p>  Generated   by busl_bench.  </p>\n</body>\n</html>\n");
+}
+
+/**
+ * Convert the line ends of a generated file to CRLF.
+ *
+ * @param b generated file
+ */
+static void __stdcall crlf(benchbuf *b) {
+	size_t len = b->len;
+	size_t lines = 0;
+	size_t i;
+	char *p;
+	for (i=0; i<len; ++i) {
+		lines += (b->p[i]=='\n');
+	}
+	while (b->len<len+lines) {
+		put(b, " "); /* make room */
+	}
+	p = &b->p[len+lines];
+	while (len--) {
+		*--p = b->p[len];
+		if (*p=='\n') {
+			*--p = '\r';
+		}
+	}
+}
+
+/** kinds of generated files, used in turn */
+static const benchkind kinds[] = {
+	{"c", "c", "--4nq", genc, "", 0},
+	{"c++", "cpp", "--4nq", gencpp, "} // namespace bench\n", 0},
+	{"java", "java", "--4nq", genjava, "", 0},
+	{"javascript", "js", "--4nq", genjs, "", 0},
+	{"php", "php", "--4nq", genphp, "", 0},
+	{"jsp", "jsp", "--4nq", genjsp, "", 0},
+	{"strip", "html", "--4nqs", genhtml, "", 0},
+	{"crlf", "c", "--4nq", genc, "", CRLF},
+	{"ctrl-z", "c", "--4nq", genc, "", CTRLZ}
+};
+
+/** number of kinds of generated files */
+#define KINDS ((int) (sizeof(kinds)/sizeof(kinds[0])))
+
+/**
+ * Current time.
+ *
+ * @return time in seconds, from an arbitrary start
+ */
+static double __stdcall now(void) {
+#if defined(_WIN32) || defined(_WIN64)
+	LARGE_INTEGER count;
+	LARGE_INTEGER freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double) count.QuadPart/(double) freq.QuadPart;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return (double) tv.tv_sec+tv.tv_usec/1e6;
+#endif
+}
+
+/**
+ * Compare latencies, for qsort().
+ *
+ * @param a latency
+ * @param b latency
+ * @return <0, 0 or >0
+ */
+static int cmptime(const void *a, const void *b) {
+	double d = *(const double *) a-*(const double *) b;
+	return (d<0)? -1: (d>0);
+}
+
+/**
+ * Read a file completely.
+ *
+ * @param name filename
+ * @param len receives the number of characters
+ * @return allocated contents, 0 if it cannot be read
+ */
+static char *__stdcall readfile(const char *name, size_t *len) {
+	FILE *f = fopen(name, "rb");
+	char *p = 0;
+	long size;
+	if (f) {
+		if (!fseek(f, 0, SEEK_END) && ((size = ftell(f))>=0) && !fseek(f, 0, SEEK_SET)
+				&& ((p = (char *) malloc((size_t) size+1))!=0)) {
+			*len = fread(p, 1, (size_t) size, f);
+		}
+		fclose(f);
+	}
+	return p;
+}
+
+/**
+ * Generate the corpus.
+ *
+ * @param dir directory, created if needed
+ * @param total size of the corpus in bytes
+ * @param seed seed of the random generator
+ * @param count receives the number of files
+ * @return the files, 0 when something failed
+ */
+static benchfile *__stdcall generate(const char *dir, size_t total, unsigned long seed, int *count) {
+	benchbuf b;
+	benchfile *file = 0;
+	size_t size = 0;
+	int n = 0;
+	memset(&b, 0, sizeof(b));
+	b.seed = seed;
+	mkdir(dir, 0777);
+	while (size<total) {
+		const benchkind *kind = &kinds[n%KINDS];
+		benchfile *f;
+		size_t target = (size_t) 1024<<rnd(&b, 9); /* 1 KB ... 512 KB, mostly small */
+		size_t i;
+		FILE *out;
+		if (!(n%64)) {
+			if (!(f = (benchfile *) realloc(file, (n+64)*sizeof(benchfile)))) {
+				free(file);
+				free(b.p);
+				return 0;
+			}
+			file = f;
+		}
+		f = &file[n++];
+		target += rnd(&b, (unsigned long) target);
+		b.len = 0;
+		while (b.len<target) {
+			kind->gen(&b);
+		}
+		put(&b, kind->tail);
+		if (kind->extra&CRLF) {
+			crlf(&b);
+		}
+		if (kind->extra&CTRLZ) {
+			/* <CTRL>-Z, followed by data which must be kept as-is */
+			size_t start = b.len+1;
+			put(&b, "\032");
+			while (b.len<start+256) {
+				put(&b, " ");
+			}
+			for (i=0; i<256; ++i) {
+				b.p[start+i] = (char) i;
+			}
+		}
+		sprintf(f->name, "%.40s/%s%d.%s", dir, kind->name, n, kind->ext);
+		f->kind = kind;
+		f->size = b.len;
+		f->lines = 0;
+		for (i=0; i<b.len; ++i) {
+			f->lines += (b.p[i]=='\n');
+		}
+		if (!(out = fopen(f->name, "wb")) || (fwrite(b.p, 1, b.len, out)!=b.len) || fclose(out)) {
+			fprintf(stderr, "busl_bench: %s: cannot be written\n", f->name);
+			free(b.p);
+			free(file);
+			return 0;
+		}
+		size += b.len;
+	}
+	free(b.p);
+	*count = n;
+	return file;
+}
+
+/**
+ * Beautify all files once, and report the throughput and latencies.
+ *
+ * @param s BUSL status
+ * @param file generated files
+ * @param count number of files
+ * @param title name of the pass, used in the report
+ * @param changed receives the number of files reported as changed
+ */
+static void __stdcall pass(Busl *s, benchfile *file, int count, const char *title, int *changed) {
+	double *time = (double *) malloc(count*sizeof(double));
+	double elapsed = 0;
+	double bytes = 0;
+	double lines = 0;
+	int i;
+	*changed = 0;
+	for (i=0; i<count; ++i) {
+		double start;
+		int flags;
+		busl_beautify(s, file[i].kind->options);
+		start = now();
+		flags = busl_beautify(s, file[i].name);
+		start = now()-start;
+		if (time) time[i] = start;
+		elapsed += start;
+		bytes += (double) file[i].size;
+		lines += (double) file[i].lines;
+		file[i].flags = flags;
+		if (flags&CHANGED) {
+			++*changed;
+		}
+	}
+	if (elapsed<=0) {
+		elapsed = 1e-9;
+	}
+	printf("%-10s %9.1f %11.0f", title, bytes/elapsed/(1024*1024), lines/elapsed);
+	if (time) {
+		qsort(time, count, sizeof(double), cmptime);
+		printf(" %9.3f %9.3f %9.3f %9.3f", 1e3*time[count/2], 1e3*time[count*9/10], 1e3*time[count*99/100], 1e3*time[count-1]);
+		free(time);
+	}
+	printf(" %8d\n", *changed);
+}
+
+/** pathological inputs, which must all be beautified in linear time */
+static const benchcase cases[] = {
+	{"long line", "adv.c", "--4q", "", "value = count+index*2; ", 0, "", "", "\n"},
+	{"ternaries", "adv.c", "--4q", "", "a ? b : ", 0, "", "", "c;\n"},
+	{"colons", "adv.c", "--4q", "", "a b: ", 0, "", "", "c;\n"},
+	{"keywords", "adv.c", "--4q", "", "if(x) y; else do z; while(x); ", 1000, "\n", "", ""},
+	{"nesting", "adv.c", "--0q", "", "while (x) {\n", 0, "", "}\n", ""},
+	{"parentheses", "adv.c", "--0q", "x = ", "(", 0, "", ")", ";\n"},
+	{"comment", "adv.c", "--4q", "/*\n", " * a huge comment, with some words in it\n", 0, "", "", " */\n"},
+	{"script", "adv.html", "--4qs", "<html>\n", "<script>// x</script>", 0, "", "", "\n</html>\n"}
+};
+
+/**
+ * Generate a pathological input.
+ *
+ * @param b receives the input
+ * @param c pathological input
+ * @param size approximate size in bytes
+ */
+static void __stdcall genadversarial(benchbuf *b, const benchcase *c, size_t size) {
+	size_t units = 0;
+	b->len = 0;
+	put(b, c->head);
+	while (b->len+units*strlen(c->close)<size) {
+		put(b, c->unit);
+		if (c->perline && !(++units%c->perline)) {
+			put(b, c->lineend);
+		} else if (!c->perline) {
+			++units;
+		}
+	}
+	if (c->perline) {
+		put(b, c->lineend);
+	}
+	while (*c->close && units--) {
+		put(b, c->close);
+	}
+	put(b, c->tail);
+}
+
+/**
+ * Beautify a pathological input in memory, the best of three tries.
+ *
+ * @param s BUSL status
+ * @param c pathological input
+ * @param b input
+ * @return time in seconds
+ */
+static double __stdcall timeadversarial(Busl *s, const benchcase *c, const benchbuf *b) {
+	double best = 0;
+	int i;
+	for (i=0; i<3; ++i) {
+		char messages[1];
+		size_t messageslen = sizeof(messages);
+		size_t outputlen = 0;
+		double start;
+		busl_beautify(s, c->options);
+		start = now();
+		busl_beautify_buffer(s, c->filename, b->p, b->len, 0, &outputlen, messages, &messageslen);
+		start = now()-start;
+		if (!i || (start<best)) {
+			best = start;
+		}
+	}
+	return best;
+}
+
+/**
+ * Beautify each pathological input of two sizes, and check that the time
+ * needed grows linearly with the size.
+ *
+ * @param s BUSL status
+ * @param size size of the smaller inputs in bytes
+ * @return number of inputs which are not beautified in linear time
+ */
+static int __stdcall adversarial(Busl *s, size_t size) {
+	benchbuf b;
+	int failed = 0;
+	int i;
+	memset(&b, 0, sizeof(b));
+	printf("%-12s %9s %9s %9s %7s\n", "input", "size MB", "ms", "2x ms", "ratio");
+	for (i=0; i<(int) (sizeof(cases)/sizeof(cases[0])); ++i) {
+		double t1;
+		double t2;
+		double ratio;
+		genadversarial(&b, &cases[i], size);
+		t1 = timeadversarial(s, &cases[i], &b);
+		genadversarial(&b, &cases[i], 2*size);
+		t2 = timeadversarial(s, &cases[i], &b);
+		ratio = (t1>0)? t2/t1: 0;
+		printf("%-12s %9.2f %9.3f %9.3f %7.2f%s\n", cases[i].name, (double) size/(1024*1024), 1e3*t1, 1e3*t2, ratio, (ratio>MAXRATIO)? " NOT LINEAR": "");
+		failed += (ratio>MAXRATIO);
+	}
+	free(b.p);
+	return failed;
+}
+
+static void __stdcall wrt(void *data, const char *str) {
+	fprintf((FILE *) data, "%s", str);
+}
+
+/**
+ * Parse a size in MB given on the command line.
+ *
+ * @param arg command line argument
+ * @param mb receives the size
+ * @return 1 when it is a positive number
+ */
+static int __stdcall sizearg(const char *arg, double *mb) {
+	char *end;
+	*mb = strtod(arg, &end);
+	return (end!=arg) && !*end && (*mb>0);
+}
+
+/**
+ * Parse a seed given on the command line.
+ *
+ * @param arg command line argument
+ * @param seed receives the seed
+ * @return 1 when it is a decimal number
+ */
+static int __stdcall seedarg(const char *arg, unsigned long *seed) {
+	char *end;
+	*seed = strtoul(arg, &end, 10);
+	return (*arg>='0') && (*arg<='9') && !*end;
+}
+
+/**
+ * Main function of the benchmark:
+ * busl_bench [<directory> [<size in MB> [<seed>]]]
+ * busl_bench -a [<size in MB>] (pathological inputs only)
+ *
+ * @param argc number of command line arguments
+ * @param argv command line arguments
+ * @return 0 when the second pass found all files unchanged, or when all
+ * pathological inputs are beautified in linear time
+ */
+int main(int argc, char *argv[]) {
+	const char *dir = (argc>1)? argv[1]: "busl_bench.dir";
+	double mb = DEFAULTSIZE;
+	unsigned long seed = DEFAULTSEED;
+	benchfile *file;
+	double bytes = 0;
+	unsigned long lines = 0;
+	int count;
+	int changed;
+	int failed = 0;
+	char **first;
+	int i;
+	Busl s;
+
+	if ((argc>1) && !strcmp(argv[1], "-a")) {
+		mb = ADVERSARIALSIZE;
+		if ((argc>3) || ((argc>2) && !sizearg(argv[2], &mb))) {
+			fprintf(stderr, "usage: %s -a [<size in MB>]\n", *argv);
+			return EXIT_FAILURE;
+		}
+		busl_create(&s, wrt, (void *) stderr);
+		failed = adversarial(&s, (size_t) (mb*1024*1024));
+		busl_finish(&s, CHANGED);
+		return failed? EXIT_FAILURE: EXIT_SUCCESS;
+	}
+	/* options are not accepted as directory, e.g. "-h" */
+	if ((argc>4) || ((argc>1) && (*dir=='-')) || ((argc>2) && !sizearg(argv[2], &mb))
+			|| ((argc>3) && !seedarg(argv[3], &seed))
+			|| !(file = generate(dir, (size_t) (mb*1024*1024), seed, &count))) {
+		fprintf(stderr, "usage: %s [<directory> [<size in MB> [<seed>]]]\n       %s -a [<size in MB>]\n", *argv, *argv);
+		return EXIT_FAILURE;
+	}
+	for (i=0; i<count; ++i) {
+		bytes += (double) file[i].size;
+		lines += file[i].lines;
+	}
+	printf("%d files, %.1f MB, %lu lines in %s (seed %lu)\n\n", count, bytes/(1024*1024), lines, dir, seed);
+	printf("%-10s %9s %11s %9s %9s %9s %9s %8s\n", "pass", "MB/s", "lines/s", "p50 ms", "p90 ms", "p99 ms", "max ms", "changed");
+	busl_create(&s, wrt, (void *) stderr);
+	s.result = EXIT_SUCCESS; /* no copyright message */
+
+	/* first pass: the generated files are badly indented */
+	pass(&s, file, count, "beautify", &changed);
+
+	/* second pass: everything is beautified already, nothing may change */
+	first = (char **) calloc(count, sizeof(char *));
+	for (i=0; first && (i<count); ++i) {
+		size_t len = 0;
+		first[i] = readfile(file[i].name, &len);
+		file[i].size = len;
+	}
+	pass(&s, file, count, "clean", &changed);
+	printf("\n");
+	for (i=0; i<count; ++i) {
+		size_t len = 0;
+		char *second = readfile(file[i].name, &len);
+		if (!first || !first[i] || !second || (len!=file[i].size) || memcmp(first[i], second, len)) {
+			printf("%s: differs after the second pass\n", file[i].name);
+			++failed;
+		} else if ((file[i].flags&CHANGED) && !strchr(file[i].kind->options, 's')) {
+			/* in strip mode files are always written, so only the contents count */
+			printf("%s: reported as changed in the second pass\n", file[i].name);
+			++failed;
+		}
+		if (first) free(first[i]);
+		free(second);
+	}
+	free(first);
+	printf("idempotency: %s\n", failed? "FAILED": "ok");
+	busl_finish(&s, CHANGED);
+	free(file);
+	return failed? EXIT_FAILURE: EXIT_SUCCESS;
+}
@@ -49,13 +49,15 @@ static void __stdcall wrt(void *output, const char *str) {
 	if (d && d->obj) {
 		JNIEnv *env = d->env;
 		jobject obj = d->obj;
-		char ba[BUFSIZE];
-		jsize size;
-		jbyteArray a;
-		sprintf(ba, "%s", str);
-		size = (jint) strlen(ba);
-		a = (*env)->NewByteArray(env, size);
-		(*env)->SetByteArrayRegion(env, a, 0, size, (jbyte *) ba);
+		/* messages can be longer than any fixed buffer, so copy str directly */
+		jsize size = (jsize) strlen(str);
+		jbyteArray a = (*env)->NewByteArray(env, size);
+		if (!a) {
+			/* OutOfMemoryError is pending, like other exceptions below */
+			d->obj = 0;
+			return;
+		}
+		(*env)->SetByteArrayRegion(env, a, 0, size, (const jbyte *) str);
 		if (!d->mid) {
 			/* First call of myprintf. Get output object */
 			jfieldID fid = (*env)->GetFieldID(env, d->cls, OUTPUTFIELD, OUTPUTTYPE);
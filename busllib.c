@@ -2,9 +2,12 @@
  * Beautifier application for Universal Set of Languages.
  */
 
+/** version, also in CACHEHEADER and OUTPUTHEADER */
+#define BUSLVERSION "0.92"
+
 /** Copyright message */
 static const char COPYRIGHT[] =
-"BUSL version 0.91: Beautifier for Universal Set of Languages.\n\
+"BUSL version " BUSLVERSION ": Beautifier for Universal Set of Languages.\n\
 Copyright (c) 2003-2009, Jan Nijtmans. All rights reserved.\n";
 
 /* This program is free software: you can redistribute it and/or modify
@@ -21,44 +24,173 @@ Copyright (c) 2003-2009, Jan Nijtmans. All rights reserved.\n";
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#if !defined(_DOS) && !defined(_WIN16) && !defined(_WIN32) && !defined(_WIN64) && !defined(_GNU_SOURCE)
+/* Without this, glibc doesn't declare fileno() and friends with -std=c89, c99 or c11 */
+#   define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #if defined(_DOS) || defined(_WIN16)
 #   define usleep(us) /* Dont't bother to implement this on DOS or Win16 */
+#   define getpid() 0
 #   include <io.h>
+#   include <fcntl.h>
 #   define unlink _unlink
 #elif defined(_WIN32) || defined(_WIN64)
-/* Don't include <windows.h> just for this single function */
+/* Don't include <windows.h> just for these few functions */
 extern __declspec(dllimport) void __stdcall Sleep(unsigned long int ms);
+extern __declspec(dllimport) void *__stdcall CreateThread(void *attr, size_t stacksize, unsigned long (__stdcall *proc)(void *), void *arg, unsigned long int flags, unsigned long int *id);
+extern __declspec(dllimport) unsigned long int __stdcall WaitForSingleObject(void *handle, unsigned long int ms);
+extern __declspec(dllimport) int __stdcall CloseHandle(void *handle);
+#   if defined(_MSC_VER)
+long __cdecl _InterlockedExchange(long volatile *target, long value);
+#       pragma intrinsic(_InterlockedExchange)
+#   else
+#       define _InterlockedExchange(target, value) __sync_lock_test_and_set(target, value)
+#   endif
 #   define usleep(us) Sleep(us/1000)
 #   include <io.h>
+#   include <fcntl.h>
+#   include <process.h>
+#   define getpid _getpid
+#   define HAVE_THREADS
 #else
 #   include <unistd.h>
+#   include <dirent.h>
+#   if defined(_POSIX_MAPPED_FILES) && (_POSIX_MAPPED_FILES>0)
+#       include <sys/mman.h>
+#       define HAVE_MMAP
+#   endif
+#   if defined(_POSIX_THREADS) && (_POSIX_THREADS>0)
+#       include <pthread.h>
+#       define HAVE_THREADS
+#   endif
+#   if defined(__linux__) && defined(_GNU_SOURCE)
+/* syscall() and loff_t are GNU extensions, without them copyfile() uses stdio */
+#       include <sys/ioctl.h>
+#       include <sys/syscall.h>
+#       include <linux/fs.h>
+#       if defined(__NR_copy_file_range)
+#           define HAVE_COPYRANGE
+#       endif
+#   endif
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && (_M_IX86_FP>=2))
+#   include <emmintrin.h>
+#   define HAVE_SSE2
+#endif
+
+#if defined(_DOS) || defined(_WIN16) || defined(_WIN32) || defined(_WIN64)
+/* text files have CRLF line ends, see writefile() */
+#   define HAVE_CRLF
+#endif
+
+#ifndef S_ISDIR
+#   define S_ISDIR(mode) (((mode)&S_IFMT)==S_IFDIR)
+#endif
+#ifndef S_ISLNK
+/* no symbolic links, so lstat() may not exist either */
+#   define lstat stat
 #endif
 
 #include "busl.h"
 
+/** size of input blocks, when the input cannot be read at once */
+#define BLOCKSIZE 16384
+
+/** room in the line buffers for the characters added while handling a single input character */
+#define LINEMARGIN 64
+
+/** room on the indent stack for the levels added while handling a single input character */
+#define STACKMARGIN 4
+
+static const char BUFFERNAME[] = "<buffer>";
+static const char STDINNAME[] = "<stdin>";
+/** file remembering which files were clean, see the "c" option */
+static const char CACHENAME[] = ".buslcache";
+/** first line of CACHENAME: a cache of another version is not used */
+static const char CACHEHEADER[] = "BUSL " BUSLVERSION " cache\n";
 static const char ERRORMESSAGE[] = "Please correct this and try again. (beautified code stored in %s)\n";
 
-static const char SPACES[] = "\t ";
-static const char ISCOMMENTORXML[] = "<\n*+";
-static const char ISCOMMENT[] = "\n*+";
-static const char ISCCOMMENT[] = "*+";
-static const char ISGTORCTRLZ[] = "\032>";
-static const char BEFORETOKEN[] = "\t (),:;[]{}";
 static const char DIRSEPARATOR[] = "/:\\";
+
+/*
+ * Character classes, as bits in charclass[]. CHARCLASS(c, cls) is equivalent to
+ * strchr() with a string holding the characters of the class, so '\0' belongs
+ * to all classes.
+ */
+#define SPACES         0x00001L /* "\t " */
+#define ISCOMMENTORXML 0x00002L /* "<\n*+" */
+#define ISCOMMENT      0x00004L /* "\n*+" */
+#define ISCCOMMENT     0x00008L /* "*+" */
+#define ISGTORCTRLZ    0x00010L /* "\032>" */
+#define BEFORETOKEN    0x00020L /* "\t (),:;[]{}" */
+#define KEEPQUOTED     0x00040L /* "\"#%'/<?`": quoting modes in which strip mode keeps everything */
 /* Due to lack of fantasy, the symbols below don't have a proper name yet */
-static const char XXXX10[] = " ,:;"; /* stack */
-static const char XXXX11[] = " :;"; /* stack */
-static const char XXXX12[] = ":;"; /* stack */
-static const char XXXX13[] = " ;"; /* stack */
-static const char XXXX14[] = "(,:;=?[{"; /* buf */
-static const char XXXX15[] = "(,:;=[{"; /* buf */
-static const char XXXX16[] = "!(,:;<=>?[{~"; /* buf */
-static const char XXXX17[] = "%&*+-/^|~"; /* buf */
-static const char XXXX18[] = "!$(@[{~"; /* buf */
+#define XXXX10         0x00080L /* " ,:;" stack */
+#define XXXX11         0x00100L /* " :;" stack */
+#define XXXX12         0x00200L /* ":;" stack */
+#define XXXX13         0x00400L /* " ;" stack */
+#define XXXX14         0x00800L /* "(,:;=?[{" buf */
+#define XXXX15         0x01000L /* "(,:;=[{" buf */
+#define XXXX16         0x02000L /* "!(,:;<=>?[{~" buf */
+#define XXXX17         0x04000L /* "%&*+-/^|~" buf */
+#define XXXX18         0x08000L /* "!$(@[{~" buf */
+#define QUOTEDSTOP     0x10000L /* control characters and "\"'`\\>": not just copied in strings and comments */
+#define ALLCLASSES     0x1FFFFL
+
+#define IS2(c, a, b) ((c)==(a) || (c)==(b))
+#define IS4(c, a, b, d, e) (IS2(c, a, b) || IS2(c, d, e))
+
+/** the classes of character c, evaluated at compile time */
+#define CLASSOF(c) ((c)? ( \
+	(IS2(c, '\t', ' ')? SPACES: 0) | \
+	(IS4(c, '<', '\n', '*', '+')? ISCOMMENTORXML: 0) | \
+	(IS2(c, '\n', '*') || (c)=='+'? ISCOMMENT: 0) | \
+	(IS2(c, '*', '+')? ISCCOMMENT: 0) | \
+	(IS2(c, '\032', '>')? ISGTORCTRLZ: 0) | \
+	(IS4(c, '\t', ' ', '(', ')') || IS4(c, ',', ':', ';', '[') || IS2(c, ']', '{') || (c)=='}'? BEFORETOKEN: 0) | \
+	(IS4(c, '"', '#', '%', '\'') || IS4(c, '/', '<', '?', '`')? KEEPQUOTED: 0) | \
+	(IS4(c, ' ', ',', ':', ';')? XXXX10: 0) | \
+	(IS2(c, ' ', ':') || (c)==';'? XXXX11: 0) | \
+	(IS2(c, ':', ';')? XXXX12: 0) | \
+	(IS2(c, ' ', ';')? XXXX13: 0) | \
+	(IS4(c, '(', ',', ':', ';') || IS4(c, '=', '?', '[', '{')? XXXX14: 0) | \
+	(IS4(c, '(', ',', ':', ';') || IS2(c, '=', '[') || (c)=='{'? XXXX15: 0) | \
+	(IS4(c, '!', '(', ',', ':') || IS4(c, ';', '<', '=', '>') || IS4(c, '?', '[', '{', '~')? XXXX16: 0) | \
+	(IS4(c, '%', '&', '*', '+') || IS4(c, '-', '/', '^', '|') || (c)=='~'? XXXX17: 0) | \
+	(IS4(c, '!', '$', '(', '@') || IS2(c, '[', '{') || (c)=='~'? XXXX18: 0) | \
+	((c)<' ' || IS4(c, '"', '\'', '`', '\\') || (c)=='>'? QUOTEDSTOP: 0) \
+	): ALLCLASSES)
+
+#define CLASS4(c) CLASSOF(c), CLASSOF((c)+1), CLASSOF((c)+2), CLASSOF((c)+3)
+#define CLASS16(c) CLASS4(c), CLASS4((c)+4), CLASS4((c)+8), CLASS4((c)+12)
+#define CLASS64(c) CLASS16(c), CLASS16((c)+16), CLASS16((c)+32), CLASS16((c)+48)
+
+/** character classes of all characters, see CHARCLASS() */
+static const unsigned long charclass[256] = {
+	CLASS64(0), CLASS64(64), CLASS64(128), CLASS64(192)
+};
+
+/** Function inlined in its callers, see lexmode() */
+#if defined(_MSC_VER)
+#   define BUSL_INLINE __forceinline
+#elif defined(__GNUC__)
+#   define BUSL_INLINE __inline__ __attribute__((always_inline))
+#else
+#   define BUSL_INLINE
+#endif
+
+/** Check if character c belongs to one of the character classes cls */
+#define CHARCLASS(c, cls) (charclass[(unsigned char) (c)]&(cls))
 
 /** begin &lt;script&gt; tag name */
 static const char scripttag[] = "<script";
@@ -102,23 +234,82 @@ static int __stdcall checkext(const char *ext, const char *const *table, int siz
 	return q>=table;
 }
 
+/** Key words recognized by lastkey() */
+enum {
+	KEYNONE, KEYIF, KEYDO, KEYFOR, KEYELSE, KEYDONE, KEYEXEC, KEYWHILE, KEYELSEIF, KEYDEFAULT
+};
+
+/** length of the longest key word, "default" */
+#define MAXKEYLEN 7
+
+/**
+ * Determine which key word the output buffer ends with, if any. Only the last
+ * MAXKEYLEN+1 characters are looked at, and the key word is selected by its
+ * length and first character, so this takes the same time for every token.
+ *
+ * @param Busl BUSL status
+ * @return KEYIF ... KEYDEFAULT, KEYNONE when the last token is no key word
+ */
+static int __stdcall lastkey(const Busl *s) {
+	const char *p;
+	int pos = s->outpos;
+	while ((pos>0) && !CHARCLASS(s->outbuf[pos-1], BEFORETOKEN)) {
+		if (s->outpos-(--pos)>MAXKEYLEN) {
+			return KEYNONE;
+		}
+	}
+	p = &s->outbuf[pos];
+	switch (s->outpos-pos) {
+		case 2:
+			return !memcmp(p, "if", 2)? KEYIF: !memcmp(p, "do", 2)? KEYDO: KEYNONE;
+		case 3:
+			return !memcmp(p, "for", 3)? KEYFOR: KEYNONE;
+		case 4:
+			switch (*p) {
+				case 'e': return !memcmp(p, "else", 4)? KEYELSE: KEYNONE;
+				case 'd': return !memcmp(p, "done", 4)? KEYDONE: KEYNONE;
+				case 'E': return !memcmp(p, "EXEC", 4)? KEYEXEC: KEYNONE;
+			}
+			break;
+		case 5:
+			return !memcmp(p, "while", 5)? KEYWHILE: KEYNONE;
+		case 6:
+			return !memcmp(p, "elseif", 6)? KEYELSEIF: KEYNONE;
+		case 7:
+			return !memcmp(p, "default", 7)? KEYDEFAULT: KEYNONE;
+	}
+	return KEYNONE;
+}
+
 /**
- * Check if the output buffer contains some key word
+ * Check if the input line contains "//" followed by "-->", which ends a script
+ * in html. Characters are only appended to the input line, so each call
+ * continues where the previous one stopped. Like strstr(), the check ends at
+ * a NUL character.
  *
  * @param Busl BUSL status
- * @param key key word
  * @return 1 when found, 0 when not
  */
-static int __stdcall checkkey(const Busl *s, const char *key) {
-	const char *begin = &s->outbuf[s->outpos-strlen(key)];
-	if ((begin<s->outbuf) || ((begin>s->outbuf) && !strchr(BEFORETOKEN, begin[-1]))) {
-		return 0;
+static int __stdcall commentend(Busl *s) {
+	const char *p = s->inbuf;
+	int pos = (s->slashscan>2)? s->slashscan-2: 0;
+	for (; (s->slashpos>=0) && (pos<s->inpos); ++pos) {
+		if (!p[pos]) {
+			s->slashscan = INT_MAX;
+			return 0;
+		}
+		if (!s->slashpos) {
+			if ((pos+1<s->inpos) && (p[pos]=='/') && (p[pos+1]=='/')) {
+				s->slashpos = pos+2;
+			}
+		} else if ((pos>=s->slashpos) && (pos+2<s->inpos) && !memcmp(&p[pos], "-->", 3)) {
+			s->slashpos = -1; /* found */
+		}
 	}
-	while (*key && (*begin==*key)) {
-		begin++;
-		key++;
+	if (pos>s->slashscan) {
+		s->slashscan = pos;
 	}
-	return !*key;
+	return s->slashpos<0;
 }
 
 /**
@@ -137,6 +328,135 @@ static void __stdcall removefile(Busl *s, const char *filename) {
 	}
 }
 
+/** input lines between two checkpoints, see busl_beautify_range() */
+#define CHECKPOINTLINES 64
+
+/**
+ * State of the lexer at the start of an input line, where nothing of the line is
+ * read yet. Beautifying can be resumed from here.
+ */
+typedef struct buslcheckpoint {
+	/** offset of the line in the (converted) input */
+	size_t offset;
+	/** input line number, the first line is 1 */
+	int line;
+	/** Busl.linenum */
+	int linenum;
+	/** Busl.flags, without CHANGED */
+	int flags;
+	/** Busl.indent */
+	int indent;
+	/** Busl.curindent */
+	int curindent;
+	/** Busl.numstrip */
+	int numstrip;
+	/** Busl.quoted */
+	char quoted;
+	/** Busl.commentquoted */
+	char commentquoted;
+	/** Busl.cmdtype */
+	char cmdtype;
+	/** index of Busl.indentstack[0..indent) in buslstates.stack */
+	size_t stack;
+} buslcheckpoint;
+
+/**
+ * The checkpoints of one run over an input.
+ */
+typedef struct buslstates {
+	/** checkpoints, in input order */
+	buslcheckpoint *cp;
+	/** number of checkpoints */
+	long count;
+	/** number of allocated checkpoints */
+	long size;
+	/** indent stacks of the checkpoints */
+	char *stack;
+	/** used length of stack */
+	size_t stacklen;
+	/** size of stack memory */
+	size_t stacksize;
+	/** state at the end of the input, when hasend is set */
+	buslcheckpoint end;
+	/** 1 when the end of the input is reached */
+	int hasend;
+	/** copy of the (converted) input */
+	char *input;
+	/** length of input */
+	size_t inputlen;
+} buslstates;
+
+/**
+ * Checkpoints kept by busl_beautify_range() for the next call, and the range
+ * being beautified.
+ */
+typedef struct buslcheckpoints {
+	/** filename the checkpoints belong to */
+	char *filename;
+	/** defaultflags the checkpoints belong to */
+	int defaultflags;
+	/** number of spaces used for indenting the checkpoints belong to */
+	int tabs;
+	/** checkpoints of the previous call */
+	buslstates old;
+	/** checkpoints of the current call */
+	buslstates now;
+	/** 1 while busl_beautify_range() is beautifying */
+	int running;
+	/** 1 while the output is written */
+	int active;
+	/** 1 while checking the end of the input: messages are always given */
+	int atend;
+	/** first line asked for */
+	int first;
+	/** last line asked for */
+	int last;
+	/** first line beautified: the last line start before first where the state is known */
+	int from;
+	/** last line beautified (0 while not known yet) */
+	int to;
+	/** input line number at offset counted */
+	int line;
+	/** offset up to which the lines are counted */
+	size_t counted;
+	/** line of the last checkpoint recorded */
+	int recorded;
+	/** the old input from this offset on is the same as the end of the new input */
+	size_t same;
+	/** next old checkpoint to be compared */
+	long next;
+	/** CHANGED when the beautified lines differ */
+	int changed;
+	/** for lexparallel(): beautify up to the first line start from this offset */
+	size_t stop;
+} buslcheckpoints;
+
+/**
+ * Check if a message is to be given: while busl_beautify_range() is running, only
+ * messages about the lines asked for and about the end of the input are given.
+ *
+ * @param Busl BUSL status
+ * @return 1 when the message is to be given
+ */
+static int __stdcall inrange(const Busl *s) {
+	const buslcheckpoints *r = s->checkpoints;
+	const char *p;
+	const char *end;
+	int line;
+	if (!r->running || r->atend) {
+		return 1;
+	}
+	/* count the lines up to the last character read */
+	p = &s->inbase[r->counted];
+	end = s->inptr-1;
+	line = r->line;
+	while ((p<end) && ((p = (const char *) memchr(p, '\n', end-p))!=0)) {
+		++p;
+		++line;
+	}
+	return (line>=r->first) && (line<=r->last);
+}
+
 /**
  * Generate a warning message
  *
@@ -149,10 +469,16 @@ static void __stdcall removefile(Busl *s, const char *filename) {
 static int __stdcall warning(Busl *s, const char *format, const char *msg, int linenum, char c) {
 	char *p = strchr(format, ':');
 	char buffer[BUFSIZE];
+	char *buf = buffer;
+	size_t len = strlen(format)+strlen(msg)+64;
+	if (s->checkpoints && !inrange(s)) {
+		return s->flags;
+	}
 	if (s->result < 0) {
 		s->result = EXIT_SUCCESS;
 		s->wrt(s->output, COPYRIGHT);
 	}
+	++s->msgcount;
 	if (p) {
 		if (!memcmp(p, ": WARNING", 9)) {
 			if (s->result==EXIT_SUCCESS) s->result = 2*EXIT_FAILURE;
@@ -161,770 +487,1903 @@ static int __stdcall warning(Busl *s, const char *format, const char *msg, int l
 		}
 	}
 
+	if ((len>sizeof(buffer)) && !(buf = (char *) malloc(len))) {
+		/* message containing a very long line, and no memory for it */
+		s->wrt(s->output, format);
+		return s->flags;
+	}
 	if (linenum>0) {
-		sprintf(buffer, format, msg, linenum, (int) s->outpos, c);
+		sprintf(buf, format, msg, linenum, (int) s->outpos, c);
 	} else {
-		sprintf(buffer, format, msg, c);
+		sprintf(buf, format, msg, c);
+	}
+	s->wrt(s->output, buf);
+	if (buf!=buffer) {
+		free(buf);
 	}
-	s->wrt(s->output, buffer);
 	return s->flags;
 }
 
 /**
- * Insert as many tabs/spaces in the line buffer as the indent level indicates
+ * Make the line buffers larger. They grow geometrically and are kept for the
+ * following lines and files, so normally they are allocated only once.
  *
  * @param Busl BUSL status
+ * @param needed minimum size needed
+ * @return 0 when out of memory
  */
-static void __stdcall writeindent(Busl *s) {
-	int count;
-	if (!(s->flags&STRIPMODE)) {
-		if (s->tabs>=0) {
-			/* use spaces for indenting */
-			count = s->tabs*s->indent;
-			while (count--) {
-				s->outbuf[s->outpos++] = ' ';
-			}
-		} else {
-			/* use tabs for indenting */
-			count = s->indent;
-			while (count--) {
-				s->outbuf[s->outpos++] = '\t';
-			}
+static int __stdcall growbuffers(Busl *s, int needed) {
+	int size = s->bufsize? s->bufsize: BUFSIZE;
+	char *p;
+	while (size<needed) {
+		if (size>INT_MAX/2) {
+			return 0;
 		}
+		size *= 2;
+	}
+	p = (char *) realloc(s->inbuf, size);
+	if (!p) {
+		return 0;
 	}
+	s->inbuf = p;
+	p = (char *) realloc(s->outbuf, size);
+	if (!p) {
+		return 0;
+	}
+	s->outbuf = p;
+	s->bufsize = size;
+	return 1;
 }
 
 /**
- * Write a single char to output. If the line is not within comment or quotes, indenting
- * is applied. If there are more than a single unclosed opening bracket in the line, then
- * the line is split into multiple lines. In addition, the written output line is compared
- * with the input line. If they are different the flag CHANGED is set.
+ * Use the indent stack inside the BUSL status, releasing a larger one if allocated.
  *
  * @param Busl BUSL status
- * @param c character to be written
- * @param fout FILE to be written
  */
-static void __stdcall writechar(Busl *s, int c, FILE *fout) {
-	if (c=='\n') {
-		int begwrite = 0;
-		int saveindent = s->indent;
-		int endwrite;
-		++s->linenum;
-		s->outbuf[s->outpos++] = (char) c;
-		if (!(s->flags&STRIPMODE)) {
-			if (*s->outbuf == '#' && s->tabs) {
-				/* If line starts with #region or #endregion, indent it normally. */
-				const char *p = s->outbuf;
-				if (!memcmp(++p, "end", 3)) {
-					p += 3;
-				}
-				if (!memcmp(p, "region", 6)) {
-					int indent = (s->tabs>0)? s->tabs*saveindent: saveindent;
-					memmove(&s->outbuf[indent], s->outbuf, s->outpos);
-					memset(s->outbuf, (s->tabs>0)? ' ': '\t', indent);
-					s->outpos += indent;
-				}
-			}
-			while (s->curindent<saveindent-1) {
-				/* There are to many unclosed opening brackets on this line,
-				 * so this line must be split */
-				int saveoutpos = s->outpos;
-				int splitoutpos;
-				if (strchr(XXXX10, s->indentstack[s->curindent++])) {
-					continue;
-				}
-				s->indent = s->curindent;
-				splitoutpos = endwrite = s->indentpos[s->indent];
-				s->flags |= CHANGED;
-				while (endwrite>0 && strchr(SPACES, s->outbuf[endwrite-1]))
-					--endwrite;
-				if (fout) {
-					fwrite(&s->outbuf[begwrite], 1, endwrite-begwrite, fout);
-					if (s->defaultflags&MACCRMODE) {
-						fwrite("\r", 1, 1, fout);
-						if (s->defaultflags&UNIXLFMODE) {
-							fwrite("\n", 1, 1, fout);
-						}
-					} else {
-						fwrite("\n", 1, 1, fout);
-					}
-				}
-				begwrite = splitoutpos;
-				++s->linenum;
-				writeindent(s);
-				if (fout) {
-					fwrite(&s->outbuf[saveoutpos], 1, s->outpos-saveoutpos, fout);
-				}
-				s->outpos = saveoutpos;
-			}
-		}
-		s->curindent = s->indent = saveindent;
-		if ((!(s->flags&STRIPMODE)) || (s->outpos>1) || !strchr(ISCOMMENT, s->quoted)) {
-			if (!(s->flags&CHANGED) && ((s->outpos!=s->inpos) || memcmp(s->outbuf, s->inbuf, s->outpos))) {
-				s->flags |= CHANGED;
-			}
-			if ((s->defaultflags&MACCRMODE) && s->outpos) {
-				s->outbuf[s->outpos-1] = '\r';
-				if (s->defaultflags&UNIXLFMODE) {
-					s->outbuf[s->outpos++] = (char) c;
-				}
-			}
-			if (fout) {
-				fwrite(&s->outbuf[begwrite], 1, s->outpos-begwrite, fout);
-			}
-		} else {
-			s->flags |= CHANGED;
+static void __stdcall resetstack(Busl *s) {
+	if (s->indentstack!=s->stacktype) {
+		free(s->indentpos);
+		free(s->indentstack);
+		free(s->indentflags);
+	}
+	s->indentpos = s->stackpos;
+	s->indentstack = s->stacktype;
+	s->indentflags = s->stackflags;
+	s->stacksize = STACKSIZE;
+}
+
+/**
+ * Make sure the indent stack has room for handling the next input character.
+ * It starts inside the BUSL status, and is moved to allocated memory which
+ * doubles in size when the nesting gets deeper.
+ *
+ * @param Busl BUSL status
+ * @return 0 when out of memory
+ */
+static int __stdcall stackspace(Busl *s) {
+	int size = s->stacksize;
+	int *pos, *flags;
+	char *type;
+	if (s->indent+STACKMARGIN<size) {
+		return 1;
+	}
+	if (size>INT_MAX/2/(int) sizeof(int)) {
+		return 0;
+	}
+	size *= 2;
+	if (s->indentstack==s->stacktype) {
+		pos = (int *) malloc(size*sizeof(int));
+		type = (char *) malloc(size);
+		flags = (int *) malloc(size*sizeof(int));
+		if (!pos || !type || !flags) {
+			free(pos);
+			free(type);
+			free(flags);
+			return 0;
 		}
-		s->outpos = s->inpos = 0;
+		memcpy(pos, s->stackpos, sizeof(s->stackpos));
+		memcpy(type, s->stacktype, sizeof(s->stacktype));
+		memcpy(flags, s->stackflags, sizeof(s->stackflags));
 	} else {
-		if ((!(s->flags&STRIPMODE)) || strchr("\"#%'/<?`", s->quoted)) {
-			if (!(s->outpos || (s->quoted && (s->quoted!='*') && (s->quoted!='+')))) {
-				writeindent(s);
-			}
-			s->outbuf[s->outpos++] = (char) c;
+		if (!(pos = (int *) realloc(s->indentpos, size*sizeof(int)))) {
+			return 0;
+		}
+		s->indentpos = pos;
+		if (!(type = (char *) realloc(s->indentstack, size))) {
+			return 0;
+		}
+		s->indentstack = type;
+		if (!(flags = (int *) realloc(s->indentflags, size*sizeof(int)))) {
+			return 0;
 		}
 	}
+	s->indentpos = pos;
+	s->indentstack = type;
+	s->indentflags = flags;
+	s->stacksize = size;
+	return 1;
 }
 
 /**
- * Beautify the given file. If the given filename does not exist, interpret the
- * characters as options.
- * During beautify a new file &lt;filename&gt;$ is written.
- * If there are no differences detected between input and output, the file
- * &lt;filename&gt;$ is removed.
- * If there are differences, then the file &lt;filename&gt; is copied to &lt;filename&gt;~
- * and &lt;filename&gt;$ is copied to &lt;filename&gt;. If this copy-operation fails (e.g. because)
- * &lt;filename&gt; is read-only, then a warning is given and &lt;filename&gt;$ is maintained.
+ * Make sure the line buffers have room for handling the next input character:
+ * a few characters and the indenting of a new line.
  *
  * @param Busl BUSL status
- * @param filename filename
+ * @return 0 when out of memory
  */
-int __stdcall busl_beautify(Busl *s, const char *filename) {
-	char dest[256];
-	char orig[256];
-	FILE *fin = 0;
-	FILE *fout = 0;
-	int c;
-	int savechar = '\n'; /* '\n' stands for empty */
-	char cmdtype = 0; /* stores type of XML processing command: '%', '#' or '?' */
-	const char *p = filename;
+static int __stdcall linespace(Busl *s) {
+	int needed = ((s->inpos>s->outpos)? s->inpos: s->outpos)+LINEMARGIN+((s->tabs>0)? s->tabs: 1)*(s->indent+2);
+	return (needed<=s->bufsize) || growbuffers(s, needed);
+}
 
-	/* If filename starts with @, read command line options from this file */
-	if (filename[0] == '@') {
-		fin = fopen(&filename[1], "r");
-		if (!fin) {
-			return warning(s, "%s: WARNING: file not found (ignored).\n", &filename[1], 0, 0);
-		}
-		c = 0;
-		while (fgets(orig, sizeof(orig)-1, fin)!=NULL) {
-			char *q = orig;
-			while (*q) ++q;
-			while (q>=&orig[1] && strchr(" \t\r\n", q[-1])) {
-				--q;
-			}
-			*q = '\0';
-			if (*orig && (*orig != '#')) {
-				c |= busl_beautify(s, orig);
-			}
-		}
-		fclose(fin);
-		return c;
+/**
+ * Output sink writing to the output file. Text files are written in binary
+ * mode everywhere: where text files have CRLF line ends (Busl.outcrlf), the
+ * line ends are converted here a line at a time, instead of character by
+ * character by the C library.
+ *
+ * @param data BUSL status
+ * @param buf characters to be written
+ * @param len number of characters
+ */
+static void __stdcall writefile(void *data, const char *buf, size_t len) {
+	Busl *s = (Busl *) data;
+#ifdef HAVE_CRLF
+	const char *lf;
+	while (s->outcrlf && ((lf = (const char *) memchr(buf, '\n', len))!=0)) {
+		fwrite(buf, 1, lf-buf, s->fout);
+		fwrite("\r\n", 1, 2, s->fout);
+		len -= (lf+1)-buf;
+		buf = lf+1;
 	}
-	/* If filename ends with slash, consider it as directory */
-	while (*p) ++p;
-	if (p>=&filename[2] && strchr(DIRSEPARATOR, p[-1])) {
-		s->outdir = (p>&filename[2] || *filename!='.')? filename: (const char *) 0;
-		return s->flags;
+#endif
+	fwrite(buf, 1, len, s->fout);
+}
+
+/**
+ * Open the output file. When this was postponed (see Busl.outname), the output
+ * so far is written as well, which is the same as the input so far.
+ *
+ * @param Busl BUSL status
+ * @param dest output filename
+ * @return 0 when the file cannot be opened
+ */
+static int __stdcall openoutput(Busl *s, const char *dest) {
+	s->outname = 0;
+	s->fout = fopen(dest, "wb");
+#ifdef HAVE_CRLF
+	s->outcrlf = !(s->defaultflags&(UNIXLFMODE|MACCRMODE));
+#endif
+	if (!s->fout) {
+		warning(s, "%s: ERROR: cannot open for writing.\n", dest, 0, 0);
+		return 0;
 	}
-	s->linenum = 1;
-	s->indent = s->inpos = s->outpos = 0;
-	s->indentflags[0] = 0;
-	fin = fopen(filename, "rb");
-	if (!fin) {
-		int savetabs = s->tabs;
-		int saveflags = s->defaultflags;
-		p = filename;
-		while (*p) {
-			char c = *p;
-			if (c >= 'A' && c <= 'Z')
-				c += 'a' - 'A';
-			if ((c>='0') && (c<='9')) {
-				s->tabs = c-'0';
-			} else if (c=='a') {
-				s->defaultflags |= AUTOMODE;
-			} else if (c=='f') {
-				s->defaultflags |= CHANGED;
-			} else if (c=='g') {
-				s->defaultflags &= ~(XMLMODE|AUTOMODE);
-			} else if (c=='l') {
-				s->defaultflags |= UNIXLFMODE;
-			} else if (c=='q') {
-				s->defaultflags |= QUIETMODE;
-			} else if (c=='r') {
-				s->defaultflags |= MACCRMODE;
-			} else if (c=='s') {
-				s->defaultflags |= STRIPMODE;
-			} else if (c=='t') {
-				s->defaultflags &= ~NOTESTMODE;
-			} else if (c=='x') {
-				s->defaultflags &= ~AUTOMODE;
-				s->defaultflags |= XMLMODE;
-			} else if (c=='z') {
-				s->defaultflags |= ZIPMODE;
-			} else if (c=='-') {
-				if ((p[1]>'0') && (p[1]<='9')) {
-					s->tabs = '0'-*(++p);
-				} else {
-					s->defaultflags &= ~(CHANGED|UNIXLFMODE|MACCRMODE|QUIETMODE|STRIPMODE|ZIPMODE);
-				}
-			} else {
-				s->tabs = savetabs;
-				s->defaultflags = saveflags;
-				return warning(s, "%s: WARNING: file not found or invalid option (ignored).\n", filename, 0, 0);
-			}
-			++p;
+	/* write lines in large blocks */
+	setvbuf(s->fout, 0, _IOFBF, BLOCKSIZE);
+	s->sink = writefile;
+	s->sinkdata = s;
+	if (s->outlen) {
+		writefile(s, s->inbase, s->outlen);
+	}
+	return 1;
+}
+
+/**
+ * Output sink writing to caller-owned memory (see busl_beautify_buffer()).
+ * Characters which don't fit are dropped, they are still counted in
+ * Busl.outlen.
+ *
+ * @param data BUSL status
+ * @param buf characters to be written
+ * @param len number of characters
+ */
+static void __stdcall writememory(void *data, const char *buf, size_t len) {
+	Busl *s = (Busl *) data;
+	if (s->outlen<s->outmemsize) {
+		size_t room = s->outmemsize-s->outlen;
+		memcpy(&s->outmem[s->outlen], buf, (len<room)? len: room);
+	}
+}
+
+/**
+ * Write a block of characters to the output sink: a FILE, caller-owned memory
+ * (see busl_beautify_buffer()), a function of the caller (see busl_beautify_sink())
+ * or nothing in test mode. The sink is chosen once for each file. The number of
+ * characters is counted in all cases, even when they don't fit in caller-owned
+ * memory.
+ *
+ * @param Busl BUSL status
+ * @param buf characters to be written
+ * @param len number of characters
+ */
+static void __stdcall writeout(Busl *s, const char *buf, size_t len) {
+	if (s->checkpoints && s->checkpoints->running && !s->checkpoints->active) {
+		/* outside the range of busl_beautify_range() */
+		return;
+	}
+	if (s->outname && (s->flags&CHANGED)) {
+		/* the output file isn't needed until now */
+		openoutput(s, s->outname);
+	}
+	if (s->sink) {
+		s->sink(s->sinkdata, buf, len);
+	}
+	s->outlen += len;
+}
+
+/** number of unchanged lines shown before and after a change, see the "d" option */
+#define DIFFCONTEXT 3
+
+/**
+ * Growing memory holding text, see busldiff
+ */
+typedef struct difftext {
+	/** characters (not nul-terminated) */
+	char *buf;
+	/** number of characters */
+	size_t len;
+	/** size of buf */
+	size_t size;
+} difftext;
+
+/**
+ * State of the unified diff between the input and the output, see the "d"
+ * option. Each time an output line is finished (see writeline()), the input
+ * read for it is compared with it, so the file is read only once. The input
+ * is taken after line end conversion, so like BUSL itself the diff ignores
+ * differences in line ends. Still, input lines ending with CRLF are shown with
+ * CRLF, otherwise patch would not find them in the file.
+ */
+typedef struct busldiff {
+	/** filename, used in the header */
+	const char *filename;
+	/** input since the last point where input and output were both at a line start */
+	difftext input;
+	/** first input character not yet added to input */
+	const char *inmark;
+	/** output since that point */
+	difftext output;
+	/** last unchanged lines, shown before the next change (prefixed with ' ') */
+	difftext context;
+	/** number of lines in context */
+	int contextlines;
+	/** lines of the current hunk, without its header */
+	difftext hunk;
+	/** output lines of the last changes, added to hunk after the input lines of the changes */
+	difftext added;
+	/** for each input line converted so far, 1 if it ended with CRLF, see convertlineends() */
+	difftext crlf;
+	/** number of unchanged lines after the last change of the hunk (-1 if there is no hunk) */
+	int trail;
+	/** first input line of the hunk */
+	unsigned long int oldstart;
+	/** number of input lines in the hunk */
+	unsigned long int oldcount;
+	/** first output line of the hunk */
+	unsigned long int newstart;
+	/** number of output lines in the hunk */
+	unsigned long int newcount;
+	/** number of the next input line */
+	unsigned long int oldline;
+	/** number of the next output line */
+	unsigned long int newline;
+	/** 1 when the header of the file is given */
+	int header;
+	/** 1 while the output is compared (until the end or <CTRL>-Z) */
+	int active;
+	/** 1 when out of memory: the rest is not compared */
+	int failed;
+} busldiff;
+
+/**
+ * Append characters to a text.
+ *
+ * @param d diff
+ * @param t text
+ * @param buf characters
+ * @param len number of characters
+ */
+static void __stdcall diffappend(busldiff *d, difftext *t, const char *buf, size_t len) {
+	if (!len) {
+		return;
+	}
+	if (t->len+len>t->size) {
+		size_t size = 2*t->size+len+256;
+		char *p = (char *) realloc(t->buf, size);
+		if (!p) {
+			d->failed = 1;
+			return;
 		}
-		return s->flags;
+		t->buf = p;
+		t->size = size;
 	}
-	p = strrchr(filename, '.');
-	if (s->outdir) {
-		const char *fwd = filename; /* filename without drive */
-#if defined(_DOS) || defined(_WIN16) || defined(_WIN32) || defined(_WIN64)
-		char drive = *fwd;
-		if (((drive>='A' && drive<='Z') || (drive>='a' && drive<='z')) && fwd[1]==':') {
-			fwd += 2;
+	memcpy(&t->buf[t->len], buf, len);
+	t->len += len;
+}
+
+/**
+ * Append a line to a text, prefixed with ' ', '-' or '+'.
+ *
+ * @param d diff
+ * @param t text
+ * @param prefix ' ', '-' or '+'
+ * @param line the line, ending with '\n' unless it is the last line
+ * @param len length of the line
+ */
+static void __stdcall diffappendline(busldiff *d, difftext *t, char prefix, const char *line, size_t len) {
+	diffappend(d, t, &prefix, 1);
+	diffappend(d, t, line, len);
+	if (!len || (line[len-1]!='\n')) {
+		static const char NONEWLINE[] = "\n\\ No newline at end of file\n";
+		diffappend(d, t, NONEWLINE, sizeof(NONEWLINE)-1);
+	}
+}
+
+/**
+ * Append an input line to a text, prefixed with ' ' or '-', with its original
+ * line end.
+ *
+ * @param d diff
+ * @param t text
+ * @param prefix ' ' or '-'
+ * @param line the line, ending with '\n' unless it is the last line
+ * @param len length of the line
+ * @param linenum number of the line in the input
+ */
+static void __stdcall diffappendinput(busldiff *d, difftext *t, char prefix, const char *line, size_t len, unsigned long int linenum) {
+	if (len && (line[len-1]=='\n') && (linenum<=d->crlf.len) && d->crlf.buf[linenum-1]) {
+		diffappend(d, t, &prefix, 1);
+		diffappend(d, t, line, len-1);
+		diffappend(d, t, "\r\n", 2);
+	} else {
+		diffappendline(d, t, prefix, line, len);
+	}
+}
+
+/**
+ * Remember the original line ends of input being converted, see
+ * convertlineends().
+ *
+ * @param d diff
+ * @param p converted input (before the conversion of the line end at end)
+ * @param end end of p
+ * @param crlf 1 if the line end at end was CRLF, 0 for CR, -1 if there is none
+ */
+static void __stdcall difflineends(busldiff *d, const char *p, const char *end, int crlf) {
+	static const char NOCRLF = 0;
+	char c = (char) crlf;
+	while ((p<end) && ((p = (const char *) memchr(p, '\n', end-p))!=0)) {
+		diffappend(d, &d->crlf, &NOCRLF, 1);
+		++p;
+	}
+	if (crlf>=0) {
+		diffappend(d, &d->crlf, &c, 1);
+	}
+}
+
+/**
+ * Give the current hunk as message, preceded by the header of the file if
+ * it is the first one.
+ *
+ * @param Busl BUSL status
+ */
+static void __stdcall diffhunk(Busl *s) {
+	busldiff *d = s->diff;
+	char header[128];
+	if (d->trail<0) {
+		return;
+	}
+	/* the diff is meant for tools, so no copyright message, but like
+	 * in check mode the exit code shows that the file is not clean */
+	if ((s->result<0) || (s->result==EXIT_SUCCESS)) {
+		s->result = 2*EXIT_FAILURE;
+	}
+	if (!d->header) {
+		size_t len = strlen(d->filename);
+		char *p = (char *) malloc(2*len+16);
+		if (p) {
+			sprintf(p, "--- %s\n+++ %s\n", d->filename, d->filename);
+			s->wrt(s->output, p);
+			free(p);
 		}
-#endif
-		if (strchr(DIRSEPARATOR, *fwd)) {
-			if (strchr(DIRSEPARATOR, *s->outdir) || s->outdir[1]==':') {
-				/* filename and outdir are absolute: D:out/ C:/in/file => D:out/in/file */
-				strcpy(dest, s->outdir); /*           /out/ C:/in/file =>  /out/in/file */
-				strcat(dest, &fwd[1]);
-			} else {
-				/* filename is absolute and outdir is relative: out/ C:\in\file => C:\in\out/file */
-				const char *q = strrchr(filename, *fwd)+1;
-				memcpy(dest, filename, q-filename);
-				strcpy(&dest[q-filename], s->outdir);
-				strcat(dest, q);
-			}
+		d->header = 1;
+	}
+	/* an empty side starts after the line before the hunk */
+	sprintf(header, "@@ -%lu,%lu +%lu,%lu @@\n", d->oldcount? d->oldstart: d->oldstart-1, d->oldcount,
+			d->newcount? d->newstart: d->newstart-1, d->newcount);
+	s->wrt(s->output, header);
+	diffappend(d, &d->hunk, d->added.buf, d->added.len);
+	diffappend(d, &d->hunk, "", 1);
+	if (!d->failed) {
+		s->wrt(s->output, d->hunk.buf);
+	}
+	d->hunk.len = d->added.len = 0;
+	d->trail = -1;
+}
+
+/**
+ * Handle a line which is the same in the input and the output: it is part of
+ * the current hunk or the context before the next one.
+ *
+ * @param Busl BUSL status
+ * @param line the line
+ * @param len length of the line
+ */
+static void __stdcall diffsame(Busl *s, const char *line, size_t len) {
+	busldiff *d = s->diff;
+	++d->oldline;
+	++d->newline;
+	if (d->added.len) {
+		diffappend(d, &d->hunk, d->added.buf, d->added.len);
+		d->added.len = 0;
+	}
+	if ((d->trail>=0) && (d->trail<DIFFCONTEXT)) {
+		diffappendinput(d, &d->hunk, ' ', line, len, d->oldline-1);
+		++d->oldcount;
+		++d->newcount;
+		++d->trail;
+		return;
+	}
+	if ((d->trail>=0) && (++d->trail>2*DIFFCONTEXT)) {
+		/* too far from the next change to be in the same hunk */
+		diffhunk(s);
+	}
+	if (d->contextlines==DIFFCONTEXT) {
+		const char *p = (const char *) memchr(d->context.buf, '\n', d->context.len);
+		size_t first = p? (size_t) (p+1-d->context.buf): d->context.len;
+		memmove(d->context.buf, &d->context.buf[first], d->context.len-first);
+		d->context.len -= first;
+		--d->contextlines;
+	}
+	diffappendinput(d, &d->context, ' ', line, len, d->oldline-1);
+	++d->contextlines;
+}
+
+/**
+ * Count the lines of a text, a last line without '\n' included.
+ *
+ * @param p text
+ * @param len length of text
+ * @return number of lines
+ */
+static unsigned long int __stdcall difflines(const char *p, size_t len) {
+	unsigned long int n = 0;
+	const char *end = p+len;
+	while ((p<end) && ((p = (const char *) memchr(p, '\n', end-p))!=0)) {
+		++p;
+		++n;
+	}
+	if (len && (end[-1]!='\n')) {
+		++n;
+	}
+	return n;
+}
+
+/**
+ * Add changed lines to the current hunk, starting a new hunk if needed.
+ *
+ * @param Busl BUSL status
+ * @param from input lines
+ * @param oldlen length of input lines
+ * @param to output lines
+ * @param newlen length of output lines
+ */
+static void __stdcall diffchange(Busl *s, const char *from, size_t oldlen, const char *to, size_t newlen) {
+	busldiff *d = s->diff;
+	const char *p;
+	const char *end;
+	unsigned long int linenum = d->oldline;
+	unsigned long int oldlines = difflines(from, oldlen);
+	unsigned long int newlines = difflines(to, newlen);
+	if (d->trail<0) {
+		d->oldstart = d->oldline-d->contextlines;
+		d->newstart = d->newline-d->contextlines;
+		d->oldcount = d->newcount = 0;
+	}
+	diffappend(d, &d->hunk, d->context.buf, d->context.len);
+	d->oldcount += d->contextlines+oldlines;
+	d->newcount += d->contextlines+newlines;
+	d->context.len = 0;
+	d->contextlines = 0;
+	for (p=from, end=from+oldlen; p<end; ) {
+		const char *lf = (const char *) memchr(p, '\n', end-p);
+		const char *next = lf? lf+1: end;
+		diffappendinput(d, &d->hunk, '-', p, next-p, linenum++);
+		p = next;
+	}
+	for (p=to, end=to+newlen; p<end; ) {
+		const char *lf = (const char *) memchr(p, '\n', end-p);
+		const char *next = lf? lf+1: end;
+		diffappendline(d, &d->added, '+', p, next-p);
+		p = next;
+	}
+	d->oldline += oldlines;
+	d->newline += newlines;
+	d->trail = 0;
+}
+
+/**
+ * Compare the input and output collected since the last comparison. When
+ * both have the same number of lines, they are compared line by line,
+ * otherwise all of it is a single change.
+ *
+ * @param Busl BUSL status
+ */
+static void __stdcall diffcompare(Busl *s) {
+	busldiff *d = s->diff;
+	const char *from = d->input.buf;
+	const char *to = d->output.buf;
+	const char *oldend = from+d->input.len;
+	const char *newend = to+d->output.len;
+	if ((d->input.len!=d->output.len) || memcmp(from, to, d->input.len)) {
+		if (difflines(from, d->input.len)!=difflines(to, d->output.len)) {
+			diffchange(s, from, d->input.len, to, d->output.len);
+			from = oldend;
+			to = newend;
+		}
+	}
+	while (from<oldend) {
+		const char *lf = (const char *) memchr(from, '\n', oldend-from);
+		const char *oldnext = lf? lf+1: oldend;
+		const char *newnext = ((lf = (const char *) memchr(to, '\n', newend-to))!=0)? lf+1: newend;
+		if (((oldnext-from)==(newnext-to)) && !memcmp(from, to, oldnext-from)) {
+			diffsame(s, from, oldnext-from);
+			from = oldnext;
+			to = newnext;
 		} else {
-			/* filename is relative: D:/out/ C:in/file => D:/out/in/file */
-			strcpy(dest, s->outdir);
-			strcat(dest, fwd);
+			/* a run of changed lines */
+			const char *oldstart = from;
+			const char *newstart = to;
+			do {
+				from = oldnext;
+				to = newnext;
+				if (from>=oldend) {
+					break;
+				}
+				oldnext = ((lf = (const char *) memchr(from, '\n', oldend-from))!=0)? lf+1: oldend;
+				newnext = ((lf = (const char *) memchr(to, '\n', newend-to))!=0)? lf+1: newend;
+			} while (((oldnext-from)!=(newnext-to)) || memcmp(from, to, oldnext-from));
+			diffchange(s, oldstart, from-oldstart, newstart, to-newstart);
+		}
+	}
+	d->input.len = d->output.len = 0;
+}
+
+/**
+ * Output sink collecting the output for the unified diff.
+ *
+ * @param data BUSL status
+ * @param buf characters to be written
+ * @param len number of characters
+ */
+static void __stdcall diffsink(void *data, const char *buf, size_t len) {
+	Busl *s = (Busl *) data;
+	if (s->diff->active) {
+		diffappend(s->diff, &s->diff->output, buf, len);
+	}
+}
+
+/**
+ * Add the input read so far to the input to be compared. The line buffer is
+ * not used for this, because it is modified while reading (e.g. tabs).
+ *
+ * @param Busl BUSL status
+ */
+static void __stdcall diffinput(Busl *s) {
+	busldiff *d = s->diff;
+	diffappend(d, &d->input, d->inmark, s->inptr-d->inmark);
+	d->inmark = s->inptr;
+}
+
+/**
+ * Compare the input and the output of a line, called when an output line is
+ * finished. Comparing waits until both the input and the output end with a
+ * complete line, e.g. when a line is split.
+ *
+ * @param Busl BUSL status
+ */
+static void __stdcall diffline(Busl *s) {
+	busldiff *d = s->diff;
+	diffinput(s);
+	if ((!d->input.len || (d->input.buf[d->input.len-1]=='\n'))
+			&& (!d->output.len || (d->output.buf[d->output.len-1]=='\n'))) {
+		diffcompare(s);
+	}
+}
+
+/**
+ * Start the unified diff of a file.
+ *
+ * @param Busl BUSL status
+ * @param filename filename, used in the header
+ * @return 0 when out of memory
+ */
+static int __stdcall startdiff(Busl *s, const char *filename) {
+	busldiff *d = s->diff;
+	if (!d && !(d = s->diff = (busldiff *) calloc(1, sizeof(busldiff)))) {
+		return 0;
+	}
+	d->filename = filename;
+	d->inmark = s->inptr;
+	d->input.len = d->output.len = d->context.len = d->hunk.len = d->added.len = d->crlf.len = 0;
+	d->contextlines = 0;
+	d->trail = -1;
+	d->oldline = d->newline = 1;
+	d->header = d->failed = 0;
+	d->active = 1;
+	s->sink = diffsink;
+	s->sinkdata = s;
+	return 1;
+}
+
+/**
+ * End the unified diff of a file: compare what is left, and give the last hunk.
+ *
+ * @param Busl BUSL status
+ */
+static void __stdcall enddiff(Busl *s) {
+	busldiff *d = s->diff;
+	if (d && d->active) {
+		/* input not followed by output, e.g. spaces at the end */
+		diffinput(s);
+		diffcompare(s);
+		diffhunk(s);
+		d->active = 0;
+		if (d->failed) {
+			warning(s, "%s: ERROR: out of memory, the diff is not complete.\n", d->filename, 0, 0);
 		}
+	}
+}
+
+/**
+ * Release the memory of the unified diff.
+ *
+ * @param Busl BUSL status
+ */
+static void __stdcall freediff(Busl *s) {
+	if (s->diff) {
+		free(s->diff->input.buf);
+		free(s->diff->output.buf);
+		free(s->diff->context.buf);
+		free(s->diff->hunk.buf);
+		free(s->diff->added.buf);
+		free(s->diff->crlf.buf);
+		free(s->diff);
+		s->diff = 0;
+	}
+}
+
+/**
+ * Convert CR and CRLF line ends to LF, up to the first <CTRL>-Z. Everything after
+ * <CTRL>-Z is copied unmodified. Source and destination may be the same memory.
+ * In diff mode the original line ends are remembered, see busldiff.
+ *
+ * @param Busl BUSL status
+ * @param dest destination memory (at least len characters)
+ * @param src input to be converted
+ * @param len number of input characters
+ * @return number of characters after conversion
+ */
+static size_t __stdcall convertlineends(Busl *s, char *dest, const char *src, size_t len) {
+	const char *end = src+len;
+	const char *stop = (const char *) memchr(src, '\032', len);
+	const char *cr;
+	char *p = dest;
+#ifdef HAVE_CRLF
+	/* messages are written in text mode, so the diff has CRLF line ends anyway */
+	busldiff *d = 0;
+#else
+	busldiff *d = (s->diff && s->diff->active)? s->diff: (busldiff *) 0;
+#endif
+	if (stop) {
+		s->inraw = 1;
 	} else {
-		strcpy(orig, filename);
-		strcpy(dest, filename);
-		/* Under Windows, running "busl *.cpp" would beautify *.cpp~ and *.cpp$
-		 * as well! As a workaround, use *.cp~ as backup file and *.cp$ as
-		 * temporary file. This is useful for DOS and WIN16 as well, which
-		 * dont accept extensions longer than 3 characters. Only do this if
-		 * the file extension is exactly 3 characters long. If the last
-		 * character is already '~' or '$' then no beautification is done,
-		 * unless the 'f' flag is supplied
-		 * Because it might be that a Windows volume is mounted on a UNIX
-		 * box, or reverse, just do this processing always.
-		 */
-		if (p) {
-			if (p[1] && p[2] && p[3] && !p[4]) {
-				if (p[3]!='~' || !(s->defaultflags&CHANGED)) {
-					orig[(p-filename)+3] = '\0';
-				}
-				if (p[3]!='$' || !(s->defaultflags&CHANGED)) {
-					dest[(p-filename)+3] = '\0';
-				}
-			}
-		} else {
-			strcat(orig, ".");
-			strcat(dest, ".");
+		stop = end;
+	}
+	while ((cr = (const char *) memchr(src, '\r', stop-src))!=0) {
+		int crlf = (cr+1<stop) && (cr[1]=='\n');
+		memmove(p, src, cr-src);
+		if (d) {
+			difflineends(d, p, p+(cr-src), crlf);
 		}
-		strcat(orig, "~");
-		strcat(dest, "$");
+		p += cr-src;
+		*p++ = '\n';
+		src = cr+1+crlf;
 	}
-	s->flags = (s->defaultflags&~SPACEHANDLING)|SPACESTRIP;
-	if (p) {
-		if ((!strcmp(orig, filename)) || (!strcmp(dest, filename)) || (!(s->defaultflags&CHANGED) && checkext(++p, ignorext, sizeof(ignorext)))) {
-			s->flags &= ~CHANGED;
-			return warning(s, "%s: ERROR: unsupported file extension: not modified.\n", filename, 0, 0);
+	memmove(p, src, end-src);
+	if (d) {
+		difflineends(d, p, p+(stop-src), -1);
+	}
+	return (p-dest)+(end-src);
+}
+
+/**
+ * Use memory as input. Only if it contains a CR before <CTRL>-Z, the input is
+ * converted into newly allocated memory, otherwise it is used as-is.
+ *
+ * @param Busl BUSL status
+ * @param input input characters
+ * @param len number of input characters
+ * @return 0 when out of memory
+ */
+static int __stdcall setinput(Busl *s, const char *input, size_t len) {
+	const char *stop = (const char *) memchr(input, '\032', len);
+	s->inptr = input;
+	s->inend = input+len;
+	if (memchr(input, '\r', (stop? stop: s->inend)-input)) {
+		s->inblock = (char *) malloc(len);
+		if (!s->inblock) {
+			return 0;
 		}
-		if (s->defaultflags&AUTOMODE) {
-			if (checkext(p, xmlext, sizeof(xmlext))) {
-				s->flags |= XMLMODE;
-			} else if (checkext(p, genext, sizeof(genext))) {
-				s->flags &= ~XMLMODE;
-			}
-			if ((s->flags&STRIPMODE) && !(s->defaultflags&CHANGED) && checkext(p, nostripext, sizeof(nostripext))) {
-				warning(s, "%s: WARNING: \"s\" option should not be used for this file type.\n", filename, 0, 0);
-				warning(s, "(Ignored. Use \"f\" if you are really sure that you want this).\n", filename, 0, 0);
-				s->flags &= ~STRIPMODE;
+		s->inblocksize = len;
+		s->inptr = s->inblock;
+		s->inend = s->inblock+convertlineends(s, s->inblock, input, len);
+	}
+	s->inbase = s->inptr;
+	return 1;
+}
+
+/**
+ * Prepare reading the input from a file. Large regular files are mapped into
+ * memory if possible. Otherwise the input is read in blocks, the whole file at
+ * once when its size is known and memory allows.
+ *
+ * @param Busl BUSL status
+ * @param fin input file, opened in binary mode
+ * @return 0 when out of memory
+ */
+static int __stdcall openinput(Busl *s, FILE *fin) {
+	size_t size = BLOCKSIZE;
+	long int len;
+#ifdef HAVE_MMAP
+	{
+		struct stat st;
+		if (!fstat(fileno(fin), &st) && S_ISREG(st.st_mode) && (st.st_size>BLOCKSIZE)
+				&& ((off_t) (size_t) st.st_size==st.st_size)) {
+			void *map = mmap(0, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fileno(fin), 0);
+			if (map!=MAP_FAILED) {
+				int result = setinput(s, (const char *) map, (size_t) st.st_size);
+				if (s->inblock || !result) {
+					/* converted (or failed): mapping is not needed any more */
+					munmap(map, (size_t) st.st_size);
+				} else {
+					s->inmap = map;
+					s->inmaplen = (size_t) st.st_size;
+					s->inmapfd = fileno(fin);
+				}
+				return result;
 			}
 		}
 	}
-	s->quoted = 0;
-	s->numstrip = 0;
-	if (s->flags&XMLMODE) {
-		if (s->flags&ZIPMODE) {
-			warning(s, "%s: WARNING: \"z\" option cannot be combined with xml/html/sgml mode (ignored).\n", filename, 0, 0);
-			s->flags &= ~ZIPMODE;
+#endif
+	if (!fseek(fin, 0L, SEEK_END)) {
+		len = ftell(fin);
+		/* one more, so reading less than size shows that the end is reached */
+		if ((len>=BLOCKSIZE) && (len<LONG_MAX) && ((unsigned long int) (size_t) (len+1)==(unsigned long int) (len+1))) {
+			size = (size_t) (len+1);
 		}
-		s->quoted = '<';
-		s->flags &= ~SPACEHANDLING;
-		s->flags |= SPACEASIS;
+		if (fseek(fin, 0L, SEEK_SET)) {
+			len = -1;
+		}
+	} else {
+		len = -1;
 	}
-	if (s->defaultflags & NOTESTMODE) {
-		if (s->defaultflags&(UNIXLFMODE|MACCRMODE)) {
-			fout = fopen(dest, "wb");
+	s->inblock = (char *) malloc(size);
+	if (!s->inblock && (size>BLOCKSIZE)) {
+		size = BLOCKSIZE;
+		s->inblock = (char *) malloc(size);
+	}
+	if (!s->inblock) {
+		return 0;
+	}
+	s->inblocksize = size;
+	s->inptr = s->inend = s->inblock;
+	s->fin = fin;
+	if (len>=0) {
+		/* the size is known, so try to read the whole file at once */
+		size_t count = fread(s->inblock, 1, size, fin);
+		if ((count<size) && !ferror(fin)) {
+			if (memchr(s->inblock, '\r', count)) {
+				count = convertlineends(s, s->inblock, s->inblock, count);
+			}
+			s->inend = s->inblock+count;
+			s->inbase = s->inblock;
+			s->fin = 0;
 		} else {
-			fout = fopen(dest, "w");
-		}
-		if (!fout) {
-			fclose(fin);
-			return warning(s, "%s: ERROR: cannot open for writing.\n", dest, 0, 0);
+			/* it has grown: read it block by block after all */
+			fseek(fin, 0L, SEEK_SET);
 		}
 	}
-	/* read one char from input stream. If it is CR then read one character ahead. */
-	c = fgetc(fin);
-	if (c=='\r') {
-		savechar = fgetc(fin);
-		c = '\n';
-	} else {
-		savechar = '\n';
+	return 1;
+}
+
+/**
+ * Release the memory used for the input. The input file is not closed.
+ *
+ * @param Busl BUSL status
+ */
+static void __stdcall closeinput(Busl *s) {
+#ifdef HAVE_MMAP
+	if (s->inmap) {
+		munmap(s->inmap, s->inmaplen);
 	}
-	/*
-	 * Here the main loop of BUSL starts.
-	 */
-	while (c!=EOF) {
-		/* Special handling of the <CNRL>-Z character */
-		if (c=='\032') {
-			savechar = fgetc(fin);
-			if (savechar!=EOF) {
-				if (s->flags&(XMLMODE|ZIPMODE)) {
-					s->flags |= CHANGED;
-					warning(s, "%s: WARNING: <CTRL>-Z and everything after it is stripped.\n", filename, 0, 0);
-					break;
-				}
-				if (s->outpos) {
-					writechar(s, '\n', fout);
-				}
-				if (!(s->defaultflags&(UNIXLFMODE|MACCRMODE))) {
-					/* re-open file in binary mode */
-					fclose(fin);
-					fin = fopen(dest, "ab");
-					if (!fin) {
-						fclose(fout);
-						return warning(s, "%s: ERROR: cannot re-open in binary mode for writing trailer.\n", dest, 0, 0);
-					}
-				}
-				s->outbuf[0] = (char) c;
-				s->outbuf[1] = (char) savechar;
-				s->outpos = (int) fread(&s->outbuf[2], 1, sizeof(s->outbuf)-2, fin);
-				if (s->outpos>=0) s->outpos += 2;
-				while (s->outpos==sizeof(s->outbuf)) {
-					if (fout) {
-						fwrite(s->outbuf, 1, sizeof(s->outbuf), fout);
-					}
-					s->outpos = (int) fread(s->outbuf, 1, sizeof(s->outbuf), fin);
-				}
-				if ((s->outpos>0) && fout) {
-					fwrite(s->outbuf, 1, s->outpos, fout);
+#endif
+	free(s->inblock);
+	s->inmap = 0;
+	s->inblock = 0;
+	s->inptr = s->inend = s->inbase = 0;
+	s->fin = 0;
+}
+
+/**
+ * Read the next input block from the input file. Line ends are converted, but a
+ * CR at the end of a block is kept until the next block shows whether it is
+ * followed by LF.
+ *
+ * @param Busl BUSL status
+ * @return 0 at end of input, 1 when at least one character is available
+ */
+static int __stdcall readblock(Busl *s) {
+	size_t len;
+	size_t count;
+	if (!s->fin) {
+		return 0;
+	}
+	if (s->diff && s->diff->active) {
+		/* the rest of the current block is compared later */
+		diffinput(s);
+	}
+	do {
+		len = 0;
+		if (s->incr) {
+			s->inblock[len++] = '\r';
+			s->incr = 0;
+		}
+		count = fread(&s->inblock[len], 1, s->inblocksize-len, s->fin);
+		len += count;
+		if (!len) {
+			return 0;
+		}
+		if (!s->inraw) {
+			size_t n = (count && (s->inblock[len-1]=='\r'))? len-1: len;
+			size_t converted = convertlineends(s, s->inblock, s->inblock, n);
+			if (n!=len) {
+				if (s->inraw) {
+					s->inblock[converted++] = '\r';
+				} else {
+					s->incr = 1;
 				}
-				s->inpos = s->outpos = 0;
 			}
-			break;
+			len = converted;
 		}
-		s->inbuf[s->inpos++] = (char) c;
-		if (s->quoted) {
-			if ((s->quoted=='%') && (c!='%') && (c!='?') && (c!='#')) {
-				s->quoted = '<';
-			}
-			switch (c) {
-				case ' ': {
-					if ((s->quoted=='<')) {
-						if ((s->inpos>=8) && !memcmp(&s->inbuf[s->inpos-8], scripttag, 7)) {
-							do {
-								writechar(s, c, fout);
-								/* read one char from input stream. Use the read ahead character if available. */
-								if (savechar!='\n') {
-									c = savechar;
-									savechar = '\n';
-								} else {
-									c = fgetc(fin);
-								}
-								if (c=='\r') {
-									/* If it is CR then read one character ahead. */
-									savechar = fgetc(fin);
-									c = '\n';
-								}
-								s->inbuf[s->inpos++] = (char) c;
-							} while (c!=EOF && !strchr(ISGTORCTRLZ, c));
-							if (c!='>') {
-								--s->inpos;
-								continue;
-							}
-							s->quoted = cmdtype = 0;
-							s->flags &= ~SPACEHANDLING;
-							s->flags |= SPACESTRIP;
-						}
-					}
-					if (s->flags&SPACESTRIP) {
-						if (s->inpos>s->numstrip) {
-							s->flags &= ~SPACEHANDLING;
-							s->flags |= SPACEASIS;
-							writechar(s, c, fout);
-						}
-					} else {
-						writechar(s, c, fout);
-					}
-					break;
-				}
-				case '\a': {/* alert, audible alarm, bell */
-					if (strchr(ISCOMMENTORXML, s->quoted)) {
-						writechar(s, c, fout);
-					} else {
-						writechar(s, '\\', fout);
-						writechar(s, 'a', fout);
-					}
-					break;
-				}
-				case '\b': {/* backspace */
-					if (strchr(ISCOMMENTORXML, s->quoted)) {
-						writechar(s, c, fout);
-					} else {
-						writechar(s, '\\', fout);
-						writechar(s, 'b', fout);
-					}
-					break;
-				}
-				case '\f': {/* formfeed */
-					if (strchr(ISCOMMENTORXML, s->quoted)) {
-						writechar(s, c, fout);
-					} else {
-						writechar(s, '\\', fout);
-						writechar(s, 'f', fout);
-					}
-					break;
-				}
-				case '\t': {/* horizontal tab */
-					if ((s->quoted=='<')) {
-						if ((s->inpos>=8) && !memcmp(&s->inbuf[s->inpos-8], scripttag, 7)) {
-							do {
-								writechar(s, c, fout);
-								/* read one char from input stream. Use the read ahead character if available. */
-								if (savechar!='\n') {
-									c = savechar;
-									savechar = '\n';
-								} else {
-									c = fgetc(fin);
-								}
-								if (c=='\r') {
-									/* If it is CR then read one character ahead. */
-									savechar = fgetc(fin);
-									c = '\n';
-								}
-								s->inbuf[s->inpos++] = (char) c;
-							} while (c!=EOF && !strchr(ISGTORCTRLZ, c));
-							if (c=='>') {
-								writechar(s, c, fout);
-								s->quoted = cmdtype = 0;
-								s->flags &= ~SPACEHANDLING;
-								s->flags |= SPACENEEDED;
-							} else {
-								--s->inpos;
-								continue;
-							}
-						}
-					} else if (strchr(ISCCOMMENT, s->quoted) && (s->flags&SPACESTRIP) && (s->inpos>s->numstrip)) {
-						s->flags &= ~SPACEHANDLING;
-						s->flags |= SPACEASIS;
-					}
+	} while (!len);
+	s->inptr = s->inblock;
+	s->inend = s->inblock+len;
+	if (s->diff) {
+		s->diff->inmark = s->inptr;
+	}
+	return 1;
+}
 
-					if (!(s->flags&SPACESTRIP)) {
-						if ((s->commentquoted=='`') || strchr("<`", s->quoted)) {
-							writechar(s, c, fout);
-						} else if (s->commentquoted || !strchr(ISCOMMENT, s->quoted)) {
-							writechar(s, '\\', fout);
-							writechar(s, 't', fout);
-						} else if (!s->tabs) {
-							writechar(s, c, fout);
-						} else {
-							int numtabs = s->numstrip>0? s->numstrip: 0;
-							int td = s->tabs;
-							if (td<0) td = -td;
-							s->flags |= CHANGED;
-							s->inbuf[s->inpos-1] = ' '; /* XXX This is suspicious*/
-							writechar(s, ' ', fout);
-							while ((numtabs<s->inpos) && (s->inbuf[numtabs]=='\t')) numtabs++;
-							while ((s->inpos-numtabs)%td) {
-								writechar(s, ' ', fout);
-								s->inbuf[s->inpos++] = ' '; /* XXX This is suspicious*/
-							}
-						}
-					}
-					break;
-				}
-				case '\v': {/* vertical tab */
-					if (strchr(ISCOMMENTORXML, s->quoted)) {
-						writechar(s, c, fout);
-					} else {
-						writechar(s, '\\', fout);
-						writechar(s, 'v', fout);
-					}
-					break;
-				}
-				case '\n': {
-					if (s->quoted=='<') {
-						if ((s->inpos>=8) && !memcmp(&s->inbuf[s->inpos-8], scripttag, 7)) {
-							do {
-								writechar(s, c, fout);
-								/* read one char from input stream. Use the read ahead character if available. */
-								if (savechar!='\n') {
-									c = savechar;
-									savechar = '\n';
-								} else {
-									c = fgetc(fin);
-								}
-								if (c=='\r') {
-									/* If it is CR then read one character ahead. */
-									savechar = fgetc(fin);
-									c = '\n';
-								}
-								s->inbuf[s->inpos++] = (char) c;
-							} while (c!=EOF && !strchr(ISGTORCTRLZ, c));
-							if (c=='>') {
-								writechar(s, c, fout);
-								s->quoted = cmdtype = 0;
-								s->flags &= ~SPACEHANDLING;
-								s->flags |= SPACENEEDED;
-							} else {
-								--s->inpos;
-								continue;
-							}
-						}
-					} else if (strchr(ISCOMMENT, s->quoted)) {
-						int backslashpos;
-						if (!(s->flags&BACKSLASH)) {
-							s->flags &= ~SPACEHANDLING;
-							s->flags |= SPACESTRIP;
-							if ((s->outpos>0) && strchr(SPACES, s->outbuf[s->outpos-1])) {
-								s->flags &= ~BACKSLASH;
-								s->outbuf[s->outpos--] = 0;
-								while ((s->outpos>0) && strchr(SPACES, s->outbuf[s->outpos-1])) --s->outpos;
-								backslashpos = s->outpos;
-								while ((backslashpos>0) && (s->outbuf[backslashpos-1]=='\\')) --backslashpos;
-								if ((backslashpos-s->outpos) &1) {
-									s->flags &= ~SPACEHANDLING;
-									s->flags |= (BACKSLASH|SPACEASIS);
-									if (!(s->defaultflags&QUIETMODE)) {
-										warning(s, "%s(%d,%d): WARNING: Backslash followed by space(s) detected in end of comment.\n", filename, s->linenum, 0);
-										warning(s, "Assuming this comment is meant to continue at the next line\n%s\n", s->outbuf, 0, 0);
-									}
-								}
-							}
-						}
-						if (s->flags&XMLMODE && s->flags&STRIPMODE && (s->quoted=='\n')) {
-							const char *p;
-							char saveinchar = s->inbuf[s->inpos];
-							s->inbuf[s->inpos] = 0;
-							p = strstr(s->inbuf, "//");
-							if (p && strstr(p, "-->")) {
-								strcpy(&s->outbuf[s->outpos], "//-->");
-								s->outpos += 5;
-							}
-							s->inbuf[s->inpos] = saveinchar;
-						}
-					}
-					writechar(s, c, fout);
-					break;
-				}
-				case '>': {
-					if (s->quoted=='<') {
-						if ((s->inpos>=8) && !memcmp(&s->inbuf[s->inpos-8], scripttag, 7)) {
-							s->quoted = cmdtype = 0;
-						}
-					} else if (s->flags&XMLMODE) {
-						if (cmdtype) {
-							if (s->outpos && (s->outbuf[s->outpos-1]==cmdtype)) {
-								if (s->quoted=='\n') {
-									s->quoted = '%'; cmdtype = 0;
-								} else {
-									s->outbuf[s->outpos] = 0;
-									warning(s, "%s(%d,%d): WARNING: '%c>' found in string or comment (ignored).\n", filename, s->linenum, cmdtype);
-									warning(s, "%s%c...\n", s->outbuf, 0, (char) c);
-								}
-							}
-						} else if ((s->inpos>=9) && !memcmp(&s->inbuf[s->inpos-9], endscripttag, 8)) {
-							if (s->quoted=='\n') {
-								s->quoted = '%'; cmdtype = 0;
-								if (s->flags&STRIPMODE) {
-									const char *p;
-									char saveinchar = s->inbuf[s->inpos];
-									s->inbuf[s->inpos] = 0;
-									p = strstr(s->inbuf, "//");
-									if (p && strstr(p, "-->")) {
-										if (s->outpos && s->outbuf[s->outpos-1]==' ') {
-											s->outpos--;
-										}
-										strcpy(&s->outbuf[s->outpos], "//-->");
-										s->outpos += 5;
-									}
-									s->inbuf[s->inpos] = saveinchar;
-									strcpy(&s->outbuf[s->outpos], endscripttag);
-									s->outpos += 8;
-								}
-							} else {
-								s->outbuf[s->outpos] = 0;
-								s->outpos -= 7;
-								warning(s, "%s(%d,%d): WARNING: '</script>' found in string or comment (ignored).\n", filename, s->linenum, 0);
-								s->outpos += 7;
-								warning(s, "%s%c...\n", s->outbuf, 0, (char) c);
-							}
-						}
-					} else if (s->flags&SPACESTRIP) {
-						s->flags &= ~SPACEHANDLING;
-						s->flags |= SPACEASIS;
-					}
-					writechar(s, c, fout);
-					break;
-				}
-				case '\"':
-				case '\'':
-				case '`': {
-					if (!(s->flags&BACKSLASH)) {
-						if (strchr(ISCOMMENT, s->quoted)) {
-							if (!s->commentquoted) {
-								s->commentquoted = (char) c;
-							} else if (c==s->commentquoted) {
-								s->commentquoted = 0;
-							}
-						}
-					}
-					if (s->flags&SPACESTRIP) {
-						s->flags &= ~SPACEHANDLING;
-						s->flags |= SPACEASIS;
-					}
-					writechar(s, c, fout);
-					break;
-				}
-				default: {
-					if (s->flags&SPACESTRIP) {
-						s->flags &= ~SPACEHANDLING;
-						s->flags |= SPACEASIS;
-					}
-					writechar(s, c, fout);
-					break;
-				}
+/**
+ * Read one character from the input.
+ *
+ * @param Busl BUSL status
+ * @return the character read, or EOF
+ */
+static int __stdcall readchar(Busl *s) {
+	if ((s->inptr<s->inend) || readblock(s)) {
+		return (unsigned char) *s->inptr++;
+	}
+	return EOF;
+}
+
+#ifdef HAVE_COPYRANGE
+/**
+ * Copy a part of a file to another file in the kernel, without reading it.
+ *
+ * @param fdin input file
+ * @param offset position in the input file
+ * @param fdout output file, written at its current position
+ * @param len number of characters to be copied
+ * @return number of characters copied, less than len at the end of the input
+ *         or when not supported (e.g. between file systems or to a pipe)
+ */
+static size_t __stdcall copyrange(int fdin, loff_t offset, int fdout, size_t len) {
+	size_t copied = 0;
+	while (copied<len) {
+		long int n = syscall(__NR_copy_file_range, fdin, &offset, fdout, (loff_t *) 0, len-copied, 0U);
+		if (n<=0) {
+			break;
+		}
+		copied += (size_t) n;
+	}
+	return copied;
+}
+#endif
+
+/**
+ * Copy the rest of the input unmodified, after <CTRL>-Z. When both the input and
+ * the output are files, the kernel copies it, so large trailers are not read.
+ *
+ * @param Busl BUSL status
+ */
+static void __stdcall copytrailer(Busl *s) {
+#ifdef HAVE_COPYRANGE
+	if ((s->sink==writefile) && !s->outcrlf && (s->inmap || s->fin)) {
+		int fd;
+		loff_t offset;
+		size_t len = 0;
+		struct stat st;
+		if (s->inmap) {
+			fd = s->inmapfd;
+			offset = s->inptr-(const char *) s->inmap;
+			len = s->inend-s->inptr;
+		} else {
+			/* the rest of the current block first */
+			writeout(s, s->inptr, s->inend-s->inptr);
+			s->inptr = s->inend;
+			fd = fileno(s->fin);
+			offset = ftell(s->fin);
+			if ((offset>=0) && !fstat(fd, &st) && (st.st_size>offset)) {
+				len = (size_t) (st.st_size-offset);
 			}
-			if (s->flags&BACKSLASH) {
-				s->flags &= ~BACKSLASH;
-			} else if (strchr(ISCCOMMENT, s->quoted)) {
-				if (c==s->quoted) {
-					s->flags |= ALMOSTEND;
-				} else if (s->flags&ALMOSTEND) {
-					if (c=='/') {
-						s->quoted = 0;
-						s->numstrip = 0;
-						s->flags &= ~SPACEHANDLING;
-						if (s->flags&STRIPMODE) {
-							if (!s->outpos || strchr(XXXX15, s->outbuf[s->outpos-1])) {
-								s->flags |= SPACESTRIP;
-							} else {
-								s->flags |= SPACENEEDED;
-							}
-						} else {
-							s->flags |= SPACEASIS;
-						}
-					}
-					s->flags &= ~ALMOSTEND;
-				}
-			} else if (c=='\\') {
-				if (s->quoted!='`') {
-					s->flags |= BACKSLASH;
-				}
-			} else if ((s->quoted=='%') && (c=='?'||c=='#')) {
-				s->quoted = 0;
-				s->numstrip = 0;
-				cmdtype = (char) c;
-				s->flags &= ~(SPACEHANDLING|BACKSLASH);
-				s->flags |= SPACEASIS;
-			} else if (s->quoted==c) {
-				if (c=='<') {
-					s->quoted = '%';
+		}
+		if (len && !fflush(s->fout)) {
+			size_t n = copyrange(fd, offset, fileno(s->fout), len);
+			if (n) {
+				/* let stdio continue where the kernel stopped */
+				fseek(s->fout, (long int) lseek(fileno(s->fout), 0, SEEK_CUR), SEEK_SET);
+				s->outlen += n;
+				if (s->inmap) {
+					s->inptr += n;
 				} else {
-					s->quoted = 0;
-					s->numstrip = 0;
-					s->flags &= ~(SPACEHANDLING|BACKSLASH);
-					if (c=='\n') {
-						s->flags |= SPACESTRIP;
-					} else {
-						s->flags |= SPACEASIS;
-						if (c=='%') {
-							c = fgetc(fin);
-							if (c=='\r') {
-								/* If it is CR then read one character ahead. */
-								savechar = fgetc(fin);
-								c = '\n';
-							} else if (c=='@') {
-								s->quoted = '<';
-								continue;
-							} else if (c=='=') {
-								s->inbuf[s->inpos++] = (char) c;
-								writechar(s, c, fout);
-								c = fgetc(fin);
-								if (c=='\r') {
-									/* If it is CR then read one character ahead. */
-									savechar = fgetc(fin);
-									c = '\n';
-								}
-							}
-							cmdtype = (char) '%';
-							continue;
-						}
-					}
+					fseek(s->fin, (long int) (offset+n), SEEK_SET);
 				}
 			}
-		} else {
-			switch (c) {
-				case '\'':
-				case '\"':
-				case '`': {
-					char newquoted;
-					newquoted = (char) c;
-					if (s->flags&SPACENEEDED) {
-						writechar(s, ' ', fout);
-					} else if (s->flags&SPACENEEDLF) {
-						writechar(s, '\n', fout);
-					}
-					if (!(s->flags&STRIPMODE) || (newquoted!='\n')) {
-						writechar(s, c, fout);
-					}
-					s->quoted = newquoted;
-					s->flags &= ~SPACEHANDLING;
-					s->flags |= SPACEASIS;
+		}
+	}
+#endif
+	do {
+		writeout(s, s->inptr, s->inend-s->inptr);
+		s->inptr = s->inend;
+	} while (readblock(s));
+}
+
+/**
+ * Find the first character in a string or comment which needs more handling than
+ * being copied: a QUOTEDSTOP character or the closing quote. With SSE2 the
+ * characters are checked 16 at a time.
+ *
+ * @param p first character to be checked
+ * @param end end of the characters
+ * @param quoted current quoting mode, see Busl.quoted
+ * @param space ' ' when spaces need handling as well, otherwise the same as quoted
+ * @return the first character needing handling, or end
+ */
+static const char *__stdcall skipquoted(const char *p, const char *end, char quoted, char space) {
+#ifdef HAVE_SSE2
+	const __m128i ctrl = _mm_set1_epi8(' '-1);
+	const __m128i dquote = _mm_set1_epi8('"');
+	const __m128i squote = _mm_set1_epi8('\'');
+	const __m128i bquote = _mm_set1_epi8('`');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i gt = _mm_set1_epi8('>');
+	const __m128i q = _mm_set1_epi8(quoted);
+	const __m128i sp = _mm_set1_epi8(space);
+	while (end-p>=16) {
+		__m128i x = _mm_loadu_si128((const __m128i *) p);
+		/* unsigned x<=' '-1 */
+		__m128i m = _mm_cmpeq_epi8(_mm_max_epu8(x, ctrl), ctrl);
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(x, dquote));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(x, squote));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(x, bquote));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(x, backslash));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(x, gt));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(x, q));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(x, sp));
+		if (_mm_movemask_epi8(m)) {
+			/* the loop below finds which one */
+			break;
+		}
+		p += 16;
+	}
+#endif
+	while ((p<end) && !CHARCLASS(*p, QUOTEDSTOP) && (*p!=quoted) && (*p!=space)) {
+		++p;
+	}
+	return p;
+}
+
+/**
+ * Copy the characters following the current one in a string, comment or XML
+ * text from the input to the line buffers at once, as long as the main loop
+ * would do nothing else than copying them one by one. Must only be called
+ * after an ordinary character is handled which doesn't end a comment, and
+ * not in the '%' quoting mode.
+ *
+ * @param Busl BUSL status
+ */
+static void __stdcall copyquoted(Busl *s) {
+	int pos = (s->inpos>s->outpos)? s->inpos: s->outpos;
+	const char *end = s->inend;
+	const char *p;
+	char space = s->quoted;
+	int len;
+	/* keep the room linespace() asks for */
+	if (end-s->inptr>s->bufsize-LINEMARGIN-pos) {
+		end = s->inptr+(s->bufsize-LINEMARGIN-pos);
+	}
+	if (s->quoted=='<') {
+		/* a space might follow "<script" */
+		int i = (s->inpos>8)? s->inpos-8: 0;
+		if (memchr(&s->inbuf[i], '<', s->inpos-i)) {
+			space = ' ';
+		}
+	}
+	p = skipquoted(s->inptr, end, s->quoted, space);
+	len = (int) (p-s->inptr);
+	memcpy(&s->inbuf[s->inpos], s->inptr, len);
+	s->inpos += len;
+	if ((!(s->flags&STRIPMODE)) || CHARCLASS(s->quoted, KEEPQUOTED)) {
+		memcpy(&s->outbuf[s->outpos], s->inptr, len);
+		s->outpos += len;
+	}
+	s->inptr = p;
+}
+
+/**
+ * Insert as many tabs/spaces in the line buffer as the indent level indicates
+ *
+ * @param Busl BUSL status
+ */
+static void __stdcall writeindent(Busl *s) {
+	int count;
+	if (!(s->flags&STRIPMODE)) {
+		if (s->tabs>=0) {
+			/* use spaces for indenting */
+			count = s->tabs*s->indent;
+			while (count--) {
+				s->outbuf[s->outpos++] = ' ';
+			}
+		} else {
+			/* use tabs for indenting */
+			count = s->indent;
+			while (count--) {
+				s->outbuf[s->outpos++] = '\t';
+			}
+		}
+	}
+}
+
+/**
+ * End the output line. If there are more than a single unclosed opening bracket in
+ * the line, then the line is split into multiple lines. In addition, the written
+ * output line is compared with the input line. If they are different the flag
+ * CHANGED is set.
+ *
+ * @param Busl BUSL status
+ */
+static void __stdcall writeline(Busl *s) {
+	int begwrite = 0;
+	int saveindent = s->indent;
+	int endwrite;
+	int linenum = s->linenum++;
+	s->outbuf[s->outpos++] = '\n';
+	if (!(s->flags&STRIPMODE)) {
+		if (*s->outbuf == '#' && s->tabs) {
+			/* If line starts with #region or #endregion, indent it normally. */
+			const char *p = s->outbuf;
+			if (!memcmp(++p, "end", 3)) {
+				p += 3;
+			}
+			if (!memcmp(p, "region", 6)) {
+				int indent = (s->tabs>0)? s->tabs*saveindent: saveindent;
+				memmove(&s->outbuf[indent], s->outbuf, s->outpos);
+				memset(s->outbuf, (s->tabs>0)? ' ': '\t', indent);
+				s->outpos += indent;
+			}
+		}
+		while (s->curindent<saveindent-1) {
+			/* There are to many unclosed opening brackets on this line,
+			 * so this line must be split */
+			int saveoutpos = s->outpos;
+			int splitoutpos;
+			if (CHARCLASS(s->indentstack[s->curindent++], XXXX10)) {
+				continue;
+			}
+			s->indent = s->curindent;
+			splitoutpos = endwrite = s->indentpos[s->indent];
+			s->flags |= CHANGED;
+			while (endwrite>0 && CHARCLASS(s->outbuf[endwrite-1], SPACES))
+				--endwrite;
+			writeout(s, &s->outbuf[begwrite], endwrite-begwrite);
+			/* the line end is written together with the indenting of the next line */
+			if (s->defaultflags&MACCRMODE) {
+				s->outbuf[s->outpos++] = '\r';
+				if (s->defaultflags&UNIXLFMODE) {
+					s->outbuf[s->outpos++] = '\n';
+				}
+			} else {
+				s->outbuf[s->outpos++] = '\n';
+			}
+			begwrite = splitoutpos;
+			++s->linenum;
+			writeindent(s);
+			writeout(s, &s->outbuf[saveoutpos], s->outpos-saveoutpos);
+			s->outpos = saveoutpos;
+		}
+	}
+	s->curindent = s->indent = saveindent;
+	if ((!(s->flags&STRIPMODE)) || (s->outpos>1) || !CHARCLASS(s->quoted, ISCOMMENT)) {
+		if (!(s->flags&CHANGED) && ((s->outpos!=s->inpos) || memcmp(s->outbuf, s->inbuf, s->outpos))) {
+			s->flags |= CHANGED;
+		}
+		if ((s->defaultflags&MACCRMODE) && s->outpos) {
+			s->outbuf[s->outpos-1] = '\r';
+			if (s->defaultflags&UNIXLFMODE) {
+				s->outbuf[s->outpos++] = '\n';
+			}
+		}
+		writeout(s, &s->outbuf[begwrite], s->outpos-begwrite);
+	} else {
+		s->flags |= CHANGED;
+	}
+	if (s->diff && s->diff->active) {
+		diffline(s);
+	}
+	if ((s->flags&CHANGED) && !s->changedline) {
+		/* the output lines are the same as the input lines until here */
+		s->changedline = linenum;
+	}
+	s->outpos = s->inpos = 0;
+	s->casescan = s->slashscan = s->slashpos = 0;
+}
+
+/**
+ * Write a single char to output. If the line is not within comment or quotes, indenting
+ * is applied. A newline ends the line, see writeline(). Inlined in lexmode(), so the
+ * mode is known at compile time there.
+ *
+ * @param Busl BUSL status
+ * @param c character to be written
+ * @param mode STRIPMODE or 0, the same as in s->flags
+ */
+static BUSL_INLINE void writecharmode(Busl *s, int c, int mode) {
+	if (c=='\n') {
+		writeline(s);
+	} else if ((!(mode&STRIPMODE)) || CHARCLASS(s->quoted, KEEPQUOTED)) {
+		if (!(s->outpos || (s->quoted && (s->quoted!='*') && (s->quoted!='+')))) {
+			writeindent(s);
+		}
+		s->outbuf[s->outpos++] = (char) c;
+	}
+}
+
+/**
+ * Stop converting line ends in the output, so a trailer can be appended
+ * unmodified. The output is opened in binary mode already, see writefile().
+ *
+ * @param Busl BUSL status
+ * @return 0 when the output file could not be opened
+ */
+static int __stdcall reopenbinary(Busl *s) {
+	/* the trailer is not part of the diff */
+	enddiff(s);
+	if (s->outname && !openoutput(s, s->outname)) {
+		return 0;
+	}
+	s->outcrlf = 0;
+	return 1;
+}
+
+/**
+ * Prepare the BUSL status for beautifying a new file. In automatic mode the
+ * file extension determines whether the generic or xml/html/sgml mode is used.
+ *
+ * @param Busl BUSL status
+ * @param filename filename, used in messages
+ * @param p file extension (0 if the filename has none)
+ */
+static void __stdcall setmode(Busl *s, const char *filename, const char *p) {
+	if (!s->stacksize) {
+		resetstack(s);
+	}
+	s->linenum = 1;
+	s->changedline = 0;
+	s->indent = s->curindent = s->inpos = s->outpos = 0;
+	s->casescan = s->slashscan = s->slashpos = 0;
+	s->indentflags[0] = 0;
+	s->commentquoted = s->cmdtype = 0;
+	s->incr = s->inraw = s->outcrlf = 0;
+	s->sink = 0;
+	s->outlen = 0;
+	if (p && (s->defaultflags&AUTOMODE)) {
+		if (checkext(p, xmlext, sizeof(xmlext))) {
+			s->flags |= XMLMODE;
+		} else if (checkext(p, genext, sizeof(genext))) {
+			s->flags &= ~XMLMODE;
+		}
+		if ((s->flags&STRIPMODE) && !(s->defaultflags&CHANGED) && checkext(p, nostripext, sizeof(nostripext))) {
+			warning(s, "%s: WARNING: \"s\" option should not be used for this file type.\n", filename, 0, 0);
+			warning(s, "(Ignored. Use \"f\" if you are really sure that you want this).\n", filename, 0, 0);
+			s->flags &= ~STRIPMODE;
+		}
+	}
+	s->quoted = 0;
+	s->numstrip = 0;
+	if (s->flags&XMLMODE) {
+		if (s->flags&ZIPMODE) {
+			warning(s, "%s: WARNING: \"z\" option cannot be combined with xml/html/sgml mode (ignored).\n", filename, 0, 0);
+			s->flags &= ~ZIPMODE;
+		}
+		s->quoted = '<';
+		s->flags &= ~SPACEHANDLING;
+		s->flags |= SPACEASIS;
+	}
+}
+
+/**
+ * Report that the line buffers could not be made large enough.
+ *
+ * @param Busl BUSL status
+ * @param filename filename, used in messages
+ * @return 1
+ */
+static int __stdcall outofmemory(Busl *s, const char *filename) {
+	warning(s, "%s(%d,%d): ERROR: out of memory (line too long).\n", filename, s->linenum, 0);
+	return 1;
+}
+
+/**
+ * Release the memory of checkpoints.
+ *
+ * @param st checkpoints
+ */
+static void __stdcall freestates(buslstates *st) {
+	free(st->cp);
+	free(st->stack);
+	free(st->input);
+	memset(st, 0, sizeof(buslstates));
+}
+
+/**
+ * Store an indent stack with the checkpoints.
+ *
+ * @param st checkpoints
+ * @param cp checkpoint, receives the index of the stored stack
+ * @param stack indent stack, cp->indent entries
+ * @return 0 when out of memory
+ */
+static int __stdcall savestack(buslstates *st, buslcheckpoint *cp, const char *stack) {
+	size_t len = (size_t) cp->indent;
+	if (st->stacklen+len>=st->stacksize) {
+		size_t size = 2*st->stacksize+len+256;
+		char *p = (char *) realloc(st->stack, size);
+		if (!p) {
+			return 0;
+		}
+		st->stack = p;
+		st->stacksize = size;
+	}
+	memcpy(&st->stack[st->stacklen], stack, len);
+	cp->stack = st->stacklen;
+	st->stacklen += len;
+	return 1;
+}
+
+/**
+ * Append a checkpoint.
+ *
+ * @param st checkpoints
+ * @param cp checkpoint
+ * @param stack indent stack of the checkpoint
+ * @return 0 when out of memory
+ */
+static int __stdcall addcheckpoint(buslstates *st, const buslcheckpoint *cp, const char *stack) {
+	if (st->count>=st->size) {
+		long size = st->size? 2*st->size: 64;
+		buslcheckpoint *p = (buslcheckpoint *) realloc(st->cp, size*sizeof(buslcheckpoint));
+		if (!p) {
+			return 0;
+		}
+		st->cp = p;
+		st->size = size;
+	}
+	st->cp[st->count] = *cp;
+	if (!savestack(st, &st->cp[st->count], stack)) {
+		return 0;
+	}
+	++st->count;
+	return 1;
+}
+
+/**
+ * Take the current state of the lexer as checkpoint.
+ *
+ * @param Busl BUSL status
+ * @param cp receives the state, except the indent stack
+ * @param offset offset in the input
+ * @param line input line number
+ */
+static void __stdcall getstate(const Busl *s, buslcheckpoint *cp, size_t offset, int line) {
+	cp->offset = offset;
+	cp->line = line;
+	cp->linenum = s->linenum;
+	cp->flags = s->flags&~CHANGED;
+	cp->indent = s->indent;
+	cp->curindent = s->curindent;
+	cp->numstrip = s->numstrip;
+	cp->quoted = s->quoted;
+	cp->commentquoted = s->commentquoted;
+	cp->cmdtype = s->cmdtype;
+	cp->stack = 0;
+}
+
+/**
+ * Check if the lexer is in the state of a checkpoint.
+ *
+ * @param Busl BUSL status
+ * @param cp checkpoint
+ * @param stack indent stack of the checkpoint
+ * @return 1 when the state is the same
+ */
+static int __stdcall samestate(const Busl *s, const buslcheckpoint *cp, const char *stack) {
+	return ((s->flags&~CHANGED)==cp->flags) && (s->indent==cp->indent) && (s->curindent==cp->curindent)
+			&& (s->numstrip==cp->numstrip) && (s->quoted==cp->quoted) && (s->commentquoted==cp->commentquoted)
+			&& (s->cmdtype==cp->cmdtype) && !memcmp(s->indentstack, stack, (size_t) cp->indent);
+}
+
+/**
+ * Put the lexer in the state of a checkpoint, the input continues at its line.
+ *
+ * @param Busl BUSL status
+ * @param cp checkpoint
+ * @param stack indent stack of the checkpoint
+ * @return 0 when out of memory
+ */
+static int __stdcall restorestate(Busl *s, const buslcheckpoint *cp, const char *stack) {
+	s->indent = cp->indent;
+	while (s->indent+STACKMARGIN>=s->stacksize) {
+		if (!stackspace(s)) {
+			return 0;
+		}
+	}
+	memcpy(s->indentstack, stack, (size_t) cp->indent);
+	s->linenum = cp->linenum;
+	s->flags = cp->flags|(s->defaultflags&CHANGED);
+	s->curindent = cp->curindent;
+	s->numstrip = cp->numstrip;
+	s->quoted = cp->quoted;
+	s->commentquoted = cp->commentquoted;
+	s->cmdtype = cp->cmdtype;
+	s->inpos = s->outpos = 0;
+	s->casescan = s->slashscan = s->slashpos = 0;
+	s->inptr = &s->inbase[cp->offset];
+	return 1;
+}
+
+/**
+ * Handle the start of an input line for busl_beautify_range(): switch the
+ * output on or off, record a checkpoint now and then, and after the range
+ * compare the state with the previous call.
+ *
+ * @param Busl BUSL status
+ * @return 1 when the state is the same as in the previous call at this point of
+ * the input, so the rest of the input doesn't need to be beautified again
+ */
+static int __stdcall checkpoint(Busl *s) {
+	buslcheckpoints *r = s->checkpoints;
+	size_t offset = (size_t) (s->inptr-s->inbase)-1;
+	const char *p = &s->inbase[r->counted];
+	const char *end = &s->inbase[offset];
+	buslcheckpoint cp;
+	if (offset && (end[-1]!='\n')) {
+		/* not the start of a line, e.g. after a tag in xml/html/sgml mode */
+		return 0;
+	}
+	while ((p<end) && ((p = (const char *) memchr(p, '\n', end-p))!=0)) {
+		++p;
+		++r->line;
+	}
+	r->counted = offset;
+	if (r->line<=r->first) {
+		/* (re)start the output here */
+		r->active = 1;
+		r->from = r->line;
+		s->outlen = 0;
+		s->flags = (s->flags&~CHANGED)|(s->defaultflags&CHANGED);
+	} else if (r->active && (r->line>r->last)) {
+		r->active = 0;
+		r->to = r->line-1;
+		r->changed = s->flags&CHANGED;
+	}
+	if (r->line-r->recorded>=CHECKPOINTLINES) {
+		getstate(s, &cp, offset, r->line);
+		if (addcheckpoint(&r->now, &cp, s->indentstack)) {
+			r->recorded = r->line;
+		}
+	}
+	if (r->to) {
+		/* compare with the checkpoint at the same place in the old input */
+		const buslstates *old = &r->old;
+		size_t shift = r->now.inputlen-old->inputlen; /* modulo, like the offsets */
+		while ((r->next<old->count) && (old->cp[r->next].offset<r->same)) {
+			++r->next;
+		}
+		while ((r->next<old->count) && (old->cp[r->next].offset+shift<offset)) {
+			++r->next;
+		}
+		if (old->hasend && (r->next<old->count) && (old->cp[r->next].offset+shift==offset)
+				&& samestate(s, &old->cp[r->next], &old->stack[old->cp[r->next].stack])) {
+			/* the rest is the same: take over the remaining checkpoints */
+			int lines = r->line-old->cp[r->next].line;
+			int linenums = s->linenum-old->cp[r->next].linenum;
+			long i;
+			for (i=r->next; i<old->count; ++i) {
+				cp = old->cp[i];
+				cp.offset += shift;
+				cp.line += lines;
+				cp.linenum += linenums;
+				if ((cp.line>r->recorded) && !addcheckpoint(&r->now, &cp, &old->stack[old->cp[i].stack])) {
 					break;
 				}
-				case ':': {
-					if (s->indent && s->indentstack[s->indent-1] == 'E') {
-						if (s->flags&SPACENEEDED) {
-							writechar(s, ' ', fout);
-						} else if (s->flags&SPACENEEDLF) {
-							writechar(s, '\n', fout);
+			}
+			if (old->hasend) {
+				cp = old->end;
+				cp.offset += shift;
+				cp.line += lines;
+				cp.linenum += linenums;
+				r->now.end = cp;
+				r->now.hasend = savestack(&r->now, &r->now.end, &old->stack[old->end.stack])
+						&& restorestate(s, &r->now.end, &r->now.stack[r->now.end.stack]);
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+#ifdef HAVE_THREADS
+/**
+ * Stop at the first line start from buslcheckpoints.stop, keeping the state
+ * there as buslcheckpoints.now.end, see lexparallel().
+ *
+ * @param Busl BUSL status
+ * @return 1 when the end of the chunk is reached
+ */
+static int __stdcall chunkend(Busl *s) {
+	buslcheckpoints *r = s->checkpoints;
+	size_t offset = (size_t) (s->inptr-s->inbase)-1;
+	if ((offset<r->stop) || (s->inbase[offset-1]!='\n')) {
+		return 0;
+	}
+	r->now.stacklen = 0;
+	getstate(s, &r->now.end, offset, 0);
+	r->now.hasend = savestack(&r->now, &r->now.end, s->indentstack);
+	return 1;
+}
+#endif
+
+/**
+ * Beautify the input. This is the main loop of BUSL: every character is read
+ * and handled according to the current quoting mode. It is inlined in an
+ * engine for each combination of XMLMODE and STRIPMODE, so the tests of
+ * these flags are done at compile time, see lex().
+ *
+ * @param Busl BUSL status
+ * @param filename filename, used in messages
+ * @param dest output filename, 0 when not writing to a file
+ * @param mode XMLMODE and STRIPMODE, the same as in s->flags
+ * @return 0 when successful, 1 when an error is reported
+ */
+static BUSL_INLINE int lexmode(Busl *s, const char *filename, const char *dest, int mode) {
+	int c = readchar(s);
+
+	if (!s->outbuf && !growbuffers(s, BUFSIZE)) {
+		return outofmemory(s, filename);
+	}
+
+	/*
+	 * Here the main loop of BUSL starts.
+	 */
+	while (c!=EOF) {
+		if (!s->inpos && !s->outpos && s->linestart && s->linestart(s)) {
+			/* the rest of the input is beautified elsewhere */
+			return 0;
+		}
+		if (!linespace(s)) {
+			return outofmemory(s, filename);
+		}
+		if (!stackspace(s)) {
+			warning(s, "%s(%d,%d): ERROR: out of memory (nesting too deep).\n", filename, s->linenum, 0);
+			return 1;
+		}
+		/* Special handling of the <CNRL>-Z character */
+		if (c=='\032') {
+			int savechar = readchar(s);
+			if (savechar!=EOF) {
+				if (s->diff && s->diff->active) {
+					/* the diff ends at <CTRL>-Z, the rest is not compared */
+					diffinput(s);
+					s->diff->input.len -= 2;
+				}
+				if (s->flags&(XMLMODE|ZIPMODE)) {
+					s->flags |= CHANGED;
+					warning(s, "%s: WARNING: <CTRL>-Z and everything after it is stripped.\n", filename, 0, 0);
+					break;
+				}
+				if (s->outpos) {
+					writecharmode(s, '\n', mode);
+				}
+				if (!reopenbinary(s)) {
+					warning(s, "%s: ERROR: cannot re-open in binary mode for writing trailer.\n", dest, 0, 0);
+					return 1;
+				}
+				/* copy <CTRL>-Z and everything after it unmodified */
+				s->outbuf[0] = (char) c;
+				s->outbuf[1] = (char) savechar;
+				writeout(s, s->outbuf, 2);
+				copytrailer(s);
+				s->inpos = s->outpos = 0;
+				s->casescan = s->slashscan = s->slashpos = 0;
+			}
+			break;
+		}
+		s->inbuf[s->inpos++] = (char) c;
+		if (s->quoted) {
+			if ((s->quoted=='%') && (c!='%') && (c!='?') && (c!='#')) {
+				s->quoted = '<';
+			}
+			switch (c) {
+				case ' ': {
+					if ((s->quoted=='<')) {
+						if ((s->inpos>=8) && !memcmp(&s->inbuf[s->inpos-8], scripttag, 7)) {
+							do {
+								if (!linespace(s)) {
+									return outofmemory(s, filename);
+								}
+								writecharmode(s, c, mode);
+								/* read one char from input stream. */
+								c = readchar(s);
+								s->inbuf[s->inpos++] = (char) c;
+							} while (c!=EOF && !CHARCLASS(c, ISGTORCTRLZ));
+							if (c!='>') {
+								--s->inpos;
+								continue;
+							}
+							s->quoted = s->cmdtype = 0;
+							s->flags &= ~SPACEHANDLING;
+							s->flags |= SPACESTRIP;
 						}
-						writechar(s, ':', fout);
-						s->flags &= ~SPACEHANDLING;
+					}
+					if (s->flags&SPACESTRIP) {
+						if (s->inpos>s->numstrip) {
+							s->flags &= ~SPACEHANDLING;
+							s->flags |= SPACEASIS;
+							writecharmode(s, c, mode);
+						}
+					} else {
+						writecharmode(s, c, mode);
+					}
+					break;
+				}
+				case '\a': {/* alert, audible alarm, bell */
+					if (CHARCLASS(s->quoted, ISCOMMENTORXML)) {
+						writecharmode(s, c, mode);
+					} else {
+						writecharmode(s, '\\', mode);
+						writecharmode(s, 'a', mode);
+					}
+					break;
+				}
+				case '\b': {/* backspace */
+					if (CHARCLASS(s->quoted, ISCOMMENTORXML)) {
+						writecharmode(s, c, mode);
+					} else {
+						writecharmode(s, '\\', mode);
+						writecharmode(s, 'b', mode);
+					}
+					break;
+				}
+				case '\f': {/* formfeed */
+					if (CHARCLASS(s->quoted, ISCOMMENTORXML)) {
+						writecharmode(s, c, mode);
+					} else {
+						writecharmode(s, '\\', mode);
+						writecharmode(s, 'f', mode);
+					}
+					break;
+				}
+				case '\t': {/* horizontal tab */
+					if ((s->quoted=='<')) {
+						if ((s->inpos>=8) && !memcmp(&s->inbuf[s->inpos-8], scripttag, 7)) {
+							do {
+								if (!linespace(s)) {
+									return outofmemory(s, filename);
+								}
+								writecharmode(s, c, mode);
+								/* read one char from input stream. */
+								c = readchar(s);
+								s->inbuf[s->inpos++] = (char) c;
+							} while (c!=EOF && !CHARCLASS(c, ISGTORCTRLZ));
+							if (c=='>') {
+								writecharmode(s, c, mode);
+								s->quoted = s->cmdtype = 0;
+								s->flags &= ~SPACEHANDLING;
+								s->flags |= SPACENEEDED;
+							} else {
+								--s->inpos;
+								continue;
+							}
+						}
+					} else if (CHARCLASS(s->quoted, ISCCOMMENT) && (s->flags&SPACESTRIP) && (s->inpos>s->numstrip)) {
+						s->flags &= ~SPACEHANDLING;
+						s->flags |= SPACEASIS;
+					}
+
+					if (!(s->flags&SPACESTRIP)) {
+						if ((s->commentquoted=='`') || strchr("<`", s->quoted)) {
+							writecharmode(s, c, mode);
+						} else if (s->commentquoted || !CHARCLASS(s->quoted, ISCOMMENT)) {
+							writecharmode(s, '\\', mode);
+							writecharmode(s, 't', mode);
+						} else if (!s->tabs) {
+							writecharmode(s, c, mode);
+						} else {
+							int numtabs = s->numstrip>0? s->numstrip: 0;
+							int td = s->tabs;
+							if (td<0) td = -td;
+							s->flags |= CHANGED;
+							s->inbuf[s->inpos-1] = ' '; /* XXX This is suspicious*/
+							writecharmode(s, ' ', mode);
+							while ((numtabs<s->inpos) && (s->inbuf[numtabs]=='\t')) numtabs++;
+							while ((s->inpos-numtabs)%td) {
+								writecharmode(s, ' ', mode);
+								s->inbuf[s->inpos++] = ' '; /* XXX This is suspicious*/
+							}
+						}
+					}
+					break;
+				}
+				case '\v': {/* vertical tab */
+					if (CHARCLASS(s->quoted, ISCOMMENTORXML)) {
+						writecharmode(s, c, mode);
+					} else {
+						writecharmode(s, '\\', mode);
+						writecharmode(s, 'v', mode);
+					}
+					break;
+				}
+				case '\n': {
+					if (s->quoted=='<') {
+						if ((s->inpos>=8) && !memcmp(&s->inbuf[s->inpos-8], scripttag, 7)) {
+							do {
+								if (!linespace(s)) {
+									return outofmemory(s, filename);
+								}
+								writecharmode(s, c, mode);
+								/* read one char from input stream. */
+								c = readchar(s);
+								s->inbuf[s->inpos++] = (char) c;
+							} while (c!=EOF && !CHARCLASS(c, ISGTORCTRLZ));
+							if (c=='>') {
+								writecharmode(s, c, mode);
+								s->quoted = s->cmdtype = 0;
+								s->flags &= ~SPACEHANDLING;
+								s->flags |= SPACENEEDED;
+							} else {
+								--s->inpos;
+								continue;
+							}
+						}
+					} else if (CHARCLASS(s->quoted, ISCOMMENT)) {
+						int backslashpos;
+						if (!(s->flags&BACKSLASH)) {
+							s->flags &= ~SPACEHANDLING;
+							s->flags |= SPACESTRIP;
+							if ((s->outpos>0) && CHARCLASS(s->outbuf[s->outpos-1], SPACES)) {
+								s->flags &= ~BACKSLASH;
+								s->outbuf[s->outpos--] = 0;
+								while ((s->outpos>0) && CHARCLASS(s->outbuf[s->outpos-1], SPACES)) --s->outpos;
+								s->casescan = 0;
+								backslashpos = s->outpos;
+								while ((backslashpos>0) && (s->outbuf[backslashpos-1]=='\\')) --backslashpos;
+								if ((backslashpos-s->outpos) &1) {
+									s->flags &= ~SPACEHANDLING;
+									s->flags |= (BACKSLASH|SPACEASIS);
+									if (!(s->defaultflags&QUIETMODE)) {
+										warning(s, "%s(%d,%d): WARNING: Backslash followed by space(s) detected in end of comment.\n", filename, s->linenum, 0);
+										warning(s, "Assuming this comment is meant to continue at the next line\n%s\n", s->outbuf, 0, 0);
+									}
+								}
+							}
+						}
+						if (mode&XMLMODE && mode&STRIPMODE && (s->quoted=='\n')) {
+							if (commentend(s)) {
+								strcpy(&s->outbuf[s->outpos], "//-->");
+								s->outpos += 5;
+							}
+						}
+					}
+					writecharmode(s, c, mode);
+					break;
+				}
+				case '>': {
+					if (s->quoted=='<') {
+						if ((s->inpos>=8) && !memcmp(&s->inbuf[s->inpos-8], scripttag, 7)) {
+							s->quoted = s->cmdtype = 0;
+						}
+					} else if (mode&XMLMODE) {
+						if (s->cmdtype) {
+							if (s->outpos && (s->outbuf[s->outpos-1]==s->cmdtype)) {
+								if (s->quoted=='\n') {
+									s->quoted = '%'; s->cmdtype = 0;
+								} else {
+									s->outbuf[s->outpos] = 0;
+									warning(s, "%s(%d,%d): WARNING: '%c>' found in string or comment (ignored).\n", filename, s->linenum, s->cmdtype);
+									warning(s, "%s%c...\n", s->outbuf, 0, (char) c);
+								}
+							}
+						} else if ((s->inpos>=9) && !memcmp(&s->inbuf[s->inpos-9], endscripttag, 8)) {
+							if (s->quoted=='\n') {
+								s->quoted = '%'; s->cmdtype = 0;
+								if (mode&STRIPMODE) {
+									if (commentend(s)) {
+										if (s->outpos && s->outbuf[s->outpos-1]==' ') {
+											s->outpos--;
+										}
+										strcpy(&s->outbuf[s->outpos], "//-->");
+										s->outpos += 5;
+									}
+									strcpy(&s->outbuf[s->outpos], endscripttag);
+									s->outpos += 8;
+								}
+							} else {
+								s->outbuf[s->outpos] = 0;
+								s->outpos -= 7;
+								warning(s, "%s(%d,%d): WARNING: '</script>' found in string or comment (ignored).\n", filename, s->linenum, 0);
+								s->outpos += 7;
+								warning(s, "%s%c...\n", s->outbuf, 0, (char) c);
+							}
+						}
+					} else if (s->flags&SPACESTRIP) {
+						s->flags &= ~SPACEHANDLING;
+						s->flags |= SPACEASIS;
+					}
+					writecharmode(s, c, mode);
+					break;
+				}
+				case '\"':
+				case '\'':
+				case '`': {
+					if (!(s->flags&BACKSLASH)) {
+						if (CHARCLASS(s->quoted, ISCOMMENT)) {
+							if (!s->commentquoted) {
+								s->commentquoted = (char) c;
+							} else if (c==s->commentquoted) {
+								s->commentquoted = 0;
+							}
+						}
+					}
+					if (s->flags&SPACESTRIP) {
+						s->flags &= ~SPACEHANDLING;
+						s->flags |= SPACEASIS;
+					}
+					writecharmode(s, c, mode);
+					break;
+				}
+				default: {
+					if (s->flags&SPACESTRIP) {
+						s->flags &= ~SPACEHANDLING;
+						s->flags |= SPACEASIS;
+					}
+					writecharmode(s, c, mode);
+					if ((s->quoted!='%') && (c!=s->quoted) && !CHARCLASS(c, QUOTEDSTOP) && !(s->flags&ALMOSTEND)) {
+						/* the characters following it are probably ordinary as well */
+						copyquoted(s);
+					}
+					break;
+				}
+			}
+			if (s->flags&BACKSLASH) {
+				s->flags &= ~BACKSLASH;
+			} else if (CHARCLASS(s->quoted, ISCCOMMENT)) {
+				if (c==s->quoted) {
+					s->flags |= ALMOSTEND;
+				} else if (s->flags&ALMOSTEND) {
+					if (c=='/') {
+						s->quoted = 0;
+						s->numstrip = 0;
+						s->flags &= ~SPACEHANDLING;
+						if (mode&STRIPMODE) {
+							if (!s->outpos || CHARCLASS(s->outbuf[s->outpos-1], XXXX15)) {
+								s->flags |= SPACESTRIP;
+							} else {
+								s->flags |= SPACENEEDED;
+							}
+						} else {
+							s->flags |= SPACEASIS;
+						}
+					}
+					s->flags &= ~ALMOSTEND;
+				}
+			} else if (c=='\\') {
+				if (s->quoted!='`') {
+					s->flags |= BACKSLASH;
+				}
+			} else if ((s->quoted=='%') && (c=='?'||c=='#')) {
+				s->quoted = 0;
+				s->numstrip = 0;
+				s->cmdtype = (char) c;
+				s->flags &= ~(SPACEHANDLING|BACKSLASH);
+				s->flags |= SPACEASIS;
+			} else if (s->quoted==c) {
+				if (c=='<') {
+					s->quoted = '%';
+				} else {
+					s->quoted = 0;
+					s->numstrip = 0;
+					s->flags &= ~(SPACEHANDLING|BACKSLASH);
+					if (c=='\n') {
+						s->flags |= SPACESTRIP;
+					} else {
+						s->flags |= SPACEASIS;
+						if (c=='%') {
+							c = readchar(s);
+							if (c=='@') {
+								s->quoted = '<';
+								continue;
+							} else if (c=='=') {
+								s->inbuf[s->inpos++] = (char) c;
+								writecharmode(s, c, mode);
+								c = readchar(s);
+							}
+							s->cmdtype = (char) '%';
+							continue;
+						}
+					}
+				}
+			}
+		} else {
+			switch (c) {
+				case '\'':
+				case '\"':
+				case '`': {
+					char newquoted;
+					newquoted = (char) c;
+					if (s->flags&SPACENEEDED) {
+						writecharmode(s, ' ', mode);
+					} else if (s->flags&SPACENEEDLF) {
+						writecharmode(s, '\n', mode);
+					}
+					if (!(mode&STRIPMODE) || (newquoted!='\n')) {
+						writecharmode(s, c, mode);
+					}
+					s->quoted = newquoted;
+					s->flags &= ~SPACEHANDLING;
+					s->flags |= SPACEASIS;
+					break;
+				}
+				case ':': {
+					if (s->indent && s->indentstack[s->indent-1] == 'E') {
+						if (s->flags&SPACENEEDED) {
+							writecharmode(s, ' ', mode);
+						} else if (s->flags&SPACENEEDLF) {
+							writecharmode(s, '\n', mode);
+						}
+						writecharmode(s, ':', mode);
+						s->flags &= ~SPACEHANDLING;
 						s->flags |= SPACEASIS;
 						break;
 					}
 					s->flags &= ~EXTRAINDENT;
-					c = fgetc(fin);
-					if (c=='\r') {
-						/* If it is CR then read one character ahead. */
-						savechar = fgetc(fin);
-						c = '\n';
-					} else if (c==':') {
+					c = readchar(s);
+					if (c==':') {
 						/* If it is ':' then we found a namespace "::" operator. */
 						s->inbuf[s->inpos++] = (char) c;
-						writechar(s, c, fout);
-						writechar(s, c, fout);
+						writecharmode(s, c, mode);
+						writecharmode(s, c, mode);
 						s->flags &= ~SPACEHANDLING;
 						s->flags |= SPACEASIS;
 						break;
@@ -936,7 +2395,7 @@ int __stdcall busl_beautify(Busl *s, const char *filename) {
 						/* This colon is part of a ?: construct */
 						s->indentstack[s->indent-1] = ';';
 						s->flags &= ~SPACEHANDLING;
-						if (s->flags&STRIPMODE) {
+						if (mode&STRIPMODE) {
 							s->flags |= SPACESTRIP;
 						} else if (s->indent<=s->curindent) {
 							s->flags |= SPACENEEDLF;
@@ -946,28 +2405,37 @@ int __stdcall busl_beautify(Busl *s, const char *filename) {
 					} else {
 						/* This colon is not part of a ?: construct, so it might be part of
 						 * a switch statement or a label */
-						if ((s->indent==s->curindent) && !(s->flags&STRIPMODE)) {
+						if ((s->indent==s->curindent) && !(mode&STRIPMODE)) {
 							int islabel;
 							int pos = s->outpos-3;
-							while ((pos>=0) && memcmp(&s->outbuf[pos], "case", 4)) --pos;
+							/* only the part of the line after the previous colon needs to be scanned */
+							int stop = (s->casescan<=pos)? s->casescan: 0;
+							while ((pos>=stop) && memcmp(&s->outbuf[pos], "case", 4)) --pos;
+							if (pos<stop) {
+								pos = stop? s->casefound: -1;
+							}
+							if (pos<s->outpos-3) {
+								s->casescan = s->outpos-3;
+								s->casefound = pos;
+							}
 							if (pos>0) {
-								islabel = strchr(BEFORETOKEN, s->outbuf[pos-1])!=0;
+								islabel = CHARCLASS(s->outbuf[pos-1], BEFORETOKEN)!=0;
 							} else {
 								islabel = pos>=0;
 							}
 							if (islabel) {
 								/* This is a case statement */
 								s->flags |= EXTRAINDENT;
-							} else if (checkkey(s, "default")) {
+							} else if (lastkey(s)==KEYDEFAULT) {
 								islabel = 1;
 								s->flags |= EXTRAINDENT;
 							} else {
 								pos = s->outpos-1;
-								while (pos>=0 && !strchr(BEFORETOKEN, s->outbuf[pos])) {
+								while (pos>=0 && !CHARCLASS(s->outbuf[pos], BEFORETOKEN)) {
 									--pos;
 								}
 								if (pos!=s->outpos-1) {
-									while (pos>=0 && strchr(SPACES, s->outbuf[pos])) {
+									while (pos>=0 && CHARCLASS(s->outbuf[pos], SPACES)) {
 										--pos;
 									}
 									islabel = pos<0;
@@ -983,20 +2451,21 @@ int __stdcall busl_beautify(Busl *s, const char *filename) {
 									if (backsndent && s->outpos>=backsndent) {
 										s->outpos -= backsndent;
 										memmove(s->outbuf, &s->outbuf[backsndent], s->outpos);
+										s->casescan = 0;
 									}
 								}
 							}
 						}
 						s->flags &= ~SPACEHANDLING;
-						if (s->flags&STRIPMODE) {
+						if (mode&STRIPMODE) {
 							s->flags |= SPACESTRIP;
-						} else if ((s->inpos>1) && strchr(XXXX16, s->inbuf[s->inpos-2])) {
+						} else if ((s->inpos>1) && CHARCLASS(s->inbuf[s->inpos-2], XXXX16)) {
 							s->flags |= SPACEASIS;
 						} else {
 							s->flags |= SPACENEEDED;
 						}
 					}
-					writechar(s, ':', fout);
+					writecharmode(s, ':', mode);
 					continue;
 				}
 				case ';':
@@ -1005,55 +2474,51 @@ int __stdcall busl_beautify(Busl *s, const char *filename) {
 					if (c == ';' && newindent && s->indentstack[newindent-1]=='E') {
 						newindent--;
 					} else {
-						while (newindent && strchr(XXXX12, s->indentstack[newindent-1])) {
+						while (newindent && CHARCLASS(s->indentstack[newindent-1], XXXX12)) {
 							newindent--;
 						}
 					}
 					s->flags &= ~(SPACEHANDLING|EXTRAINDENT);
-					if (s->flags&STRIPMODE) {
+					if (mode&STRIPMODE) {
 						s->flags |= SPACESTRIP;
-					} else if ((s->inpos>1) && strchr(XXXX16, s->inbuf[s->inpos-2])) {
+					} else if ((s->inpos>1) && CHARCLASS(s->inbuf[s->inpos-2], XXXX16)) {
 						s->flags |= SPACEASIS;
 					} else {
 						s->flags |= SPACENEEDED;
 					}
-					writechar(s, c, fout);
+					writecharmode(s, c, mode);
 					s->indent = newindent;
 					break;
 				}
 				case '=': {
-					if (s->flags&STRIPMODE) {
+					if (mode&STRIPMODE) {
 						s->flags &= ~SPACEHANDLING;
 						s->flags |= SPACESTRIP;
-					} else if ((s->inpos>1) && strchr(XXXX16, s->inbuf[s->inpos-2])) {
+					} else if ((s->inpos>1) && CHARCLASS(s->inbuf[s->inpos-2], XXXX16)) {
 						s->flags &= ~SPACEHANDLING;
 						s->flags |= SPACEASIS;
 					} else {
 						int i;
 						int spaceinsert;
 						if (s->flags&SPACENEEDED) {
-							writechar(s, ' ', fout);
+							writecharmode(s, ' ', mode);
 						} else if (s->flags&SPACENEEDLF) {
-							writechar(s, '\n', fout);
+							writecharmode(s, '\n', mode);
 						}
 						s->flags &= ~SPACEHANDLING;
 						i = s->outpos-1;
-						while ((i>=0) && strchr(XXXX17, s->outbuf[i])) i--;
+						while ((i>=0) && CHARCLASS(s->outbuf[i], XXXX17)) i--;
 						spaceinsert = i+1;
-						while ((i>=0) && strchr(SPACES, s->outbuf[i])) {
+						while ((i>=0) && CHARCLASS(s->outbuf[i], SPACES)) {
 							--i;
 							spaceinsert = 0;
 						}
 						if ((i>6) && !memcmp(&s->outbuf[i-7], "operator", 8)) {
 							s->flags |= SPACEASIS;
 						} else {
-							writechar(s, '=', fout);
-							c = fgetc(fin);
-							if (c=='\r') {
-								/* If it is CR then read one character ahead. */
-								savechar = fgetc(fin);
-								c = '\n';
-							}
+							writecharmode(s, '=', mode);
+							c = readchar(s);
+
 							if (strchr("=>", c)) {
 								/* Special cases "==" and "=>" (php) operators. */
 								s->flags |= SPACEASIS;
@@ -1063,85 +2528,87 @@ int __stdcall busl_beautify(Busl *s, const char *filename) {
 									memmove(s->outbuf+spaceinsert+1, s->outbuf+spaceinsert, s->outpos-spaceinsert);
 									s->outbuf[spaceinsert] = ' ';
 									s->outpos++;
+									s->casescan = 0;
 								}
 								s->flags |= SPACENEEDED;
 							}
 							continue;
 						}
 					}
-					writechar(s, c, fout);
+					writecharmode(s, c, mode);
 					break;
 				}
 				case '?': {
 					s->indentpos[s->indent] = s->outpos;
 					s->flags &= ~SPACEHANDLING;
-					if (s->flags&STRIPMODE) {
+					if (mode&STRIPMODE) {
 						s->flags |= SPACESTRIP;
-					} else if ((s->inpos>1) && strchr(XXXX16, s->inbuf[s->inpos-2])) {
+					} else if ((s->inpos>1) && CHARCLASS(s->inbuf[s->inpos-2], XXXX16)) {
 						s->flags |= SPACEASIS;
 					} else {
 						s->flags |= SPACENEEDED;
 					}
-					writechar(s, c, fout);
+					writecharmode(s, c, mode);
 					s->indentstack[s->indent++] = ':';
 					s->indentflags[s->indent] = s->indentflags[s->indent-1];
 					break;
 				}
 				case '(': {
 					char indenttype = ')';
-					if (checkkey(s, "elseif")) {
+					int key = lastkey(s);
+					if (key==KEYELSEIF) {
 						indenttype = '(';
-					} else if (checkkey(s, "if") || checkkey(s, "for") || checkkey(s, "while")) {
+					} else if ((key==KEYIF) || (key==KEYFOR) || (key==KEYWHILE)) {
 						if (s->indent && s->indentstack[s->indent-1]==';') --s->indent;
 						indenttype = '(';
 					}
-					if (!(s->flags&STRIPMODE)) {
+					if (!(mode&STRIPMODE)) {
 						if (s->flags&SPACENEEDED) {
-							writechar(s, ' ', fout);
+							writecharmode(s, ' ', mode);
 						} else if (s->flags&SPACENEEDLF) {
-							writechar(s, '\n', fout);
+							writecharmode(s, '\n', mode);
 						}
 					}
 					s->indentpos[s->indent] = s->outpos;
 					s->flags &= ~SPACEHANDLING;
 					s->flags |= SPACESTRIP;
-					writechar(s, c, fout);
+					writecharmode(s, c, mode);
 					s->indentstack[s->indent++] = indenttype;
 					s->indentflags[s->indent] = s->indentflags[s->indent-1];
 					break;
 				}
 				case '{': {
 					if (s->flags&EXTRAINDENT) {
-						if (s->indent && strchr(XXXX13, s->indentstack[s->indent-1])) --s->indent;
+						if (s->indent && CHARCLASS(s->indentstack[s->indent-1], XXXX13)) --s->indent;
 						s->flags &= ~EXTRAINDENT;
 					}
-					if (!(s->flags&STRIPMODE)) {
+					if (!(mode&STRIPMODE)) {
 						if (s->flags&SPACENEEDLF) {
-							writechar(s, '\n', fout);
-						} else if ((s->flags&SPACENEEDED) || (s->outpos && (!strchr(XXXX18, s->outbuf[s->outpos-1])))) {
-							writechar(s, ' ', fout);
+							writecharmode(s, '\n', mode);
+						} else if ((s->flags&SPACENEEDED) || (s->outpos && (!CHARCLASS(s->outbuf[s->outpos-1], XXXX18)))) {
+							writecharmode(s, ' ', mode);
 						}
 					}
 					s->indentpos[s->indent] = s->outpos;
 					s->flags &= ~SPACEHANDLING;
 					s->flags |= SPACESTRIP;
-					writechar(s, c, fout);
+					writecharmode(s, c, mode);
 					s->indentstack[s->indent++] = '}';
 					s->indentflags[s->indent] = s->indentflags[s->indent-1];
 					break;
 				}
 				case '[': {
-					if (!(s->flags&STRIPMODE) && ((s->inpos<8) || !memcmp(&s->inbuf[s->inpos-8], "delete", 6))) {
+					if (!(mode&STRIPMODE) && ((s->inpos<8) || !memcmp(&s->inbuf[s->inpos-8], "delete", 6))) {
 						if (s->flags&SPACENEEDED) {
-							writechar(s, ' ', fout);
+							writecharmode(s, ' ', mode);
 						} else if (s->flags&SPACENEEDLF) {
-							writechar(s, '\n', fout);
+							writecharmode(s, '\n', mode);
 						}
 					}
 					s->indentpos[s->indent] = s->outpos;
 					s->flags &= ~SPACEHANDLING;
 					s->flags |= SPACESTRIP;
-					writechar(s, c, fout);
+					writecharmode(s, c, mode);
 					s->indentstack[s->indent++] = ']';
 					s->indentflags[s->indent] = s->indentflags[s->indent-1];
 					break;
@@ -1150,19 +2617,19 @@ int __stdcall busl_beautify(Busl *s, const char *filename) {
 				case '}':
 				case ']': {
 					int newindent;
-					while (s->indent && strchr(XXXX11, s->indentstack[s->indent-1])) {
+					while (s->indent && CHARCLASS(s->indentstack[s->indent-1], XXXX11)) {
 						s->indent--;
 					}
 					newindent = s->indent;
 					if ((newindent>0) && (c==')') && (s->indentstack[newindent-1]=='(')) {
-						if (!(s->flags&STRIPMODE) && (s->indent<s->curindent) && s->outpos) {
-							writechar(s, '\n', fout);
+						if (!(mode&STRIPMODE) && (s->indent<s->curindent) && s->outpos) {
+							writecharmode(s, '\n', mode);
 						}
 						s->indentstack[--s->indent] = ';';
 						s->flags |= EXTRAINDENT;
 					} else if ((newindent>0) && (c==s->indentstack[newindent-1])) {
-						if (!(s->flags&STRIPMODE) && (s->indent<s->curindent) && s->outpos) {
-							writechar(s, '\n', fout);
+						if (!(mode&STRIPMODE) && (s->indent<s->curindent) && s->outpos) {
+							writecharmode(s, '\n', mode);
 						}
 						newindent = --s->indent;
 					} else if (!(s->defaultflags&QUIETMODE)) {
@@ -1171,254 +2638,2303 @@ int __stdcall busl_beautify(Busl *s, const char *filename) {
 						warning(s, "%s%c...\n", s->outbuf, 0, (char) c);
 					}
 					s->flags &= ~SPACEHANDLING;
-					if (s->flags&STRIPMODE) {
+					if (mode&STRIPMODE) {
 						s->flags |= SPACESTRIP;
 					} else {
 						s->flags |= SPACEASIS;
 					}
-					writechar(s, c, fout);
+					writecharmode(s, c, mode);
 					s->indent = newindent;
 					break;
 				}
 				case ' ':
 				case '\t':
 				case '\n': {
-					if (checkkey(s, "EXEC")) {
+					int key = lastkey(s);
+					if (key==KEYEXEC) {
+						s->indentpos[s->indent] = s->outpos;
 						s->indentstack[s->indent++] = 'E';
-					} else if (checkkey(s, "else") || checkkey(s, "do")) {
+					} else if ((key==KEYELSE) || (key==KEYDO)) {
 						if (!(s->flags&EXTRAINDENT)) {
+							s->indentpos[s->indent] = s->outpos;
 							s->indentstack[s->indent++] = ';';
 						}
 						s->flags |= EXTRAINDENT;
-					} else if (checkkey(s, "done") && s->indent && s->indentstack[s->indent-1]==';') {
+					} else if ((key==KEYDONE) && s->indent && s->indentstack[s->indent-1]==';') {
 						int backsndent = (s->tabs>=0)? s->tabs: 1;
 						s->indent--;
 						s->flags &= ~EXTRAINDENT;
-						if (backsndent && !(s->flags&STRIPMODE)) {
+						if (backsndent && !(mode&STRIPMODE)) {
 							s->outpos -= backsndent;
 							memmove(s->outbuf, &s->outbuf[backsndent], s->outpos);
+							s->casescan = 0;
 						}
 					}
 					if (c=='\n') {
 						s->flags &= ~SPACEHANDLING;
 						s->flags |= SPACESTRIP;
-						writechar(s, c, fout);
+						writecharmode(s, c, mode);
 					} else if (!(s->flags&(SPACESTRIP|SPACENEEDLF))) {
 						s->flags &= ~SPACEHANDLING;
 						s->flags |= SPACENEEDED;
 					}
 					break;
 				}
-				case '/': {
-					char nextquoted = s->quoted;
-					char prevchar = (char) (s->outpos? s->outbuf[s->outpos-1]: (char) 0);
-					if (s->flags&SPACENEEDED) {
-						writechar(s, ' ', fout);
-					} else if (s->flags&SPACENEEDLF) {
-						writechar(s, '\n', fout);
-					}
-					c = fgetc(fin);
-					if (c=='\r') {
-						/* If it is CR then read one character ahead. */
-						savechar = fgetc(fin);
-						c = '\n';
-					}
-					if (c=='/') {
-						nextquoted = '\n';
-						s->commentquoted = 0;
-					} else if (c=='*' || c=='+') {
-						s->inbuf[s->inpos++] = (char) c;
-						nextquoted = (char) c;
-						s->commentquoted = 0;
-						if (s->flags&STRIPMODE) {
-							s->flags &= ~SPACEHANDLING;
-							s->flags |= s->outpos? SPACESTRIP: SPACENEEDED;
-							s->numstrip = 0;
-						} else {
-							writechar(s, '/', fout);
-							s->numstrip = (s->tabs>=0)? s->indent * s->tabs: s->indent;
-							s->numstrip += s->inpos-s->outpos-1;
-							writechar(s, c, fout);
-						}
-						s->quoted = nextquoted;
-						break;
-					} else if (strchr(XXXX14, prevchar)) {
-						nextquoted = '/';
-						s->commentquoted = 0;
-					}
-					s->flags &= ~SPACEHANDLING;
-					s->flags |= SPACEASIS;
-					if (!(nextquoted && (s->flags&STRIPMODE))) {
-						writechar(s, '/', fout);
-					}
-					s->quoted = nextquoted;
-					continue;
+				case '/': {
+					char nextquoted = s->quoted;
+					char prevchar = (char) (s->outpos? s->outbuf[s->outpos-1]: (char) 0);
+					if (s->flags&SPACENEEDED) {
+						writecharmode(s, ' ', mode);
+					} else if (s->flags&SPACENEEDLF) {
+						writecharmode(s, '\n', mode);
+					}
+					c = readchar(s);
+
+					if (c=='/') {
+						nextquoted = '\n';
+						s->commentquoted = 0;
+					} else if (c=='*' || c=='+') {
+						s->inbuf[s->inpos++] = (char) c;
+						nextquoted = (char) c;
+						s->commentquoted = 0;
+						if (mode&STRIPMODE) {
+							s->flags &= ~SPACEHANDLING;
+							s->flags |= s->outpos? SPACESTRIP: SPACENEEDED;
+							s->numstrip = 0;
+						} else {
+							writecharmode(s, '/', mode);
+							s->numstrip = (s->tabs>=0)? s->indent * s->tabs: s->indent;
+							s->numstrip += s->inpos-s->outpos-1;
+							writecharmode(s, c, mode);
+						}
+						s->quoted = nextquoted;
+						break;
+					} else if (CHARCLASS(prevchar, XXXX14)) {
+						nextquoted = '/';
+						s->commentquoted = 0;
+					}
+					s->flags &= ~SPACEHANDLING;
+					s->flags |= SPACEASIS;
+					if (!(nextquoted && (mode&STRIPMODE))) {
+						writecharmode(s, '/', mode);
+					}
+					s->quoted = nextquoted;
+					continue;
+				}
+				case '#': {
+					if (s->flags&(SPACENEEDED|SPACENEEDLF)) {
+						writecharmode(s, ' ', mode);
+					}
+					if (!s->outpos) {
+						s->quoted = '\n';
+						s->commentquoted = 0;
+					}
+					s->flags &= ~SPACEHANDLING;
+					s->flags |= SPACEASIS;
+					writecharmode(s, c, mode);
+					break;
+				}
+				case '>': {
+					/* Check for occurrence of "%>", "#>", "?>", "</script>" or "/>" */
+					if (mode&XMLMODE) {
+						if (s->cmdtype) {
+							if ((s->inpos>=2) && (s->inbuf[s->inpos-2]==s->cmdtype)) {
+								s->quoted = '<';
+								if (s->indent && s->indentstack[s->indent-1]==':') {
+									s->indent--;
+								}
+								/* remove any spaces before %>, #> or ?> */
+								while ((s->outpos>1) && ((s->outbuf[s->outpos-2]==' ') || (s->outbuf[s->outpos-2]=='\t'))) {
+									--s->outpos;
+								}
+								s->casescan = 0;
+								if (s->outpos) {
+									s->outbuf[s->outpos-1] = s->cmdtype;
+								}
+								s->flags &= ~SPACEHANDLING;
+								s->flags |= SPACEASIS;
+							}
+						} else {
+							if ((s->inpos>=2) && (s->inbuf[s->inpos-2]=='/') && ((s->inpos<3) || (s->inbuf[s->inpos-3]!='*'))) {
+								s->quoted = '<';
+								/* remove any spaces before '/' */
+								while ((s->outpos>1) && ((s->outbuf[s->outpos-2]==' ') || (s->outbuf[s->outpos-2]=='\t'))) {
+									--s->outpos;
+								}
+								s->casescan = 0;
+								if (s->outpos) {
+									s->outbuf[s->outpos-1] = '/';
+								}
+								s->flags &= ~SPACEHANDLING;
+								s->flags |= SPACEASIS;
+							} else if ((s->outpos>=8) && !(s->flags&SPACENEEDED) && !memcmp(&s->outbuf[s->outpos-8], endscripttag, 8)) {
+								s->quoted = '<';
+								/* remove any spaces before </script */
+								while ((s->outpos>8) && ((s->outbuf[s->outpos-9]==' ') || (s->outbuf[s->outpos-9]=='\t'))) {
+									--s->outpos;
+								}
+								s->casescan = 0;
+								memcpy(&s->outbuf[s->outpos-8], endscripttag, 8);
+								s->flags &= ~SPACEHANDLING;
+								s->flags |= SPACEASIS;
+							}
+						}
+					}
+					/* no break here because further handling is equal to the default situation */
+				}
+				default: {
+					s->flags &= ~EXTRAINDENT;
+					if (s->flags&SPACENEEDED) {
+						writecharmode(s, ' ', mode);
+					} else if (s->flags&SPACENEEDLF) {
+						writecharmode(s, '\n', mode);
+					}
+					s->flags &= ~SPACEHANDLING;
+					s->flags |= SPACEASIS;
+					writecharmode(s, c, mode);
+					break;
+				}
+
+			}
+		}
+		/* read one char from input stream. */
+		c = readchar(s);
+	}
+	if (s->outpos) {
+		writecharmode(s, '\n', mode);
+	}
+	if (s->flags&ZIPMODE) {
+		long int pos = (long int) s->outlen;
+		s->flags |= CHANGED;
+		if (s->fout) {
+			fflush(s->fout);
+			pos = ftell(s->fout);
+		}
+		if (!reopenbinary(s)) {
+			warning(s, "%s: ERROR: cannot re-open in binary mode for writing remaining after <CTRL>-Z.\n", dest, 0, 0);
+			return 1;
+		}
+		/* prepare ZIP trailer */
+		memcpy(s->outbuf, "\032\120\113\005\006", 5);
+		memset(&s->outbuf[5], 0, 18);
+		s->outbuf[17] = (char) ++pos;
+		s->outbuf[18] = (char) (pos>>8);
+		s->outbuf[19] = (char) (pos>>16);
+		s->outbuf[20] = (char) (pos>>24);
+		/* write ZIP trailer */
+		writeout(s, s->outbuf, 23);
+	}
+	return 0;
+}
+
+/**
+ * Beautify the input in generic mode, see lexmode().
+ *
+ * @param Busl BUSL status
+ * @param filename filename, used in messages
+ * @param dest output filename, 0 when not writing to a file
+ * @return 0 when successful, 1 when an error is reported
+ */
+static int __stdcall lexgeneric(Busl *s, const char *filename, const char *dest) {
+	return lexmode(s, filename, dest, 0);
+}
+
+/**
+ * Beautify the input in generic strip mode, see lexmode().
+ *
+ * @param Busl BUSL status
+ * @param filename filename, used in messages
+ * @param dest output filename, 0 when not writing to a file
+ * @return 0 when successful, 1 when an error is reported
+ */
+static int __stdcall lexstrip(Busl *s, const char *filename, const char *dest) {
+	return lexmode(s, filename, dest, STRIPMODE);
+}
+
+/**
+ * Beautify the input in xml/html/sgml mode, see lexmode().
+ *
+ * @param Busl BUSL status
+ * @param filename filename, used in messages
+ * @param dest output filename, 0 when not writing to a file
+ * @return 0 when successful, 1 when an error is reported
+ */
+static int __stdcall lexxml(Busl *s, const char *filename, const char *dest) {
+	return lexmode(s, filename, dest, XMLMODE);
+}
+
+/**
+ * Beautify the input in xml/html/sgml strip mode, see lexmode().
+ *
+ * @param Busl BUSL status
+ * @param filename filename, used in messages
+ * @param dest output filename, 0 when not writing to a file
+ * @return 0 when successful, 1 when an error is reported
+ */
+static int __stdcall lexxmlstrip(Busl *s, const char *filename, const char *dest) {
+	return lexmode(s, filename, dest, XMLMODE|STRIPMODE);
+}
+
+/**
+ * Beautify the input with the engine for the mode of the file.
+ *
+ * @param Busl BUSL status
+ * @param filename filename, used in messages
+ * @param dest output filename, 0 when not writing to a file
+ * @return 0 when successful, 1 when an error is reported
+ */
+static int __stdcall lex(Busl *s, const char *filename, const char *dest) {
+	switch (s->flags&(XMLMODE|STRIPMODE)) {
+		case XMLMODE:
+			return lexxml(s, filename, dest);
+		case STRIPMODE:
+			return lexstrip(s, filename, dest);
+		case XMLMODE|STRIPMODE:
+			return lexxmlstrip(s, filename, dest);
+	}
+	return lexgeneric(s, filename, dest);
+}
+
+/**
+ * Line start function of the "k" option: stop beautifying after the first
+ * line which is changed.
+ *
+ * @param Busl BUSL status
+ * @return 1 when the file is changed
+ */
+static int __stdcall stopchanged(Busl *s) {
+	return (s->flags&CHANGED)!=0;
+}
+
+/**
+ * Check for comments, strings and braces which are not closed at end of file.
+ *
+ * @param Busl BUSL status
+ * @param filename filename, used in messages
+ * @param dest output filename, 0 when not writing to a file
+ * @return 1 when an error is reported, 0 otherwise
+ */
+static int __stdcall checkend(Busl *s, const char *filename, const char *dest) {
+	if (s->quoted=='*') {
+		warning(s, "%s(%d,%d): ERROR: */ missing at end of file.\n", filename, s->linenum, 0);
+		if (!(s->defaultflags&CHANGED)) {
+			s->flags &= ~CHANGED;
+			if (dest && (s->flags&NOTESTMODE)) {
+				warning(s, ERRORMESSAGE, dest, 0, 0);
+			}
+			return 1;
+		}
+	} else if ((s->quoted=='\'') || (s->quoted=='\"') || (s->quoted=='/')) {
+		warning(s, "%s(%d,%d): ERROR: %c missing at end of file.\n", filename, s->linenum, s->quoted);
+		if (!(s->defaultflags&CHANGED)) {
+			s->flags &= ~CHANGED;
+			if (dest && (s->flags&NOTESTMODE)) {
+				warning(s, ERRORMESSAGE, dest, 0, 0);
+			}
+			return 1;
+		}
+	} else if ((s->flags&XMLMODE) && (s->quoted!='<')) {
+		if (s->cmdtype) {
+			warning(s, "%s(%d,%d): ERROR: %c> missing at end of file.\n", filename, s->linenum, s->cmdtype);
+		} else {
+			warning(s, "%s(%d,%d): ERROR: </script> missing at end of file.\n", filename, s->linenum, 0);
+		}
+		if (!(s->defaultflags&CHANGED)) {
+			s->flags &= ~CHANGED;
+			if (dest && (s->flags&NOTESTMODE)) {
+				warning(s, ERRORMESSAGE, dest, 0, 0);
+			}
+		}
+		return 1;
+	} else {
+		while (s->indent && CHARCLASS(s->indentstack[s->indent-1], XXXX11)) s->indent--;
+		if (s->indent--) {
+			if (s->indentstack[s->indent]=='(') {
+				s->indentstack[s->indent] = ')';
+			}
+			warning(s, "%s(%d,%d): ERROR: %c", filename, s->linenum, s->indentstack[s->indent]);
+			while (s->indent--) {
+				if (!CHARCLASS(s->indentstack[s->indent], XXXX11)) {
+					if (s->indentstack[s->indent]=='(') {
+						s->indentstack[s->indent] = ')';
+					}
+					warning(s, "%s%c", ", ", 0, s->indentstack[s->indent]);
+				}
+			}
+			warning(s, " missing at end of file.\n", filename, 0, 0);
+			if (!(s->defaultflags&CHANGED)) {
+				s->flags &= ~CHANGED;
+				if (dest && (s->flags&NOTESTMODE)) {
+					warning(s, ERRORMESSAGE, dest, 0, 0);
+				}
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Beautify only up to the first change, see the "k" option. The end is only
+ * checked for unclosed comments, strings and braces when it is reached.
+ *
+ * @param Busl BUSL status
+ * @param filename filename, used in messages
+ * @param dest output filename, 0 when not writing to a file
+ * @return 1 when an error is reported, 0 otherwise
+ */
+static int __stdcall lexcheck(Busl *s, const char *filename, const char *dest) {
+	int error;
+	s->linestart = stopchanged;
+	error = lex(s, filename, dest);
+	s->linestart = 0;
+	return error || (!(s->flags&CHANGED) && checkend(s, filename, dest));
+}
+
+#ifdef HAVE_THREADS
+#   if defined(_WIN32) || defined(_WIN64)
+/** lock protecting data shared between threads (a simple spin lock) */
+typedef long volatile busllock;
+#   else
+/** lock protecting data shared between threads */
+typedef pthread_mutex_t busllock;
+#   endif
+
+/**
+ * A thread, running a function with a single argument
+ */
+typedef struct buslthread {
+	/** function to be run */
+	void (__stdcall *proc)(void *);
+	/** argument for the function */
+	void *data;
+#   if defined(_WIN32) || defined(_WIN64)
+	/** thread handle */
+	void *handle;
+#   else
+	/** thread id */
+	pthread_t handle;
+#   endif
+	/** 1 if the thread is running */
+	int started;
+} buslthread;
+
+/**
+ * Initialize a lock.
+ *
+ * @param l lock
+ */
+static void __stdcall initlock(busllock *l) {
+#   if defined(_WIN32) || defined(_WIN64)
+	*l = 0;
+#   else
+	pthread_mutex_init(l, 0);
+#   endif
+}
+
+/**
+ * Acquire a lock, waiting until it is free.
+ *
+ * @param l lock
+ */
+static void __stdcall acquire(busllock *l) {
+#   if defined(_WIN32) || defined(_WIN64)
+	while (_InterlockedExchange(l, 1)) {
+		Sleep(0);
+	}
+#   else
+	pthread_mutex_lock(l);
+#   endif
+}
+
+/**
+ * Release a lock.
+ *
+ * @param l lock
+ */
+static void __stdcall release(busllock *l) {
+#   if defined(_WIN32) || defined(_WIN64)
+	_InterlockedExchange(l, 0);
+#   else
+	pthread_mutex_unlock(l);
+#   endif
+}
+
+/**
+ * Clean up a lock.
+ *
+ * @param l lock
+ */
+static void __stdcall destroylock(busllock *l) {
+#   if defined(_WIN32) || defined(_WIN64)
+	*l = 0;
+#   else
+	pthread_mutex_destroy(l);
+#   endif
+}
+
+/**
+ * Start function of every thread.
+ *
+ * @param data buslthread
+ * @return 0
+ */
+#   if defined(_WIN32) || defined(_WIN64)
+static unsigned long int __stdcall threadproc(void *data) {
+#   else
+static void *threadproc(void *data) {
+#   endif
+	buslthread *t = (buslthread *) data;
+	t->proc(t->data);
+	return 0;
+}
+
+/**
+ * Start a thread.
+ *
+ * @param t thread
+ * @param proc function to be run by the thread
+ * @param data argument for the function
+ */
+static void __stdcall startthread(buslthread *t, void (__stdcall *proc)(void *), void *data) {
+	t->proc = proc;
+	t->data = data;
+#   if defined(_WIN32) || defined(_WIN64)
+	t->handle = CreateThread(0, 0, threadproc, t, 0, 0);
+	t->started = (t->handle!=0);
+#   else
+	t->started = !pthread_create(&t->handle, 0, threadproc, t);
+#   endif
+}
+
+/**
+ * Wait until a thread started by startthread() is finished.
+ *
+ * @param t thread
+ */
+static void __stdcall jointhread(buslthread *t) {
+	if (t->started) {
+#   if defined(_WIN32) || defined(_WIN64)
+		WaitForSingleObject(t->handle, 0xFFFFFFFFUL);
+		CloseHandle(t->handle);
+#   else
+		pthread_join(t->handle, 0);
+#   endif
+		t->started = 0;
+	}
+}
+
+/**
+ * Determine the number of processors.
+ *
+ * @return number of processors, at least 1
+ */
+static int __stdcall numcpus(void) {
+	long int n = 1;
+#   if defined(_WIN32) || defined(_WIN64)
+	const char *env = getenv("NUMBER_OF_PROCESSORS");
+	if (env) {
+		n = atol(env);
+	}
+#   elif defined(_SC_NPROCESSORS_ONLN)
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#   endif
+	return (n>1)? (int) n: 1;
+}
+#endif
+
+/** the options which determine the beautified code, so whether a file is clean,
+ * and QUIETMODE, which suppresses warnings about files which are otherwise clean */
+#define CACHEFLAGS (AUTOMODE|QUIETMODE|UNIXLFMODE|MACCRMODE|XMLMODE|ZIPMODE|STRIPMODE)
+
+/**
+ * A file which was clean, see buslcache
+ */
+typedef struct buslcached {
+	/** next file with the same hash value */
+	struct buslcached *next;
+	/** file size */
+	unsigned long int size;
+	/** modification time */
+	long int mtime;
+	/** inode number (0 if the system doesn't have them) */
+	unsigned long int ino;
+	/** defaultflags used, only CACHEFLAGS */
+	int defaultflags;
+	/** number of spaces used for indenting (<0 = use tabs) */
+	int tabs;
+	/** filename, as given */
+	char name[1];
+} buslcached;
+
+/**
+ * Files which were clean in earlier runs, remembered in CACHENAME. A file is
+ * skipped if its size, modification time and inode, and the options, are
+ * still the same.
+ */
+typedef struct buslcache {
+	/** hash table of files */
+	buslcached **table;
+	/** size of table */
+	unsigned long int size;
+	/** number of files */
+	unsigned long int count;
+	/** 1 when the cache needs to be saved */
+	int changed;
+#ifdef HAVE_THREADS
+	/** protects everything above, workers of busl_beautify_batch() share the cache */
+	busllock lock;
+#endif
+} buslcache;
+
+/**
+ * Find a file in the cache.
+ *
+ * @param c cache
+ * @param name filename
+ * @return the link to the file, pointing to 0 if not found
+ */
+static buslcached **__stdcall findcached(buslcache *c, const char *name) {
+	unsigned long int hash = 5381;
+	const char *p = name;
+	buslcached **f;
+	while (*p) {
+		hash = 33*hash+(unsigned char) *p++;
+	}
+	f = &c->table[hash%c->size];
+	while (*f && strcmp((*f)->name, name)) {
+		f = &(*f)->next;
+	}
+	return f;
+}
+
+/**
+ * Remember a clean file in the cache, or update it.
+ *
+ * @param c cache
+ * @param name filename
+ * @param size file size
+ * @param mtime modification time
+ * @param ino inode number
+ * @param defaultflags defaultflags used
+ * @param tabs number of spaces used for indenting
+ */
+static void __stdcall addcached(buslcache *c, const char *name, unsigned long int size,
+		long int mtime, unsigned long int ino, int defaultflags, int tabs) {
+	buslcached **f;
+	if (c->count>=c->size) {
+		/* make the hash table larger */
+		unsigned long int i;
+		buslcache bigger = *c;
+		bigger.size = 2*c->size+1;
+		bigger.table = (buslcached **) calloc(bigger.size, sizeof(buslcached *));
+		if (bigger.table) {
+			for (i=0; i<c->size; ++i) {
+				while (c->table[i]) {
+					buslcached *next = c->table[i]->next;
+					f = findcached(&bigger, c->table[i]->name);
+					c->table[i]->next = 0;
+					*f = c->table[i];
+					c->table[i] = next;
+				}
+			}
+			free(c->table);
+			c->table = bigger.table;
+			c->size = bigger.size;
+		}
+	}
+	f = findcached(c, name);
+	if (!*f) {
+		size_t len = strlen(name);
+		if (!(*f = (buslcached *) malloc(sizeof(buslcached)+len))) {
+			return;
+		}
+		memcpy((*f)->name, name, len+1);
+		(*f)->next = 0;
+		++c->count;
+	}
+	(*f)->size = size;
+	(*f)->mtime = mtime;
+	(*f)->ino = ino;
+	(*f)->defaultflags = defaultflags&CACHEFLAGS;
+	(*f)->tabs = tabs;
+	c->changed = 1;
+}
+
+/**
+ * Load the cache from CACHENAME, if it isn't loaded yet.
+ *
+ * @param Busl BUSL status
+ */
+static void __stdcall loadcache(Busl *s) {
+	buslcache *c;
+	FILE *fin;
+	char line[512];
+	if (s->cache || !(c = (buslcache *) calloc(1, sizeof(buslcache)))) {
+		return;
+	}
+	c->size = 1023;
+	if (!(c->table = (buslcached **) calloc(c->size, sizeof(buslcached *)))) {
+		free(c);
+		return;
+	}
+#ifdef HAVE_THREADS
+	initlock(&c->lock);
+#endif
+	fin = fopen(CACHENAME, "r");
+	if (fin) {
+		if (fgets(line, sizeof(line), fin) && !strcmp(line, CACHEHEADER)) {
+			while (fgets(line, sizeof(line), fin)) {
+				unsigned long int size, ino;
+				long int mtime;
+				int defaultflags, tabs, n = 0;
+				char *p = &line[strlen(line)];
+				if ((p>line) && (p[-1]=='\n')) {
+					*--p = 0;
+					if ((sscanf(line, "%lu %ld %lu %d %d %n", &size, &mtime, &ino, &defaultflags, &tabs, &n)==5) && n) {
+						addcached(c, &line[n], size, mtime, ino, defaultflags, tabs);
+					}
+				}
+			}
+		}
+		fclose(fin);
+	}
+	c->changed = 0;
+	s->cache = c;
+}
+
+/**
+ * Write the cache to CACHENAME, if anything is changed, and release it.
+ *
+ * @param Busl BUSL status
+ */
+static void __stdcall savecache(Busl *s) {
+	buslcache *c = s->cache;
+	unsigned long int i;
+	char tmpname[sizeof(CACHENAME)+1];
+	FILE *fout = 0;
+	if (!c) {
+		return;
+	}
+	if (c->changed) {
+		/* write it as a whole, so it is never half-written */
+		strcpy(tmpname, CACHENAME);
+		strcat(tmpname, "$");
+		fout = fopen(tmpname, "w");
+		if (!fout) {
+			warning(s, "%s: WARNING: cannot open for writing.\n", tmpname, 0, 0);
+		} else {
+			fputs(CACHEHEADER, fout);
+		}
+	}
+	for (i=0; i<c->size; ++i) {
+		while (c->table[i]) {
+			buslcached *f = c->table[i];
+			if (fout) {
+				fprintf(fout, "%lu %ld %lu %d %d %s\n", f->size, f->mtime, f->ino, f->defaultflags, f->tabs, f->name);
+			}
+			c->table[i] = f->next;
+			free(f);
+		}
+	}
+	if (fout) {
+		if (fclose(fout)) {
+			unlink(tmpname);
+		} else {
+			unlink(CACHENAME);
+			rename(tmpname, CACHENAME);
+		}
+	}
+#ifdef HAVE_THREADS
+	destroylock(&c->lock);
+#endif
+	free(c->table);
+	free(c);
+	s->cache = 0;
+}
+
+/**
+ * Check if a file was clean last time, and is not modified since.
+ *
+ * @param Busl BUSL status
+ * @param filename filename
+ * @param st status of the file
+ * @return 1 when the file can be skipped
+ */
+static int __stdcall iscached(Busl *s, const char *filename, const struct stat *st) {
+	buslcached *f;
+	int result;
+#ifdef HAVE_THREADS
+	acquire(&s->cache->lock);
+#endif
+	f = *findcached(s->cache, filename);
+	result = f && (f->size==(unsigned long int) st->st_size) && (f->mtime==(long int) st->st_mtime)
+			&& (f->ino==(unsigned long int) st->st_ino) && (f->defaultflags==(s->defaultflags&CACHEFLAGS))
+			&& (f->tabs==s->tabs);
+#ifdef HAVE_THREADS
+	release(&s->cache->lock);
+#endif
+	return result;
+}
+
+/**
+ * Remember that a file is clean. Not if it is modified within the current
+ * second: a later modification within the same second would go unnoticed.
+ *
+ * @param Busl BUSL status
+ * @param filename filename
+ * @param st status of the file
+ */
+static void __stdcall setcached(Busl *s, const char *filename, const struct stat *st) {
+	if ((st->st_mtime<time(0)) && !strchr(filename, '\n')) {
+#ifdef HAVE_THREADS
+		acquire(&s->cache->lock);
+#endif
+		addcached(s->cache, filename, (unsigned long int) st->st_size, (long int) st->st_mtime,
+				(unsigned long int) st->st_ino, s->defaultflags, s->tabs);
+#ifdef HAVE_THREADS
+		release(&s->cache->lock);
+#endif
+	}
+}
+
+/**
+ * A file to be beautified by busl_beautify_batch(), or the messages given
+ * in between while collecting the files.
+ */
+typedef struct busltask {
+	/** filename (0 if only messages are stored) */
+	char *name;
+	/** output directory (0 if none) */
+	char *outdir;
+	/** directory of the content-addressed output cache (0 if none), see Busl.outcache */
+	char *outcache;
+	/** file size, used to beautify the largest files first (plus the sizes of the tasks chained by next) */
+	unsigned long int size;
+	/** next file with the same temporary and backup file, beautified after this one by the same worker */
+	struct busltask *next;
+	/** defaultflags to be used for this file */
+	int defaultflags;
+	/** report to be used for this file, see Busl.report */
+	int report;
+	/** the "j" option given before this file, see Busl.jobs */
+	int jobs;
+	/** number of spaces used for indenting (<0 = use tabs) */
+	int tabs;
+	/** 1 when no more files are to be beautified if this one is not clean, see Busl.failfast */
+	int failfast;
+	/** flags returned by busl_beautify() */
+	int flags;
+	/** result code, see Busl.result */
+	int result;
+	/** buffered messages (0 if none) */
+	char *msg;
+	/** length of buffered messages */
+	size_t msglen;
+	/** size of msg memory */
+	size_t msgsize;
+} busltask;
+
+/**
+ * All files and messages collected by busl_beautify_batch(), in order.
+ */
+typedef struct buslbatch {
+	/** tasks, in command line order */
+	busltask *task;
+	/** number of tasks */
+	long count;
+	/** number of allocated tasks */
+	long size;
+	/** tasks containing a file of the range being beautified in parallel, in the order they are beautified (not the ones chained by busltask.next) */
+	busltask **order;
+	/** number of tasks in order */
+	long ordered;
+	/** index in order of the next task to be beautified */
+	long next;
+	/** 1 when a file is not clean and the "e" option is used: no more files are beautified */
+	int stop;
+#ifdef HAVE_THREADS
+	/** protects next */
+	busllock lock;
+#endif
+} buslbatch;
+
+/**
+ * Append a message to the messages of a task.
+ *
+ * @param t task
+ * @param str message
+ */
+static void __stdcall appendmsg(busltask *t, const char *str) {
+	size_t len = strlen(str);
+	if (t->msglen+len>=t->msgsize) {
+		size_t size = 2*t->msgsize+len+1;
+		char *msg = (char *) realloc(t->msg, size);
+		if (!msg) {
+			return;
+		}
+		t->msg = msg;
+		t->msgsize = size;
+	}
+	memcpy(&t->msg[t->msglen], str, len+1);
+	t->msglen += len;
+}
+
+/**
+ * Message output function of the BUSL status of a worker: the messages are
+ * stored with the file being beautified.
+ *
+ * @param data busltask
+ * @param str message
+ */
+static void __stdcall taskwrt(void *data, const char *str) {
+	appendmsg((busltask *) data, str);
+}
+
+/**
+ * Add an empty task at the end of the batch.
+ *
+ * @param b batch
+ * @return the new task, 0 when out of memory
+ */
+static busltask *__stdcall newtask(buslbatch *b) {
+	if (b->count>=b->size) {
+		long size = b->size? 2*b->size: 64;
+		busltask *task = (busltask *) realloc(b->task, size*sizeof(busltask));
+		if (!task) {
+			return 0;
+		}
+		b->task = task;
+		b->size = size;
+	}
+	memset(&b->task[b->count], 0, sizeof(busltask));
+	return &b->task[b->count++];
+}
+
+/**
+ * Message output function while collecting files: messages are stored
+ * in between the files, so they can be given in the right order.
+ *
+ * @param data buslbatch
+ * @param str message
+ */
+static void __stdcall batchwrt(void *data, const char *str) {
+	buslbatch *b = (buslbatch *) data;
+	busltask *t = b->count? &b->task[b->count-1]: (busltask *) 0;
+	if (!t || t->name) {
+		t = newtask(b);
+	}
+	if (t) {
+		appendmsg(t, str);
+	}
+}
+
+/**
+ * Remember a file to be beautified later by busl_beautify_batch(), together
+ * with the current options.
+ *
+ * @param s BUSL status
+ * @param filename filename
+ * @param size file size
+ * @return flags
+ */
+static int __stdcall addtask(Busl *s, const char *filename, unsigned long int size) {
+	busltask *t = newtask(s->batch);
+	size_t len = strlen(filename)+1;
+	size_t outdirlen = s->outdir? strlen(s->outdir)+1: 0;
+	size_t outcachelen = s->outcache? strlen(s->outcache)+1: 0;
+	if (!t || !(t->name = (char *) malloc(len+outdirlen+outcachelen))) {
+		if (t) {
+			--s->batch->count;
+		}
+		return warning(s, "%s: ERROR: out of memory.\n", filename, 0, 0);
+	}
+	memcpy(t->name, filename, len);
+	if (s->outdir) {
+		/* copy it, it doesn't live long enough when it comes from @<file> */
+		t->outdir = &t->name[len];
+		memcpy(t->outdir, s->outdir, outdirlen);
+	}
+	if (s->outcache) {
+		/* copy it, a later "+<dir>" replaces it */
+		t->outcache = &t->name[len+outdirlen];
+		memcpy(t->outcache, s->outcache, outcachelen);
+	}
+	t->size = size;
+	t->defaultflags = s->defaultflags;
+	t->report = s->report;
+	t->tabs = s->tabs;
+	t->failfast = s->failfast;
+	t->jobs = s->jobs;
+	return 0;
+}
+
+/**
+ * A file found by a directory walk.
+ */
+typedef struct buslfile {
+	/** path of the file */
+	char *name;
+	/** file size */
+	unsigned long int size;
+} buslfile;
+
+/**
+ * State of a directory walk, shared by all threads walking.
+ */
+typedef struct buslwalk {
+	/** directories still to be read */
+	char **dir;
+	/** number of directories still to be read */
+	long dirs;
+	/** number of allocated directories */
+	long dirsize;
+	/** files found */
+	buslfile *file;
+	/** number of files found */
+	long files;
+	/** number of allocated files */
+	long filesize;
+	/** number of directories being read at this moment */
+	int busy;
+	/** 1 when out of memory */
+	int nomem;
+#ifdef HAVE_THREADS
+	/** protects everything above */
+	busllock lock;
+#endif
+} buslwalk;
+
+/**
+ * Check whether a file found in a directory walk should be beautified: only
+ * files which have a known file extension are.
+ *
+ * @param name filename (without directory)
+ * @return 1 when the file should be beautified, 0 when not
+ */
+static int __stdcall checkfile(const char *name) {
+	const char *p = strrchr(name, '.');
+	if (!p || checkext(++p, ignorext, sizeof(ignorext))) {
+		return 0;
+	}
+	return checkext(p, genext, sizeof(genext)) || checkext(p, xmlext, sizeof(xmlext));
+}
+
+/**
+ * Add a directory or a file found in a directory walk. The caller must
+ * hold the lock.
+ *
+ * @param w walk
+ * @param dir directory
+ * @param name name of directory or file in dir (0 for dir itself)
+ * @param isdir 1 for a directory, 0 for a file
+ * @param size file size
+ */
+static void __stdcall addpath(buslwalk *w, const char *dir, const char *name, int isdir, unsigned long int size) {
+	size_t len = strlen(dir);
+	char *path = (char *) malloc(len+(name? strlen(name)+2: 1));
+	if (!path) {
+		w->nomem = 1;
+		return;
+	}
+	strcpy(path, dir);
+	if (name) {
+		if (!len || !strchr(DIRSEPARATOR, path[len-1])) {
+#if defined(_DOS) || defined(_WIN16) || defined(_WIN32) || defined(_WIN64)
+			path[len++] = '\\';
+#else
+			path[len++] = '/';
+#endif
+		}
+		strcpy(&path[len], name);
+	}
+	if (isdir) {
+		if (w->dirs>=w->dirsize) {
+			long n = w->dirsize? 2*w->dirsize: 64;
+			char **dirs = (char **) realloc(w->dir, n*sizeof(char *));
+			if (!dirs) {
+				w->nomem = 1;
+				free(path);
+				return;
+			}
+			w->dir = dirs;
+			w->dirsize = n;
+		}
+		w->dir[w->dirs++] = path;
+	} else {
+		if (w->files>=w->filesize) {
+			long n = w->filesize? 2*w->filesize: 256;
+			buslfile *files = (buslfile *) realloc(w->file, n*sizeof(buslfile));
+			if (!files) {
+				w->nomem = 1;
+				free(path);
+				return;
+			}
+			w->file = files;
+			w->filesize = n;
+		}
+		w->file[w->files].name = path;
+		w->file[w->files++].size = size;
+	}
+}
+
+/**
+ * Read a single directory: subdirectories are added to the directories
+ * to be read, and files with a known file extension to the files found.
+ * Hidden directories and files (starting with '.') and symbolic links are skipped.
+ *
+ * @param w walk
+ * @param dir directory
+ */
+static void __stdcall readdirectory(buslwalk *w, const char *dir) {
+#if defined(_WIN32) || defined(_WIN64)
+	struct _finddata_t entry;
+	intptr_t handle;
+	char *pattern = (char *) malloc(strlen(dir)+3);
+	if (!pattern) {
+		return;
+	}
+	strcpy(pattern, dir);
+	strcat(pattern, strchr(DIRSEPARATOR, pattern[strlen(pattern)-1])? "*": "\\*");
+	handle = _findfirst(pattern, &entry);
+	free(pattern);
+	if (handle==-1) {
+		return;
+	}
+	do {
+		if ((*entry.name!='.') && !(entry.attrib&_A_HIDDEN)) {
+			int isdir = (entry.attrib&_A_SUBDIR)!=0;
+			if (isdir || checkfile(entry.name)) {
+#   ifdef HAVE_THREADS
+				acquire(&w->lock);
+#   endif
+				addpath(w, dir, entry.name, isdir, (unsigned long int) entry.size);
+#   ifdef HAVE_THREADS
+				release(&w->lock);
+#   endif
+			}
+		}
+	} while (!_findnext(handle, &entry));
+	_findclose(handle);
+#elif !defined(_DOS) && !defined(_WIN16)
+	DIR *d = opendir(dir);
+	struct dirent *entry;
+	size_t len = strlen(dir);
+	char *path;
+	if (!d) {
+		return;
+	}
+	path = (char *) malloc(len+258);
+	if (path) {
+		strcpy(path, dir);
+		if (!len || (path[len-1]!='/')) {
+			path[len++] = '/';
+		}
+		while ((entry = readdir(d))!=0) {
+			struct stat st;
+			if ((*entry->d_name=='.') || (strlen(entry->d_name)>256)) {
+				continue;
+			}
+			strcpy(&path[len], entry->d_name);
+			if (!lstat(path, &st) && (S_ISDIR(st.st_mode) || (S_ISREG(st.st_mode) && checkfile(entry->d_name)))) {
+#   ifdef HAVE_THREADS
+				acquire(&w->lock);
+#   endif
+				addpath(w, dir, entry->d_name, S_ISDIR(st.st_mode), (unsigned long int) st.st_size);
+#   ifdef HAVE_THREADS
+				release(&w->lock);
+#   endif
+			}
+		}
+		free(path);
+	}
+	closedir(d);
+#endif
+}
+
+/**
+ * Read directories of a walk until all are read.
+ *
+ * @param data buslwalk
+ */
+static void __stdcall walkproc(void *data) {
+	buslwalk *w = (buslwalk *) data;
+#ifdef HAVE_THREADS
+	acquire(&w->lock);
+	while (w->dirs || w->busy) {
+		if (w->dirs) {
+			char *dir = w->dir[--w->dirs];
+			++w->busy;
+			release(&w->lock);
+			readdirectory(w, dir);
+			free(dir);
+			acquire(&w->lock);
+			--w->busy;
+		} else {
+			/* other threads might still find new directories */
+			release(&w->lock);
+			usleep(1000);
+			acquire(&w->lock);
+		}
+	}
+	release(&w->lock);
+#else
+	while (w->dirs) {
+		char *dir = w->dir[--w->dirs];
+		readdirectory(w, dir);
+		free(dir);
+	}
+#endif
+}
+
+/**
+ * Compare two files found by a directory walk by name, for qsort().
+ *
+ * @param a first buslfile
+ * @param b second buslfile
+ * @return <0, 0 or >0
+ */
+static int cmpname(const void *a, const void *b) {
+	return strcmp(((const buslfile *) a)->name, ((const buslfile *) b)->name);
+}
+
+/**
+ * Beautify all files with a known file extension in a directory and its
+ * subdirectories. With the "j" option the directories are read in parallel.
+ * The files are handled in sorted order, so the messages are independent of
+ * the order in which the directories are read.
+ *
+ * @param s BUSL status
+ * @param dir directory
+ * @return flags
+ */
+static int __stdcall walk(Busl *s, const char *dir) {
+#if defined(_DOS) || defined(_WIN16)
+	return warning(s, "%s: WARNING: directories are not supported (ignored).\n", dir, 0, 0);
+#else
+	buslwalk w;
+	int changed = 0;
+	long i;
+	memset(&w, 0, sizeof(w));
+	addpath(&w, dir, 0, 1, 0);
+#   ifdef HAVE_THREADS
+	initlock(&w.lock);
+	if (s->jobs>1) {
+		buslthread *thread = (buslthread *) calloc(s->jobs, sizeof(buslthread));
+		int k;
+		for (k=1; thread && (k<s->jobs); ++k) {
+			startthread(&thread[k], walkproc, &w);
+		}
+		walkproc(&w);
+		for (k=1; thread && (k<s->jobs); ++k) {
+			jointhread(&thread[k]);
+		}
+		free(thread);
+	}
+#   endif
+	walkproc(&w);
+#   ifdef HAVE_THREADS
+	destroylock(&w.lock);
+#   endif
+	free(w.dir);
+	if (w.nomem) {
+		warning(s, "%s: ERROR: out of memory.\n", dir, 0, 0);
+	}
+	if (w.files) {
+		qsort(w.file, w.files, sizeof(buslfile), cmpname);
+	}
+	for (i=0; i<w.files; ++i) {
+		if (s->batch) {
+			changed |= addtask(s, w.file[i].name, w.file[i].size);
+		} else {
+			changed |= busl_beautify(s, w.file[i].name);
+		}
+		free(w.file[i].name);
+	}
+	free(w.file);
+	return changed;
+#endif
+}
+
+/**
+ * Beautify the file of a task, using the BUSL status of a worker.
+ *
+ * @param w BUSL status of the worker
+ * @param t task
+ */
+static void __stdcall runtask(Busl *w, busltask *t) {
+	if (t->name) {
+		w->output = t;
+		w->defaultflags = t->defaultflags;
+		w->report = t->report;
+		w->tabs = t->tabs;
+		w->outdir = t->outdir;
+		w->outcache = t->outcache;
+		w->result = EXIT_SUCCESS; /* no copyright message */
+		t->flags = busl_beautify(w, t->name);
+		t->result = w->result;
+	}
+}
+
+/**
+ * Merge a result code into the BUSL status: errors take precedence over warnings.
+ *
+ * @param s BUSL status
+ * @param result result code, see Busl.result
+ */
+static void __stdcall mergeresult(Busl *s, int result) {
+	if (result==EXIT_FAILURE) {
+		s->result = EXIT_FAILURE;
+	} else if ((result==2*EXIT_FAILURE) && (s->result==EXIT_SUCCESS)) {
+		s->result = 2*EXIT_FAILURE;
+	}
+}
+
+/**
+ * Give the messages of a task, and merge its result code.
+ *
+ * @param s BUSL status
+ * @param t task
+ */
+static void __stdcall finishtask(Busl *s, busltask *t) {
+	if (t->msglen) {
+		if (s->result<0) {
+			s->result = EXIT_SUCCESS;
+			if (!(t->report&DIFFMODE)) {
+				/* see diffhunk() */
+				s->wrt(s->output, COPYRIGHT);
+			}
+		}
+		s->wrt(s->output, t->msg);
+	}
+	mergeresult(s, t->result);
+	free(t->msg);
+	free(t->name);
+}
+
+/**
+ * Move the list of files to be removed from a worker to the BUSL status.
+ *
+ * @param s BUSL status
+ * @param w BUSL status of the worker
+ */
+static void __stdcall mergeremoved(Busl *s, Busl *w) {
+	while (w->first) {
+		toberemoved *f = w->first;
+		w->first = f->next;
+		f->next = s->first;
+		s->first = f;
+	}
+}
+
+#ifdef HAVE_THREADS
+/**
+ * A worker of busl_beautify_batch()
+ */
+typedef struct buslworker {
+	/** the batch being handled */
+	buslbatch *batch;
+	/** BUSL status of this worker */
+	Busl *s;
+	/** thread running this worker (not used for the calling thread) */
+	buslthread thread;
+} buslworker;
+
+/**
+ * Beautify files until all are taken.
+ *
+ * @param data buslworker
+ */
+static void __stdcall workerproc(void *data) {
+	buslworker *worker = (buslworker *) data;
+	buslbatch *b = worker->batch;
+	for (;;) {
+		busltask *t;
+		long i;
+		acquire(&b->lock);
+		i = b->stop? b->ordered: b->next++;
+		release(&b->lock);
+		if (i>=b->ordered) {
+			break;
+		}
+		for (t=b->order[i]; t; t=t->next) {
+			runtask(worker->s, t);
+			if (t->failfast && (t->flags&CHANGED)) {
+				acquire(&b->lock);
+				b->stop = 1;
+				release(&b->lock);
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * Length of the part of a filename which determines the names of its
+ * temporary and backup files, see busl_beautify(): "foo.jsp" and "foo.js"
+ * both use "foo.js$" and "foo.js~".
+ *
+ * @param filename filename
+ * @return length
+ */
+static size_t __stdcall stemlen(const char *filename) {
+	const char *p = strrchr(filename, '.');
+	size_t len = strlen(filename);
+	if (p && p[1] && p[2] && p[3] && !p[4]) {
+		--len;
+	}
+	return len;
+}
+
+/**
+ * Compare two tasks by the names of their temporary and backup files for
+ * qsort(), tasks with the same names in command line order.
+ *
+ * @param a first task
+ * @param b second task
+ * @return <0, 0 or >0
+ */
+static int cmpstem(const void *a, const void *b) {
+	const busltask *ta = *(const busltask *const *) a;
+	const busltask *tb = *(const busltask *const *) b;
+	size_t lena = stemlen(ta->name);
+	size_t lenb = stemlen(tb->name);
+	int c = memcmp(ta->name, tb->name, (lena<lenb)? lena: lenb);
+	if (c) {
+		return c;
+	}
+	if (lena!=lenb) {
+		return (lena<lenb)? -1: 1;
+	}
+	return (ta<tb)? -1: (ta>tb);
+}
+
+/**
+ * Compare two tasks by file size for qsort(): largest files first, because
+ * if a large file is started last, the other workers have to wait for it.
+ *
+ * @param a first task
+ * @param b second task
+ * @return <0, 0 or >0
+ */
+static int cmpsize(const void *a, const void *b) {
+	const busltask *ta = *(const busltask *const *) a;
+	const busltask *tb = *(const busltask *const *) b;
+	if (ta->size!=tb->size) {
+		return (ta->size>tb->size)? -1: 1;
+	}
+	return (ta<tb)? -1: (ta>tb);
+}
+#endif
+
+/**
+ * Beautify standard input to standard output. The input is read in blocks of
+ * fixed size and every line is written as soon as it is complete, so the
+ * memory used does not depend on the input size. No files are written.
+ *
+ * @param s BUSL status
+ * @param ext file extension determining the mode (may be empty)
+ * @return flags
+ */
+static int __stdcall filter(Busl *s, const char *ext) {
+	int error;
+	s->flags = (s->defaultflags&~SPACEHANDLING)|SPACESTRIP;
+	if (*ext && !(s->defaultflags&CHANGED) && checkext(ext, ignorext, sizeof(ignorext))) {
+		s->flags &= ~CHANGED;
+		return warning(s, "%s: ERROR: unsupported file extension: not modified.\n", STDINNAME, 0, 0);
+	}
+	setmode(s, STDINNAME, *ext? ext: (const char *) 0);
+	s->inblock = (char *) malloc(BLOCKSIZE);
+	if (!s->inblock) {
+		return warning(s, "%s: ERROR: out of memory.\n", STDINNAME, 0, 0);
+	}
+	s->inblocksize = BLOCKSIZE;
+	s->inptr = s->inend = s->inblock;
+	s->fin = stdin;
+#if defined(_DOS) || defined(_WIN16) || defined(_WIN32) || defined(_WIN64)
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	s->fout = (s->defaultflags&NOTESTMODE)? stdout: (FILE *) 0;
+	if (s->fout) {
+		s->sink = writefile;
+		s->sinkdata = s;
+	} else if ((s->report&DIFFMODE) && !startdiff(s, STDINNAME)) {
+		return warning(s, "%s: ERROR: out of memory.\n", STDINNAME, 0, 0);
+	}
+#ifdef HAVE_CRLF
+	s->outcrlf = !(s->defaultflags&(UNIXLFMODE|MACCRMODE));
+#endif
+	s->outmemsize = 0;
+	error = (s->report&CHECKMODE)? lexcheck(s, STDINNAME, 0): (lex(s, STDINNAME, 0) || checkend(s, STDINNAME, 0));
+	if (!error && (s->flags&STRIPMODE)) {
+		s->flags |= CHANGED;
+	}
+	enddiff(s);
+	if (s->fout) {
+		fflush(s->fout);
+		s->fout = 0;
+	}
+	closeinput(s);
+	if ((s->flags&CHANGED) && (s->report&CHECKMODE)) {
+		return warning(s, "%s(%d,0): WARNING: not beautified, first change in this line.\n", STDINNAME, s->changedline? s->changedline: s->linenum, 0);
+	}
+	if ((s->flags&CHANGED) && !(s->defaultflags&(NOTESTMODE|QUIETMODE)) && !(s->report&DIFFMODE)) {
+		return warning(s, "%s not written (test mode)\n", STDINNAME, 0, 0);
+	}
+	return s->flags;
+}
+
+/**
+ * Copy the rest of a file, using the output line buffer. A whole file is
+ * cloned (sharing the blocks) or copied by the kernel where possible.
+ *
+ * @param Busl BUSL status
+ * @param fin file to be copied
+ * @param fout file receiving the copy
+ */
+static void __stdcall copyfile(Busl *s, FILE *fin, FILE *fout) {
+#ifdef FICLONE
+	if (!ftell(fin) && !ioctl(fileno(fout), FICLONE, fileno(fin))) {
+		return;
+	}
+#endif
+#ifdef HAVE_COPYRANGE
+	{
+		struct stat st;
+		long int pos = ftell(fin);
+		if ((pos>=0) && !fflush(fout) && !fstat(fileno(fin), &st) && (st.st_size>pos)) {
+			size_t n = copyrange(fileno(fin), pos, fileno(fout), (size_t) (st.st_size-pos));
+			if (n) {
+				/* the rest (if it has grown) as usual */
+				fseek(fin, (long int) (pos+n), SEEK_SET);
+				fseek(fout, (long int) lseek(fileno(fout), 0, SEEK_CUR), SEEK_SET);
+			}
+		}
+	}
+#endif
+	s->outpos = (int) fread(s->outbuf, 1, s->bufsize, fin);
+	while (s->outpos==s->bufsize) {
+		fwrite(s->outbuf, 1, s->bufsize, fout);
+		s->outpos = (int) fread(s->outbuf, 1, s->bufsize, fin);
+	}
+	if (s->outpos>0) {
+		fwrite(s->outbuf, 1, s->outpos, fout);
+	}
+}
+
+/**
+ * Report that a file is modified.
+ *
+ * @param Busl BUSL status
+ * @param filename filename
+ */
+static void __stdcall modified(Busl *s, const char *filename) {
+	if (!(s->defaultflags&QUIETMODE)) {
+		if (s->flags&XMLMODE) {
+			warning(s, "%s modified (xml/html/sgml mode)\n", filename, 0, 0);
+		} else if (s->flags&ZIPMODE) {
+			warning(s, "%s modified (trailer contains empty ZIP-file)\n", filename, 0, 0);
+		} else {
+			warning(s, "%s modified\n", filename, 0, 0);
+		}
+	}
+}
+
+/**
+ * Replace a file by its beautified version by renaming, so the file is never
+ * half-written. The original file is kept as backup, by a hard link or by
+ * renaming it, unless the "n" option is used. Nothing is done when the file
+ * is a symbolic link or has more than one link or another owner, which
+ * renaming would not keep, or when the files cannot be renamed.
+ *
+ * @param Busl BUSL status
+ * @param filename file to be replaced
+ * @param dest beautified version
+ * @param orig backup filename
+ * @return 1 when replaced, 0 when the files need to be copied
+ */
+static int __stdcall replacefile(Busl *s, const char *filename, const char *dest, const char *orig) {
+#if defined(_DOS) || defined(_WIN16) || defined(_WIN32) || defined(_WIN64)
+	/* rename() cannot replace an existing file here */
+	if (s->defaultflags&NOBACKUP) {
+		return 0;
+	}
+	unlink(orig);
+	if (rename(filename, orig)) {
+		return 0;
+	}
+	if (rename(dest, filename)) {
+		rename(orig, filename);
+		return 0;
+	}
+#else
+	struct stat st;
+	if (lstat(filename, &st) || !S_ISREG(st.st_mode) || (st.st_nlink>1) || (st.st_uid!=geteuid())
+			|| chmod(dest, st.st_mode&07777)) {
+		return 0;
+	}
+	if (!(s->defaultflags&NOBACKUP)) {
+		unlink(orig);
+		if (link(filename, orig) && rename(filename, orig)) {
+			return 0;
+		}
+	}
+	if (rename(dest, filename)) {
+		if (!(s->defaultflags&NOBACKUP)) {
+			if (access(filename, F_OK)) {
+				/* it was renamed to the backup */
+				rename(orig, filename);
+			} else {
+				/* remove the hard link, copying the backup would truncate the file */
+				unlink(orig);
+			}
+		}
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+#ifdef HAVE_THREADS
+/** minimum input per chunk for lexparallel() */
+#define CHUNKSIZE (1L<<20)
+
+/**
+ * A chunk of the input beautified speculatively by lexparallel()
+ */
+typedef struct buslchunk {
+	/** BUSL status of the worker */
+	Busl *s;
+	/** filename, used in messages */
+	const char *filename;
+	/** state in which the chunk is started: the state at the start of the input */
+	buslcheckpoint start;
+	/** offset of the first line of the chunk, and the end state */
+	buslcheckpoints cp;
+	/** messages given */
+	busltask task;
+	/** memory for the beautified code */
+	char *out;
+	/** size of out */
+	size_t outsize;
+	/** 1 when the chunk is beautified without errors */
+	int done;
+	/** thread beautifying the chunk */
+	buslthread thread;
+} buslchunk;
+
+/**
+ * Thread function beautifying a chunk for lexparallel().
+ *
+ * @param data buslchunk
+ */
+static void __stdcall chunkproc(void *data) {
+	buslchunk *k = (buslchunk *) data;
+	Busl *w = k->s;
+	if (restorestate(w, &k->start, "") && !lex(w, k->filename, 0)) {
+		if (!w->checkpoints->now.end.offset) {
+			/* the end of the input is reached */
+			getstate(w, &w->checkpoints->now.end, (size_t) (w->inend-w->inbase), 0);
+			w->checkpoints->now.hasend = savestack(&w->checkpoints->now, &w->checkpoints->now.end, w->indentstack);
+		}
+		k->done = w->checkpoints->now.hasend && !w->msgcount && (w->outlen<=k->outsize);
+	}
+}
+
+/**
+ * Beautify a large input with several threads. The input is split into chunks
+ * at line starts. All chunks except the first are beautified in parallel,
+ * speculatively starting in the state at the start of the input, which is
+ * usually right (not in a comment or string, no indenting). The first chunk is
+ * beautified meanwhile as usual. Then each chunk whose start state turns out
+ * to be the end state of the previous chunk is taken as is, the others are
+ * beautified again, so the result is the same as from lex(). Chunks giving
+ * messages are beautified again as well, as their line numbers are not known.
+ *
+ * @param Busl BUSL status
+ * @param filename filename, used in messages
+ * @param dest output filename, 0 when not writing to a file
+ * @return 0 when successful, 1 when an error is reported
+ */
+static int __stdcall lexparallel(Busl *s, const char *filename, const char *dest) {
+	size_t len = (size_t) (s->inend-s->inbase);
+	int n = s->jobs;
+	buslchunk *chunk;
+	buslcheckpoints *saved = s->checkpoints;
+	buslcheckpoints first;
+	buslcheckpoint start;
+	int error;
+	int i;
+	if ((n<2) || !s->inbase || (s->flags&ZIPMODE) || (s->report&DIFFMODE)
+			|| memchr(s->inbase, '\032', len)) {
+		return lex(s, filename, dest);
+	}
+	if ((size_t) n>len/CHUNKSIZE) {
+		n = (int) (len/CHUNKSIZE);
+	}
+	if ((n<2) || !(chunk = (buslchunk *) calloc(n, sizeof(buslchunk)))) {
+		return lex(s, filename, dest);
+	}
+	getstate(s, &start, 0, 1);
+	memset(&first, 0, sizeof(first));
+	/* split the input, and start beautifying all chunks but the first */
+	for (i=1; i<n; ++i) {
+		const char *p = (const char *) memchr(&s->inbase[len/n*i], '\n', len-len/n*i);
+		buslchunk *k = &chunk[i];
+		Busl *w;
+		k->cp.counted = p? (size_t) (p+1-s->inbase): len; /* offset of the first line */
+		chunk[i-1].cp.stop = k->cp.counted;
+		if ((k->cp.counted>=len) || (k->cp.counted<=chunk[i-1].cp.counted)
+				|| !(k->s = w = busl_create(0, taskwrt, &k->task))) {
+			break;
+		}
+		k->filename = filename;
+		k->start = start;
+		k->start.offset = k->cp.counted;
+		k->cp.stop = len+1;
+		w->defaultflags = s->defaultflags;
+		w->tabs = s->tabs;
+		w->result = EXIT_SUCCESS; /* no copyright message */
+		resetstack(w);
+		w->checkpoints = &k->cp;
+		w->linestart = chunkend;
+		w->inbase = s->inbase;
+		w->inend = s->inend;
+		k->outsize = 2*(size_t) CHUNKSIZE+(len/n)*2;
+		w->outmem = k->out = (char *) malloc(k->outsize);
+		w->outmemsize = k->out? k->outsize: 0;
+		w->sink = writememory;
+		w->sinkdata = w;
+		startthread(&k->thread, chunkproc, k);
+		if (!k->thread.started) {
+			busl_delete(w);
+			free(k->out);
+			k->s = 0;
+			break;
+		}
+	}
+	n = i;
+	/* meanwhile the first chunk */
+	first.stop = chunk[0].cp.stop;
+	s->checkpoints = &first;
+	s->linestart = chunkend;
+	error = lex(s, filename, dest);
+	for (i=1; i<n; ++i) {
+		jointhread(&chunk[i].thread);
+	}
+	/* continue with the next chunk, as long as the end is not reached */
+	for (i=1; (i<n) && !error && first.now.end.offset; ++i) {
+		buslchunk *k = &chunk[i];
+		if (k->done && (k->cp.counted==first.now.end.offset) && samestate(s, &start, "")) {
+			/* the speculation was right: take the chunk */
+			int changed = (s->flags|k->s->flags)&CHANGED;
+			int linenum = s->linenum+k->cp.now.end.linenum-start.linenum;
+			s->flags |= changed;
+			writeout(s, k->out, k->s->outlen);
+			if (!restorestate(s, &k->cp.now.end, &k->cp.now.stack[k->cp.now.end.stack])) {
+				error = outofmemory(s, filename);
+				break;
+			}
+			s->flags |= changed;
+			s->linenum = linenum;
+			first.now.end.offset = (k->cp.now.end.offset<len)? k->cp.now.end.offset: 0;
+		} else {
+			/* beautify it again, starting in the right state */
+			s->inptr = &s->inbase[first.now.end.offset];
+			first.now.end.offset = 0;
+			first.stop = k->cp.stop;
+			error = lex(s, filename, dest);
+		}
+	}
+	if (!error && first.now.end.offset) {
+		/* the first chunk (or a chunk beautified again) went on to the end */
+		s->inptr = &s->inbase[first.now.end.offset];
+		first.stop = len+1;
+		error = lex(s, filename, dest);
+	}
+	s->linestart = 0;
+	s->checkpoints = saved;
+	for (i=1; i<n; ++i) {
+		chunk[i].s->checkpoints = 0;
+		busl_delete(chunk[i].s);
+		freestates(&chunk[i].cp.now);
+		free(chunk[i].out);
+		free(chunk[i].task.msg);
+	}
+	freestates(&first.now);
+	free(chunk);
+	return error;
+}
+#else
+#define lexparallel lex
+#endif
+
+/** first line of an entry in the output cache, followed by CHANGED and the length */
+static const char OUTPUTHEADER[] = "BUSL " BUSLVERSION " output ";
+
+/**
+ * SHA-256 state, used to name the entries of the output cache
+ */
+typedef struct buslsha {
+	/** hash value so far */
+	unsigned long int h[8];
+	/** message length in bytes, low and high 32 bits */
+	unsigned long int len[2];
+	/** partial block */
+	unsigned char block[64];
+} buslsha;
+
+static const unsigned long int shak[64] = {
+	0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+	0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+	0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL, 0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+	0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL, 0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+	0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL, 0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+	0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL, 0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+	0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL, 0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+	0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL, 0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+/* unsigned long may have more than 32 bits, so mask where needed */
+#define SHAMASK 0xFFFFFFFFUL
+#define SHAROR(x, n) ((((x)>>(n))|((x)<<(32-(n))))&SHAMASK)
+
+/**
+ * Start a SHA-256 hash.
+ *
+ * @param c state
+ */
+static void __stdcall shainit(buslsha *c) {
+	static const unsigned long int h[8] = {
+		0x6a09e667UL, 0xbb67ae85UL, 0x3c6ef372UL, 0xa54ff53aUL, 0x510e527fUL, 0x9b05688cUL, 0x1f83d9abUL, 0x5be0cd19UL
+	};
+	memcpy(c->h, h, sizeof(h));
+	c->len[0] = c->len[1] = 0;
+}
+
+/**
+ * Hash one block of 64 bytes.
+ *
+ * @param c state
+ * @param p block
+ */
+static void __stdcall shablock(buslsha *c, const unsigned char *p) {
+	unsigned long int w[64], v[8], t1, t2;
+	int i;
+	for (i=0; i<16; ++i, p+=4) {
+		w[i] = ((unsigned long int) p[0]<<24)|((unsigned long int) p[1]<<16)|((unsigned long int) p[2]<<8)|p[3];
+	}
+	for (; i<64; ++i) {
+		t1 = SHAROR(w[i-15], 7)^SHAROR(w[i-15], 18)^(w[i-15]>>3);
+		t2 = SHAROR(w[i-2], 17)^SHAROR(w[i-2], 19)^(w[i-2]>>10);
+		w[i] = (w[i-16]+t1+w[i-7]+t2)&SHAMASK;
+	}
+	memcpy(v, c->h, sizeof(v));
+	for (i=0; i<64; ++i) {
+		t1 = v[7]+(SHAROR(v[4], 6)^SHAROR(v[4], 11)^SHAROR(v[4], 25))+((v[4]&v[5])^(~v[4]&v[6]))+shak[i]+w[i];
+		t2 = (SHAROR(v[0], 2)^SHAROR(v[0], 13)^SHAROR(v[0], 22))+((v[0]&v[1])^(v[0]&v[2])^(v[1]&v[2]));
+		memmove(&v[1], &v[0], 7*sizeof(v[0]));
+		v[4] = (v[4]+t1)&SHAMASK;
+		v[0] = (t1+t2)&SHAMASK;
+	}
+	for (i=0; i<8; ++i) {
+		c->h[i] = (c->h[i]+v[i])&SHAMASK;
+	}
+}
+
+/**
+ * Add characters to a SHA-256 hash.
+ *
+ * @param c state
+ * @param data characters
+ * @param len number of characters
+ */
+static void __stdcall shaupdate(buslsha *c, const char *data, size_t len) {
+	const unsigned char *p = (const unsigned char *) data;
+	size_t used = (size_t) (c->len[0]&63);
+	unsigned long int low = (c->len[0]+(unsigned long int) len)&SHAMASK;
+	/* size_t may have more than 32 bits */
+	c->len[1] = (c->len[1]+(unsigned long int) ((len>>16)>>16)+(low<c->len[0]))&SHAMASK;
+	c->len[0] = low;
+	if (used) {
+		size_t n = (len<64-used)? len: 64-used;
+		memcpy(&c->block[used], p, n);
+		p += n;
+		len -= n;
+		if (used+n<64) {
+			return;
+		}
+		shablock(c, c->block);
+	}
+	while (len>=64) {
+		shablock(c, p);
+		p += 64;
+		len -= 64;
+	}
+	memcpy(c->block, p, len);
+}
+
+/**
+ * Finish a SHA-256 hash.
+ *
+ * @param c state
+ * @param hex receives the hash value as 64 hexadecimal digits and '\0'
+ */
+static void __stdcall shafinal(buslsha *c, char *hex) {
+	unsigned char pad[72];
+	size_t n = 64-(size_t) ((c->len[0]+8)&63);
+	unsigned long int bits[2];
+	int i;
+	bits[1] = ((c->len[1]<<3)|(c->len[0]>>29))&SHAMASK;
+	bits[0] = (c->len[0]<<3)&SHAMASK;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i=0; i<4; ++i) {
+		pad[n+i] = (unsigned char) (bits[1]>>(24-8*i));
+		pad[n+4+i] = (unsigned char) (bits[0]>>(24-8*i));
+	}
+	shaupdate(c, (const char *) pad, n+8);
+	for (i=0; i<32; ++i) {
+		sprintf(&hex[2*i], "%02x", (unsigned int) (c->h[i/4]>>(24-8*(i%4)))&0xFF);
+	}
+}
+
+/**
+ * Set the directory of the content-addressed output cache, see Busl.outcache.
+ * An empty name stops using it.
+ *
+ * @param Busl BUSL status
+ * @param dir directory
+ * @return flags
+ */
+static int __stdcall setoutcache(Busl *s, const char *dir) {
+	struct stat st;
+	size_t len = strlen(dir);
+	free(s->outcache);
+	s->outcache = 0;
+	if (!len) {
+		return s->flags;
+	}
+	if (stat(dir, &st) || !S_ISDIR(st.st_mode)) {
+		return warning(s, "%s: WARNING: output cache is not a directory (ignored).\n", dir, 0, 0);
+	}
+	if (!(s->outcache = (char *) malloc(len+2))) {
+		return warning(s, "%s: ERROR: out of memory.\n", dir, 0, 0);
+	}
+	memcpy(s->outcache, dir, len+1);
+	if (!strchr(DIRSEPARATOR, dir[len-1])) {
+		strcpy(&s->outcache[len], "/");
+	}
+	return s->flags;
+}
+
+/**
+ * Determine the name of the entry in the output cache for the current input: the
+ * SHA-256 hash of the input and everything else that determines the output.
+ * Only inputs which are completely in memory, and which are beautified to text
+ * only, are cached.
+ *
+ * @param Busl BUSL status
+ * @return the name of the entry, to be freed by the caller (0 if not cached)
+ */
+static char *__stdcall outcachename(Busl *s) {
+	buslsha c;
+	char key[64];
+	size_t len = strlen(s->outcache);
+	char *name;
+	if (!s->inbase || (s->flags&ZIPMODE) || (s->defaultflags&MACCRMODE) || s->report
+			|| memchr(s->inbase, '\032', s->inend-s->inbase) || !(name = (char *) malloc(len+65))) {
+		return 0;
+	}
+	sprintf(key, "%s%d %d %d\n", OUTPUTHEADER, s->flags&~(NOTESTMODE|NOBACKUP|USECACHE),
+			s->defaultflags&~(NOTESTMODE|NOBACKUP|USECACHE), s->tabs);
+	shainit(&c);
+	shaupdate(&c, key, strlen(key));
+	shaupdate(&c, s->inbase, s->inend-s->inbase);
+	memcpy(name, s->outcache, len);
+	shafinal(&c, &name[len]);
+	return name;
+}
+
+/**
+ * Write the output of an earlier run from the output cache, instead of
+ * beautifying the input. The entry is checked completely before anything is
+ * written, a damaged entry is just not used.
+ *
+ * @param Busl BUSL status
+ * @param name name of the entry
+ * @return 1 when the output is written, 0 if not in the cache
+ */
+static int __stdcall readoutcache(Busl *s, const char *name) {
+	FILE *fin = fopen(name, "rb");
+	char line[64];
+	int changed = 0;
+	unsigned long int len = 0;
+	char *body = 0;
+	size_t n = sizeof(OUTPUTHEADER)-1;
+	if (!fin) {
+		return 0;
+	}
+	if (!fgets(line, sizeof(line), fin) || memcmp(line, OUTPUTHEADER, n)
+			|| (sscanf(&line[n], "%d %lu", &changed, &len)!=2) || (changed && !len)
+			|| (changed && (body = (char *) malloc(len))==0)
+			|| (changed && fread(body, 1, len, fin)!=len) || (getc(fin)!=EOF)) {
+		fclose(fin);
+		free(body);
+		return 0;
+	}
+	fclose(fin);
+	if (changed) {
+		s->flags |= CHANGED;
+		writeout(s, body, len);
+		free(body);
+	} else {
+		/* the output is the input */
+		writeout(s, s->inbase, s->inend-s->inbase);
+	}
+	return 1;
+}
+
+/**
+ * Store the output in the output cache. The output of a changed file is read
+ * back from dest. The entry is written under a temporary name first, so it is
+ * never seen half-written. The temporary name contains the process id and the
+ * address of the BUSL status, so other processes and threads writing the same
+ * entry at the same time use another temporary file.
+ *
+ * @param Busl BUSL status
+ * @param name name of the entry
+ * @param dest output file
+ */
+static void __stdcall writeoutcache(Busl *s, const char *name, const char *dest) {
+	size_t len = strlen(name);
+	char *tmpname = (char *) malloc(len+64);
+	FILE *fin = 0;
+	FILE *fout;
+	size_t count = 0;
+	int ok = 1;
+	if (!tmpname) {
+		return;
+	}
+	if ((s->flags&CHANGED) && !(fin = fopen(dest, (s->defaultflags&UNIXLFMODE)? "rb": "r"))) {
+		free(tmpname);
+		return;
+	}
+	sprintf(tmpname, "%s$%lx.%lx", name, (unsigned long int) getpid(), (unsigned long int) (size_t) s);
+	fout = fopen(tmpname, "wb");
+	if (fout) {
+		fprintf(fout, "%s%d %lu\n", OUTPUTHEADER, (s->flags&CHANGED)? 1: 0,
+				(s->flags&CHANGED)? (unsigned long int) s->outlen: 0UL);
+		if (fin) {
+			size_t n;
+			while ((n = fread(s->outbuf, 1, s->bufsize, fin))>0) {
+				fwrite(s->outbuf, 1, n, fout);
+				count += n;
+			}
+			/* modified in between? */
+			ok = (count==s->outlen);
+		}
+		if (fclose(fout) || !ok) {
+			unlink(tmpname);
+		} else if (rename(tmpname, name)) {
+			/* rename doesn't replace existing files everywhere */
+			unlink(name);
+			if (rename(tmpname, name)) {
+				unlink(tmpname);
+			}
+		}
+	}
+	if (fin) {
+		fclose(fin);
+	}
+	free(tmpname);
+}
+
+/**
+ * Beautify the given file. If the given filename does not exist, interpret the
+ * characters as options. If it is a directory, beautify all source files in it
+ * and its subdirectories.
+ * During beautify a new file &lt;filename&gt;$ is written.
+ * If there are no differences detected between input and output, the file
+ * &lt;filename&gt;$ is removed.
+ * If there are differences, then the file &lt;filename&gt; is copied to &lt;filename&gt;~
+ * and &lt;filename&gt;$ is copied to &lt;filename&gt;. If this copy-operation fails (e.g. because)
+ * &lt;filename&gt; is read-only, then a warning is given and &lt;filename&gt;$ is maintained.
+ *
+ * @param Busl BUSL status
+ * @param filename filename
+ */
+int __stdcall busl_beautify(Busl *s, const char *filename) {
+	char dest[256];
+	char orig[256];
+	FILE *fin = 0;
+	FILE *fout = 0;
+	int c;
+	int written;
+	int backup;
+	unsigned long int msgcount;
+	char *name;
+	const char *p = filename;
+	struct stat st;
+	unsigned long int size = 0;
+
+	/* If filename starts with @, read command line options from this file */
+	if (filename[0] == '@') {
+		fin = fopen(&filename[1], "r");
+		if (!fin) {
+			return warning(s, "%s: WARNING: file not found (ignored).\n", &filename[1], 0, 0);
+		}
+		c = 0;
+		while (fgets(orig, sizeof(orig)-1, fin)!=NULL) {
+			char *q = orig;
+			while (*q) ++q;
+			while (q>=&orig[1] && strchr(" \t\r\n", q[-1])) {
+				--q;
+			}
+			*q = '\0';
+			if (*orig && (*orig != '#')) {
+				c |= busl_beautify(s, orig);
+			}
+		}
+		fclose(fin);
+		return c;
+	}
+	/* If filename starts with =, beautify standard input to standard output */
+	if (filename[0] == '=') {
+		return filter(s, &filename[1]);
+	}
+	/* If filename starts with +, keep the beautified code in this directory */
+	if (filename[0] == '+') {
+		return setoutcache(s, &filename[1]);
+	}
+	/* If filename ends with slash, consider it as directory */
+	while (*p) ++p;
+	if (p>=&filename[2] && strchr(DIRSEPARATOR, p[-1])) {
+		s->outdir = (p>&filename[2] || *filename!='.')? filename: (const char *) 0;
+		return s->flags;
+	}
+	/* If filename is a directory, beautify all source files in it */
+	if (stat(filename, &st)) {
+		st.st_mode = 0;
+		st.st_size = 0;
+	} else if (S_ISDIR(st.st_mode)) {
+		return walk(s, filename);
+	} else if (s->cache && (s->defaultflags&USECACHE) && !s->outdir && iscached(s, filename, &st)) {
+		/* clean last time, and not modified since */
+		return 0;
+	}
+	size = (unsigned long int) st.st_size;
+	msgcount = s->msgcount;
+	fin = fopen(filename, "rb");
+	if (!fin) {
+		int savetabs = s->tabs;
+		int saveflags = s->defaultflags;
+		int savereport = s->report;
+		p = filename;
+		while (*p) {
+			char c = *p;
+			if (c >= 'A' && c <= 'Z')
+				c += 'a' - 'A';
+			if ((c>='0') && (c<='9')) {
+				s->tabs = c-'0';
+			} else if (c=='a') {
+				s->defaultflags |= AUTOMODE;
+			} else if (c=='c') {
+				s->defaultflags |= USECACHE;
+				loadcache(s);
+			} else if (c=='d') {
+				s->defaultflags &= ~NOTESTMODE;
+				s->report |= DIFFMODE;
+			} else if (c=='e') {
+				s->failfast = 1;
+			} else if (c=='f') {
+				s->defaultflags |= CHANGED;
+			} else if (c=='g') {
+				s->defaultflags &= ~(XMLMODE|AUTOMODE);
+			} else if (c=='k') {
+				s->defaultflags &= ~NOTESTMODE;
+				s->report |= CHECKMODE;
+			} else if (c=='j') {
+				s->jobs = 0;
+				while ((p[1]>='0') && (p[1]<='9')) {
+					s->jobs = 10*s->jobs+(*(++p)-'0');
+				}
+#ifdef HAVE_THREADS
+				if (!s->jobs) {
+					s->jobs = numcpus();
 				}
-				case '#': {
-					if (s->flags&(SPACENEEDED|SPACENEEDLF)) {
-						writechar(s, ' ', fout);
-					}
-					if (!s->outpos) {
-						s->quoted = '\n';
-						s->commentquoted = 0;
-					}
-					s->flags &= ~SPACEHANDLING;
-					s->flags |= SPACEASIS;
-					writechar(s, c, fout);
-					break;
+#endif
+			} else if (c=='l') {
+				s->defaultflags |= UNIXLFMODE;
+			} else if (c=='n') {
+				s->defaultflags |= NOBACKUP;
+			} else if (c=='q') {
+				s->defaultflags |= QUIETMODE;
+			} else if (c=='r') {
+				s->defaultflags |= MACCRMODE;
+			} else if (c=='s') {
+				s->defaultflags |= STRIPMODE;
+			} else if (c=='t') {
+				s->defaultflags &= ~NOTESTMODE;
+			} else if (c=='x') {
+				s->defaultflags &= ~AUTOMODE;
+				s->defaultflags |= XMLMODE;
+			} else if (c=='z') {
+				s->defaultflags |= ZIPMODE;
+			} else if (c=='-') {
+				if ((p[1]>'0') && (p[1]<='9')) {
+					s->tabs = '0'-*(++p);
+				} else {
+					s->defaultflags &= ~(CHANGED|UNIXLFMODE|MACCRMODE|QUIETMODE|STRIPMODE|ZIPMODE|NOBACKUP);
+					s->report = 0;
 				}
-				case '>': {
-					/* Check for occurrence of "%>", "#>", "?>", "</script>" or "/>" */
-					if (s->flags&XMLMODE) {
-						if (cmdtype) {
-							if ((s->inpos>=2) && (s->inbuf[s->inpos-2]==cmdtype)) {
-								s->quoted = '<';
-								if (s->indent && s->indentstack[s->indent-1]==':') {
-									s->indent--;
-								}
-								/* remove any spaces before %>, #> or ?> */
-								while ((s->outpos>1) && ((s->outbuf[s->outpos-2]==' ') || (s->outbuf[s->outpos-2]=='\t'))) {
-									--s->outpos;
-								}
-								s->outbuf[s->outpos-1] = cmdtype;
-								s->flags &= ~SPACEHANDLING;
-								s->flags |= SPACEASIS;
-							}
-						} else {
-							if ((s->inpos>=2) && (s->inbuf[s->inpos-2]=='/') && ((s->inpos<3) || (s->inbuf[s->inpos-3]!='*'))) {
-								s->quoted = '<';
-								/* remove any spaces before '/' */
-								while ((s->outpos>1) && ((s->outbuf[s->outpos-2]==' ') || (s->outbuf[s->outpos-2]=='\t'))) {
-									--s->outpos;
-								}
-								s->outbuf[s->outpos-1] = '/';
-								s->flags &= ~SPACEHANDLING;
-								s->flags |= SPACEASIS;
-							} else if ((s->outpos>=8) && !(s->flags&SPACENEEDED) && !memcmp(&s->outbuf[s->outpos-8], endscripttag, 8)) {
-								s->quoted = '<';
-								/* remove any spaces before </script */
-								while ((s->outpos>8) && ((s->outbuf[s->outpos-9]==' ') || (s->outbuf[s->outpos-9]=='\t'))) {
-									--s->outpos;
-								}
-								memcpy(&s->outbuf[s->outpos-8], endscripttag, 8);
-								s->flags &= ~SPACEHANDLING;
-								s->flags |= SPACEASIS;
-							}
-						}
-					}
-					/* no break here because further handling is equal to the default situation */
+			} else {
+				s->tabs = savetabs;
+				s->defaultflags = saveflags;
+				s->report = savereport;
+				return warning(s, "%s: WARNING: file not found or invalid option (ignored).\n", filename, 0, 0);
+			}
+			++p;
+		}
+		return s->flags;
+	}
+	if (s->batch) {
+		/* collecting files for busl_beautify_batch() */
+		fclose(fin);
+		return addtask(s, filename, size);
+	}
+	if (strlen(filename)+(s->outdir? strlen(s->outdir): 0)+2>sizeof(dest)) {
+		fclose(fin);
+		return warning(s, "%s: ERROR: filename too long.\n", filename, 0, 0);
+	}
+	p = strrchr(filename, '.');
+	if (s->outdir) {
+		const char *fwd = filename; /* filename without drive */
+#if defined(_DOS) || defined(_WIN16) || defined(_WIN32) || defined(_WIN64)
+		char drive = *fwd;
+		if (((drive>='A' && drive<='Z') || (drive>='a' && drive<='z')) && fwd[1]==':') {
+			fwd += 2;
+		}
+#endif
+		if (strchr(DIRSEPARATOR, *fwd)) {
+			if (strchr(DIRSEPARATOR, *s->outdir) || s->outdir[1]==':') {
+				/* filename and outdir are absolute: D:out/ C:/in/file => D:out/in/file */
+				strcpy(dest, s->outdir); /*           /out/ C:/in/file =>  /out/in/file */
+				strcat(dest, &fwd[1]);
+			} else {
+				/* filename is absolute and outdir is relative: out/ C:\in\file => C:\in\out/file */
+				const char *q = strrchr(filename, *fwd)+1;
+				memcpy(dest, filename, q-filename);
+				strcpy(&dest[q-filename], s->outdir);
+				strcat(dest, q);
+			}
+		} else {
+			/* filename is relative: D:/out/ C:in/file => D:/out/in/file */
+			strcpy(dest, s->outdir);
+			strcat(dest, fwd);
+		}
+	} else {
+		strcpy(orig, filename);
+		strcpy(dest, filename);
+		/* Under Windows, running "busl *.cpp" would beautify *.cpp~ and *.cpp$
+		 * as well! As a workaround, use *.cp~ as backup file and *.cp$ as
+		 * temporary file. This is useful for DOS and WIN16 as well, which
+		 * dont accept extensions longer than 3 characters. Only do this if
+		 * the file extension is exactly 3 characters long. If the last
+		 * character is already '~' or '$' then no beautification is done,
+		 * unless the 'f' flag is supplied
+		 * Because it might be that a Windows volume is mounted on a UNIX
+		 * box, or reverse, just do this processing always.
+		 */
+		if (p) {
+			if (p[1] && p[2] && p[3] && !p[4]) {
+				if (p[3]!='~' || !(s->defaultflags&CHANGED)) {
+					orig[(p-filename)+3] = '\0';
 				}
-				default: {
-					s->flags &= ~EXTRAINDENT;
-					if (s->flags&SPACENEEDED) {
-						writechar(s, ' ', fout);
-					} else if (s->flags&SPACENEEDLF) {
-						writechar(s, '\n', fout);
-					}
-					s->flags &= ~SPACEHANDLING;
-					s->flags |= SPACEASIS;
-					writechar(s, c, fout);
-					break;
+				if (p[3]!='$' || !(s->defaultflags&CHANGED)) {
+					dest[(p-filename)+3] = '\0';
 				}
-
 			}
-		}
-		/* read one char from input stream. Use the read ahead character if available. */
-		if (savechar!='\n') {
-			c = savechar;
-			savechar = '\n';
 		} else {
-			c = fgetc(fin);
+			strcat(orig, ".");
+			strcat(dest, ".");
 		}
-		if (c=='\r') {
-			/* If it is CR then read one character ahead. */
-			savechar = fgetc(fin);
-			c = '\n';
+		strcat(orig, "~");
+		strcat(dest, "$");
+	}
+	s->flags = (s->defaultflags&~SPACEHANDLING)|SPACESTRIP;
+	if (p) {
+		if ((!strcmp(orig, filename)) || (!strcmp(dest, filename)) || (!(s->defaultflags&CHANGED) && checkext(++p, ignorext, sizeof(ignorext)))) {
+			s->flags &= ~CHANGED;
+			fclose(fin);
+			return warning(s, "%s: ERROR: unsupported file extension: not modified.\n", filename, 0, 0);
 		}
 	}
-	if (s->outpos) {
-		writechar(s, '\n', fout);
+	setmode(s, filename, p);
+	if (!(s->defaultflags&NOTESTMODE) && (s->report&DIFFMODE) && !startdiff(s, filename)) {
+		/* started before reading, so the original line ends are seen */
+		fclose(fin);
+		return warning(s, "%s: ERROR: out of memory.\n", filename, 0, 0);
 	}
-	if (s->flags&ZIPMODE) {
-		long int pos;
-		s->flags |= CHANGED;
-		if (!(s->defaultflags&(UNIXLFMODE|MACCRMODE))) {
-			/* re-open file in binary mode */
-			fclose(fin);
-			fin = fopen(dest, "ab");
-			if (!fin) {
-				fclose(fout);
-				return warning(s, "%s: ERROR: cannot re-open in binary mode for writing remaining after <CTRL>-Z.\n", dest, 0, 0);
-			}
-		} else {
-			fflush(fout);
+	if (!openinput(s, fin)) {
+		if (s->diff) {
+			s->diff->active = 0;
 		}
-		/* prepare ZIP trailer */
-		pos = ftell(fout);
-		memcpy(s->outbuf, "\032\120\113\005\006", 5);
-		memset(&s->outbuf[5], 0, 18);
-		s->outbuf[17] = (char) ++pos;
-		s->outbuf[18] = (char) (pos>>8);
-		s->outbuf[19] = (char) (pos>>16);
-		s->outbuf[20] = (char) (pos>>24);
-		/* write ZIP trailer */
-		if (fout) {
-			fwrite(s->outbuf, 1, 23, fout);
+		fclose(fin);
+		return warning(s, "%s: ERROR: out of memory.\n", filename, 0, 0);
+	}
+	if (s->diff) {
+		/* the input starts here */
+		s->diff->inmark = s->inptr;
+	}
+	if (s->defaultflags & NOTESTMODE) {
+		if (s->inbase && !s->outdir && !(s->flags&(STRIPMODE|ZIPMODE)) && !(s->defaultflags&MACCRMODE)) {
+			/* Most files are clean already: don't create the output file
+			 * until the output differs from the input. */
+			s->outname = dest;
+		} else if (!openoutput(s, dest)) {
+			closeinput(s);
+			fclose(fin);
+			return s->flags;
 		}
 	}
-	if (fout) {
-		fclose(fout);
+	s->outmemsize = 0;
+	name = s->outcache? outcachename(s): (char *) 0;
+	if (name && readoutcache(s, name)) {
+		/* beautified before, maybe somewhere else */
+		c = 0;
+		free(name);
+		name = 0;
+	} else {
+		c = (s->report&CHECKMODE)? lexcheck(s, filename, dest): (lexparallel(s, filename, dest) || checkend(s, filename, dest));
+		enddiff(s);
 	}
+	if (s->outname && (c || (s->flags&CHANGED))) {
+		/* the output is needed after all, e.g. when an error message mentions it */
+		openoutput(s, dest);
+	}
+	written = (s->outname==0);
+	s->outname = 0;
+	if (s->fout) {
+		fclose(s->fout);
+		s->fout = 0;
+	} else if (written && (s->defaultflags&NOTESTMODE)) {
+		/* it could not be created */
+		c = 1;
+	}
+	if (name && !c && (s->msgcount==msgcount) && ((s->defaultflags&NOTESTMODE) || !(s->flags&CHANGED))) {
+		writeoutcache(s, name, dest);
+	}
+	free(name);
+	closeinput(s);
 	fclose(fin);
-	if (s->quoted=='*') {
-		warning(s, "%s(%d,%d): ERROR: */ missing at end of file.\n", filename, s->linenum, 0);
-		if (!(s->defaultflags&CHANGED)) {
-			s->flags &= ~CHANGED;
-			return (s->flags&NOTESTMODE)? warning(s, ERRORMESSAGE, dest, 0, 0): s->flags;
-		}
-	} else if ((s->quoted=='\'') || (s->quoted=='\"') || (s->quoted=='/')) {
-		warning(s, "%s(%d,%d): ERROR: %c missing at end of file.\n", filename, s->linenum, s->quoted);
-		if (!(s->defaultflags&CHANGED)) {
-			s->flags &= ~CHANGED;
-			return (s->flags&NOTESTMODE)? warning(s, ERRORMESSAGE, dest, 0, 0): s->flags;
-		}
-	} else if ((s->flags&XMLMODE) && (s->quoted!='<')) {
-		if (cmdtype) {
-			warning(s, "%s(%d,%d): ERROR: %c> missing at end of file.\n", filename, s->linenum, cmdtype);
-		} else {
-			warning(s, "%s(%d,%d): ERROR: </script> missing at end of file.\n", filename, s->linenum, 0);
-		}
-		if (!(s->defaultflags&CHANGED)) {
-			s->flags &= ~CHANGED;
-			if (s->flags&NOTESTMODE) {
-				warning(s, ERRORMESSAGE, dest, 0, 0);
-			}
-		}
+	if (c) {
 		return s->flags;
-	} else {
-		while (s->indent && strchr(XXXX11, s->indentstack[s->indent-1])) s->indent--;
-		if (s->indent--) {
-			if (s->indentstack[s->indent]=='(') {
-				s->indentstack[s->indent] = ')';
-			}
-			warning(s, "%s(%d,%d): ERROR: %c", filename, s->linenum, s->indentstack[s->indent]);
-			while (s->indent--) {
-				if (!strchr(XXXX11, s->indentstack[s->indent])) {
-					if (s->indentstack[s->indent]=='(') {
-						s->indentstack[s->indent] = ')';
-					}
-					warning(s, "%s%c", ", ", 0, s->indentstack[s->indent]);
-				}
-			}
-			warning(s, " missing at end of file.\n", filename, 0, 0);
-			if (!(s->defaultflags&CHANGED)) {
-				s->flags &= ~CHANGED;
-				if (s->flags&NOTESTMODE) {
-					warning(s, ERRORMESSAGE, dest, 0, 0);
-				}
-			}
-			return s->flags;
-		}
+	}
+	if (s->cache && (s->defaultflags&USECACHE) && !(s->flags&(CHANGED|STRIPMODE)) && !s->outdir
+			&& (s->msgcount==msgcount) && S_ISREG(st.st_mode)) {
+		setcached(s, filename, &st);
 	}
 	if (s->outdir || s->flags&STRIPMODE) {
 		s->flags |= CHANGED;
@@ -1432,70 +4948,605 @@ int __stdcall busl_beautify(Busl *s, const char *filename) {
 			}
 		}
 	} else if (!(s->defaultflags&NOTESTMODE)) {
-		if (s->flags&CHANGED && !(s->defaultflags & QUIETMODE)) {
+		if ((s->flags&CHANGED) && (s->report&CHECKMODE)) {
+			return warning(s, "%s(%d,0): WARNING: not beautified, first change in this line.\n", filename, s->changedline? s->changedline: s->linenum, 0);
+		}
+		if (s->flags&CHANGED && !(s->defaultflags&QUIETMODE) && !(s->report&DIFFMODE)) {
 			return warning(s, "%s not written (test mode)\n", dest, 0, 0);
 		}
 		return s->flags;
 	} else if (s->flags&CHANGED) {
-		fin = fopen(filename, "rb");
-		if (!fin) {
-			warning(s, "%s: ERROR: cannot open\n", filename, 0, 0);
-		} else {
-			fout = fopen(orig, "wb");
-			if (!fout) {
-				fclose(fin);
+		if (replacefile(s, filename, dest, orig)) {
+			modified(s, filename);
+			return s->flags;
+		}
+		/* Copy the files instead. This keeps the original file itself,
+		 * including its hard links and owner. */
+		backup = (s->defaultflags&NOBACKUP)? 0: -1;
+		if (backup) {
+			fin = fopen(filename, "rb");
+			if (!fin) {
 				warning(s, "%s: ERROR: cannot open\n", filename, 0, 0);
 			} else {
-				s->outpos = (int) fread(s->outbuf, 1, sizeof(s->outbuf), fin);
-				while (s->outpos==sizeof(s->outbuf)) {
-					fwrite(s->outbuf, 1, sizeof(s->outbuf), fout);
-					s->outpos = (int) fread(s->outbuf, 1, sizeof(s->outbuf), fin);
-				}
-				if (s->outpos>0) {
-					fwrite(s->outbuf, 1, s->outpos, fout);
+				/* it might be a hard link to the file itself */
+				unlink(orig);
+				fout = fopen(orig, "wb");
+				if (!fout) {
+					warning(s, "%s: ERROR: cannot open\n", filename, 0, 0);
+				} else {
+					copyfile(s, fin, fout);
+					fclose(fout);
+					backup = 1;
 				}
-				fclose(fout);
 				fclose(fin);
-
-				fin = fopen(dest, "rb");
-				if (!fin) {
-					warning(s, "%s: ERROR: cannot open\n", dest, 0, 0);
-				} else {
-					fout = fopen(filename, "wb");
-					if (!fout) {
-						warning(s, "%s: ERROR: should be writable\n", filename, 0, 0);
+			}
+		}
+		if (backup>=0) {
+			fin = fopen(dest, "rb");
+			if (!fin) {
+				warning(s, "%s: ERROR: cannot open\n", dest, 0, 0);
+			} else {
+				fout = fopen(filename, "wb");
+				if (!fout) {
+					warning(s, "%s: ERROR: should be writable\n", filename, 0, 0);
+					if (backup) {
 						removefile(s, orig);
-					} else {
-						s->outpos = (int) fread(s->outbuf, 1, sizeof(s->outbuf), fin);
-						while (s->outpos==sizeof(s->outbuf)) {
-							fwrite(s->outbuf, 1, sizeof(s->outbuf), fout);
-							s->outpos = (int) fread(s->outbuf, 1, sizeof(s->outbuf), fin);
-						}
-						if (s->outpos>0) {
-							fwrite(s->outbuf, 1, s->outpos, fout);
-						}
-						fclose(fout);
-						removefile(s, dest);
-						if (!(s->defaultflags&QUIETMODE)) {
-							if (s->flags&XMLMODE) {
-								warning(s, "%s modified (xml/html/sgml mode)\n", filename, 0, 0);
-							} else if (s->flags&ZIPMODE) {
-								warning(s, "%s modified (trailer contains empty ZIP-file)\n", filename, 0, 0);
-							} else {
-								warning(s, "%s modified\n", filename, 0, 0);
-							}
-						}
 					}
-					fclose(fin);
+				} else {
+					copyfile(s, fin, fout);
+					fclose(fout);
+					removefile(s, dest);
+					modified(s, filename);
 				}
+				fclose(fin);
 			}
 		}
-	} else {
+	} else if (written) {
 		removefile(s, dest);
 	}
 	return s->flags;
 }
 
+/**
+ * Caller-owned memory receiving messages, see busl_beautify_buffer()
+ */
+typedef struct msgbuf {
+	/** message memory */
+	char *buf;
+	/** size of message memory */
+	size_t size;
+	/** length of all messages, even when they don't fit */
+	size_t len;
+} msgbuf;
+
+/**
+ * Message output function which appends messages to caller-owned memory. The
+ * memory is always kept nul-terminated, messages which don't fit are truncated.
+ *
+ * @param data msgbuf
+ * @param str message
+ */
+static void __stdcall memwrt(void *data, const char *str) {
+	msgbuf *m = (msgbuf *) data;
+	size_t len = strlen(str);
+	if (m->len+1<m->size) {
+		size_t room = m->size-m->len-1;
+		if (len<room) room = len;
+		memcpy(&m->buf[m->len], str, room);
+		m->buf[m->len+room] = '\0';
+	}
+	m->len += len;
+}
+
+/**
+ * Beautify source code which is already in memory, passing the beautified code
+ * to a function of the caller, e.g. a line at a time. Nothing is read from or
+ * written to disk. The filename is only used in messages and - in automatic
+ * mode - to determine the mode from its extension. The messages are handled
+ * the same as by busl_beautify_buffer().
+ *
+ * @param s BUSL status
+ * @param filename filename (may be 0)
+ * @param input source code to be beautified
+ * @param inputlen length of source code
+ * @param sink function receiving the beautified code, in pieces (may be 0)
+ * @param data first argument of sink
+ * @param messages memory receiving the messages (may be 0)
+ * @param messageslen in: size of message memory, out: length of messages
+ * @return flags, CHANGED is set when the beautified code differs
+ */
+int __stdcall busl_beautify_sink(Busl *s, const char *filename, const char *input, size_t inputlen, void (__stdcall *sink)(void *, const char *, size_t), void *data, char *messages, size_t *messageslen) {
+	void (__stdcall *savewrt)(void *, const char *) = s->wrt;
+	void *saveoutput = s->output;
+	int saveresult = s->result;
+	msgbuf m;
+	const char *p;
+
+	if (messages) {
+		/* collect messages, without the copyright message */
+		m.buf = messages;
+		m.size = *messageslen;
+		m.len = 0;
+		if (m.size) *messages = '\0';
+		s->wrt = memwrt;
+		s->output = &m;
+		if (s->result<0) s->result = EXIT_SUCCESS;
+	}
+	if (!filename) {
+		filename = BUFFERNAME;
+	}
+	p = strrchr(filename, '.');
+	s->flags = (s->defaultflags&~SPACEHANDLING)|SPACESTRIP;
+	if (p && !(s->defaultflags&CHANGED) && checkext(++p, ignorext, sizeof(ignorext))) {
+		s->flags &= ~CHANGED;
+		warning(s, "%s: ERROR: unsupported file extension: not modified.\n", filename, 0, 0);
+		s->outlen = 0;
+	} else {
+		setmode(s, filename, p);
+		s->sink = sink;
+		s->sinkdata = data;
+		if (!setinput(s, input, inputlen)) {
+			warning(s, "%s: ERROR: out of memory.\n", filename, 0, 0);
+		} else if (!lex(s, filename, 0) && !checkend(s, filename, 0) && (s->flags&STRIPMODE)) {
+			s->flags |= CHANGED;
+		}
+		closeinput(s);
+		s->sink = 0;
+	}
+	if (messages) {
+		*messageslen = m.len;
+		s->wrt = savewrt;
+		s->output = saveoutput;
+		if ((saveresult<0) && (s->result==EXIT_SUCCESS)) s->result = saveresult;
+	}
+	return s->flags;
+}
+
+/**
+ * Beautify source code which is already in memory. Nothing is read from or
+ * written to disk: the beautified code is written to caller-owned memory.
+ * The filename is only used in messages and - in automatic mode - to determine
+ * the mode from its extension.
+ * If the output doesn't fit, it is truncated, but *outputlen still receives the
+ * full length, so the call can be repeated with a larger buffer. The same holds
+ * for the messages, which are nul-terminated. If messages is 0, the messages are
+ * written to the message output function as usual.
+ *
+ * @param s BUSL status
+ * @param filename filename (may be 0)
+ * @param input source code to be beautified
+ * @param inputlen length of source code
+ * @param output memory receiving the beautified code
+ * @param outputlen in: size of output memory, out: length of beautified code
+ * @param messages memory receiving the messages (may be 0)
+ * @param messageslen in: size of message memory, out: length of messages
+ * @return flags, CHANGED is set when the beautified code differs
+ */
+int __stdcall busl_beautify_buffer(Busl *s, const char *filename, const char *input, size_t inputlen, char *output, size_t *outputlen, char *messages, size_t *messageslen) {
+	int flags;
+	s->outmem = output;
+	s->outmemsize = output? *outputlen: 0;
+	flags = busl_beautify_sink(s, filename, input, inputlen, writememory, s, messages, messageslen);
+	*outputlen = s->outlen;
+	s->outmem = 0;
+	s->outmemsize = 0;
+	return flags;
+}
+
+/**
+ * Release the checkpoints kept by busl_beautify_range().
+ *
+ * @param Busl BUSL status
+ */
+static void __stdcall freecheckpoints(Busl *s) {
+	if (s->checkpoints) {
+		freestates(&s->checkpoints->old);
+		freestates(&s->checkpoints->now);
+		free(s->checkpoints->filename);
+		free(s->checkpoints);
+		s->checkpoints = 0;
+	}
+}
+
+/**
+ * Get the checkpoints for busl_beautify_range(), dropping those of another
+ * file or other options.
+ *
+ * @param Busl BUSL status
+ * @param filename filename
+ * @return checkpoints, 0 when out of memory
+ */
+static buslcheckpoints *__stdcall getcheckpoints(Busl *s, const char *filename) {
+	buslcheckpoints *r = s->checkpoints;
+	size_t len = strlen(filename)+1;
+	if (r && (strcmp(r->filename, filename) || (r->defaultflags!=s->defaultflags) || (r->tabs!=s->tabs))) {
+		freecheckpoints(s);
+		r = 0;
+	}
+	if (!r && (r = (buslcheckpoints *) calloc(1, sizeof(buslcheckpoints)))!=0) {
+		if (!(r->filename = (char *) malloc(len))) {
+			free(r);
+			return 0;
+		}
+		memcpy(r->filename, filename, len);
+		r->defaultflags = s->defaultflags;
+		r->tabs = s->tabs;
+		s->checkpoints = r;
+	}
+	return r;
+}
+
+/**
+ * Start beautifying at the last checkpoint before the range, where the input
+ * is still the same as in the previous call. The checkpoints up to there are
+ * kept.
+ *
+ * @param Busl BUSL status
+ * @return 0 when out of memory
+ */
+static int __stdcall startrange(Busl *s) {
+	buslcheckpoints *r = s->checkpoints;
+	buslstates *old = &r->old;
+	size_t len = r->now.inputlen;
+	size_t prefix = 0;
+	size_t suffix = 0;
+	long i;
+	buslcheckpoint cp;
+	if (len>old->inputlen) {
+		len = old->inputlen;
+	}
+	while ((len-prefix>=256) && !memcmp(&old->input[prefix], &r->now.input[prefix], 256)) {
+		prefix += 256;
+	}
+	while ((prefix<len) && (old->input[prefix]==r->now.input[prefix])) {
+		++prefix;
+	}
+	while ((len-prefix-suffix>=256) && !memcmp(&old->input[old->inputlen-suffix-256], &r->now.input[r->now.inputlen-suffix-256], 256)) {
+		suffix += 256;
+	}
+	while ((prefix+suffix<len) && (old->input[old->inputlen-suffix-1]==r->now.input[r->now.inputlen-suffix-1])) {
+		++suffix;
+	}
+	r->same = old->inputlen-suffix;
+	/* the state at a line start depends on the input before it, and possibly its
+	 * first character */
+	for (i=0; (i<old->count) && (old->cp[i].line<=r->first) && (!old->cp[i].offset || (old->cp[i].offset<prefix)); ++i) {
+		if (!addcheckpoint(&r->now, &old->cp[i], &old->stack[old->cp[i].stack])) {
+			return 0;
+		}
+	}
+	if (r->now.count) {
+		cp = r->now.cp[r->now.count-1];
+		if (!restorestate(s, &cp, &r->now.stack[cp.stack])) {
+			return 0;
+		}
+	} else {
+		getstate(s, &cp, 0, 1);
+		if (!addcheckpoint(&r->now, &cp, s->indentstack)) {
+			return 0;
+		}
+	}
+	r->line = r->recorded = r->from = cp.line;
+	r->counted = cp.offset;
+	r->to = 0;
+	r->next = 0;
+	r->active = 1;
+	r->changed = 0;
+	return 1;
+}
+
+/**
+ * Beautify some lines of source code in memory, e.g. the lines just edited.
+ * This works like busl_beautify_buffer(), but output receives the beautified
+ * code of these lines only, and only messages about them and about the end of
+ * the input are given. The range is widened to the nearest line starts where
+ * the state of BUSL is known, *firstline and *lastline receive the lines
+ * actually beautified, which are to be replaced by the output.
+ * The state at line starts is kept in the BUSL status. A next call for the same
+ * file and options only beautifies from the last checkpoint before the range
+ * which is not affected by changes of the input, and stops after the range as
+ * soon as the state is the same as in the previous call at the same place.
+ * So the time needed depends on the size of the range and the changes, not on
+ * the size of the input (except for the first call). The "z" option is ignored.
+ *
+ * @param s BUSL status
+ * @param filename filename (may be 0)
+ * @param input source code (the whole file)
+ * @param inputlen length of source code
+ * @param firstline in: first line to be beautified (1 = first line), out: first line beautified
+ * @param lastline in: last line to be beautified, out: last line beautified
+ * @param output memory receiving the beautified lines
+ * @param outputlen in: size of output memory, out: length of beautified lines
+ * @param messages memory receiving the messages (may be 0)
+ * @param messageslen in: size of message memory, out: length of messages
+ * @return flags, CHANGED is set when the beautified lines differ
+ */
+int __stdcall busl_beautify_range(Busl *s, const char *filename, const char *input, size_t inputlen, int *firstline, int *lastline, char *output, size_t *outputlen, char *messages, size_t *messageslen) {
+	void (__stdcall *savewrt)(void *, const char *) = s->wrt;
+	void *saveoutput = s->output;
+	int saveresult = s->result;
+	buslcheckpoints *r;
+	msgbuf m;
+	const char *p;
+	size_t len;
+	size_t outsize;
+
+	if (messages) {
+		/* collect messages, without the copyright message */
+		m.buf = messages;
+		m.size = *messageslen;
+		m.len = 0;
+		if (m.size) *messages = '\0';
+		s->wrt = memwrt;
+		s->output = &m;
+		if (s->result<0) s->result = EXIT_SUCCESS;
+	}
+	if (!filename) {
+		filename = BUFFERNAME;
+	}
+	p = strrchr(filename, '.');
+	s->flags = (s->defaultflags&~SPACEHANDLING)|SPACESTRIP;
+	outsize = output? *outputlen: 0;
+	*outputlen = 0;
+	if (p && !(s->defaultflags&CHANGED) && checkext(++p, ignorext, sizeof(ignorext))) {
+		s->flags &= ~CHANGED;
+		warning(s, "%s: ERROR: unsupported file extension: not modified.\n", filename, 0, 0);
+	} else if (!(r = getcheckpoints(s, filename))) {
+		warning(s, "%s: ERROR: out of memory.\n", filename, 0, 0);
+	} else {
+		setmode(s, filename, p);
+		/* the zip trailer depends on the whole output */
+		s->flags &= ~ZIPMODE;
+		s->outmem = output;
+		s->outmemsize = outsize;
+		s->sink = writememory;
+		s->sinkdata = s;
+		r->first = (*firstline>1)? *firstline: 1;
+		r->last = (*lastline>r->first)? *lastline: r->first;
+		if (!setinput(s, input, inputlen) || !(r->now.input = (char *) malloc((len = s->inend-s->inbase)+1))) {
+			warning(s, "%s: ERROR: out of memory.\n", filename, 0, 0);
+		} else {
+			memcpy(r->now.input, s->inbase, len);
+			r->now.inputlen = len;
+			if (!startrange(s)) {
+				warning(s, "%s: ERROR: out of memory.\n", filename, 0, 0);
+			} else {
+				int error;
+				r->running = 1;
+				s->linestart = checkpoint;
+				error = lex(s, filename, 0);
+				s->linestart = 0;
+				if (!error && !r->now.hasend) {
+					/* the end is reached: count the last lines and keep the state */
+					p = &s->inbase[r->counted];
+					while ((p<s->inend) && ((p = (const char *) memchr(p, '\n', s->inend-p))!=0)) {
+						++p;
+						++r->line;
+					}
+					if (len && (s->inbase[len-1]=='\n')) {
+						--r->line;
+					}
+					getstate(s, &r->now.end, len, r->line);
+					r->now.hasend = savestack(&r->now, &r->now.end, s->indentstack);
+				}
+				if (!r->to) {
+					/* the range includes the last line */
+					r->to = r->line;
+					r->changed = s->flags&CHANGED;
+				}
+				r->atend = 1;
+				if (error || checkend(s, filename, 0)) {
+					if (!(s->defaultflags&CHANGED)) {
+						r->changed = 0;
+					}
+				} else if (s->flags&STRIPMODE) {
+					r->changed = CHANGED;
+				}
+				s->flags = (s->flags&~CHANGED)|r->changed;
+				r->running = r->atend = r->active = 0;
+				*firstline = r->from;
+				*lastline = r->to;
+				*outputlen = s->outlen;
+			}
+		}
+		freestates(&r->old);
+		r->old = r->now;
+		memset(&r->now, 0, sizeof(buslstates));
+		closeinput(s);
+		s->outmem = 0;
+		s->outmemsize = 0;
+		s->sink = 0;
+	}
+	if (messages) {
+		*messageslen = m.len;
+		s->wrt = savewrt;
+		s->output = saveoutput;
+		if ((saveresult<0) && (s->result==EXIT_SUCCESS)) s->result = saveresult;
+	}
+	return s->flags;
+}
+
+/**
+ * Beautify the files of a range of tasks and give their messages. With more
+ * than one job, the files are beautified in parallel, otherwise sequentially
+ * by the first worker.
+ *
+ * @param s BUSL status
+ * @param w BUSL status of the first worker
+ * @param b batch
+ * @param first index of the first task
+ * @param last index after the last task
+ * @param jobs the "j" option of the files in the range
+ * @return flags, CHANGED is set when any file is changed
+ */
+static int __stdcall beautifytasks(Busl *s, Busl *w, buslbatch *b, long first, long last, int jobs) {
+	int changed = 0;
+	long i;
+#ifdef HAVE_THREADS
+	buslworker *worker;
+	int workers = 1;
+	long files = 0;
+	for (i=first; i<last; ++i) {
+		if (b->task[i].name) {
+			++files;
+		}
+	}
+	b->ordered = 0;
+	b->next = 0;
+	if ((jobs>1) && (files>1) && ((b->order = (busltask **) malloc(files*sizeof(busltask *)))!=0)) {
+		busltask *prev = 0;
+		long n = 0;
+		for (i=first; i<last; ++i) {
+			if (b->task[i].name) {
+				b->order[n++] = &b->task[i];
+			}
+		}
+		/* Files sharing a temporary and backup file are beautified one
+		 * after another by the same worker, like "foo.jsp" and "foo.js" */
+		qsort(b->order, n, sizeof(busltask *), cmpstem);
+		for (i=0, n=0; i<files; ++i) {
+			busltask *t = b->order[i];
+			size_t len = stemlen(t->name);
+			if (prev && (stemlen(prev->name)==len) && !memcmp(prev->name, t->name, len)) {
+				prev->next = t;
+				b->order[n-1]->size += t->size;
+			} else {
+				b->order[n++] = t;
+			}
+			prev = t;
+		}
+		b->ordered = n;
+		workers = (jobs<b->ordered)? jobs: (int) b->ordered;
+	}
+	if ((workers>1) && ((worker = (buslworker *) calloc(workers, sizeof(buslworker)))!=0)) {
+		int k;
+		qsort(b->order, b->ordered, sizeof(busltask *), cmpsize);
+		initlock(&b->lock);
+		for (k=0; k<workers; ++k) {
+			worker[k].batch = b;
+			worker[k].s = k? busl_create(0, taskwrt, 0): w;
+			if (!worker[k].s) {
+				/* the workers started so far take all files */
+				warning(s, "%s: WARNING: out of memory, beautified with fewer workers.\n", b->order[0]->name, 0, 0);
+				workers = k;
+				break;
+			}
+			worker[k].s->cache = s->cache;
+			worker[k].s->jobs = jobs/workers;
+			if (k) {
+				startthread(&worker[k].thread, workerproc, &worker[k]);
+			}
+		}
+		/* this thread is a worker as well */
+		workerproc(&worker[0]);
+		for (k=1; k<workers; ++k) {
+			jointhread(&worker[k].thread);
+			mergeremoved(s, worker[k].s);
+			worker[k].s->cache = 0;
+			worker[k].s->outcache = 0;
+			busl_delete(worker[k].s);
+		}
+		destroylock(&b->lock);
+		free(worker);
+		for (i=first; i<last; ++i) {
+			finishtask(s, &b->task[i]);
+			changed |= b->task[i].flags;
+		}
+	} else
+#endif
+	{
+		/* sequentially: give the messages of each file immediately */
+		w->jobs = jobs; /* a single large file is split, see lexparallel() */
+		for (i=first; i<last; ++i) {
+			if (!b->stop) {
+				runtask(w, &b->task[i]);
+				b->stop = b->task[i].failfast && (b->task[i].flags&CHANGED);
+			}
+			finishtask(s, &b->task[i]);
+			changed |= b->task[i].flags;
+		}
+	}
+	free(b->order);
+	b->order = 0;
+	return changed;
+}
+
+/**
+ * Beautify a list of files, like calling busl_beautify() for each of them. The
+ * list may contain options, output directories and @<file> as well, which are
+ * applied to the files following them. With the "j" option the files are
+ * beautified in parallel, each worker using its own BUSL status. Messages are
+ * buffered per file and given in the order of the list, and the result codes
+ * are merged, so busl_finish() gives the same result as a sequential run.
+ * Each file should occur only once in the list.
+ *
+ * @param s BUSL status
+ * @param argc number of files/options
+ * @param argv files/options
+ * @return flags, CHANGED is set when any file is changed
+ */
+int __stdcall busl_beautify_batch(Busl *s, int argc, const char *const *argv) {
+	int changed = 0;
+	buslbatch b;
+	void (__stdcall *savewrt)(void *, const char *) = s->wrt;
+	void *saveoutput = s->output;
+	int saveresult = s->result;
+	int collected;
+	long i, last;
+	Busl *w;
+
+	/* First collect all files, keeping the messages of options in between */
+	memset(&b, 0, sizeof(b));
+	s->batch = &b;
+	s->wrt = batchwrt;
+	s->output = &b;
+	if (saveresult<0) s->result = EXIT_SUCCESS;
+	while (argc-->0) {
+		changed |= busl_beautify(s, *argv++);
+	}
+	s->batch = 0;
+	s->wrt = savewrt;
+	s->output = saveoutput;
+	collected = s->result;
+	s->result = saveresult;
+
+	w = busl_create(0, taskwrt, 0);
+	if (!w) {
+		for (i=0; i<b.count; ++i) {
+			if (b.task[i].name) {
+				warning(s, "%s: ERROR: out of memory.\n", b.task[i].name, 0, 0);
+			}
+			finishtask(s, &b.task[i]);
+		}
+		free(b.task);
+		mergeresult(s, collected);
+		return changed;
+	}
+	w->cache = s->cache;
+	for (i=0; i<b.count; i=last) {
+		/* the files up to the next change of the "j" option */
+		long files = 0;
+		int jobs = 1;
+		for (last=i; last<b.count; ++last) {
+			if (b.task[last].name) {
+				if (files++ && (b.task[last].jobs!=jobs)) {
+					break;
+				}
+				jobs = b.task[last].jobs;
+			}
+		}
+		changed |= beautifytasks(s, w, &b, i, last, jobs);
+	}
+	mergeremoved(s, w);
+	w->cache = 0;
+	w->outcache = 0;
+	busl_delete(w);
+	free(b.task);
+	/* the messages of options are given already, only merge their result */
+	mergeresult(s, collected);
+	return changed;
+}
+
 /**
  * print usage instructions to output stream.
  *
@@ -1510,9 +5561,15 @@ int __stdcall busl_usage(Busl *s, const char *argv0) {
 	warning(s, "\t4 indenting 4 spaces/level\n", COPYRIGHT, 0, 0);
 	warning(s, "\t-4 indenting 1 tab=4 spaces/level (default)\n", COPYRIGHT, 0, 0);
 	warning(s, "\ta automatic detection of mode (default)\n", COPYRIGHT, 0, 0);
+	warning(s, "\tc skip files which were clean last time (remembered in .buslcache)\n", COPYRIGHT, 0, 0);
+	warning(s, "\td diff mode: show the changes as unified diff, nothing is written (implies t)\n", COPYRIGHT, 0, 0);
+	warning(s, "\te stop at the first file which is not clean\n", COPYRIGHT, 0, 0);
 	warning(s, "\tf force output\n", COPYRIGHT, 0, 0);
 	warning(s, "\tg generic mode (default) (resets a, x)\n", COPYRIGHT, 0, 0);
+	warning(s, "\tj<n> beautify <n> files in parallel (j only: one per processor)\n", COPYRIGHT, 0, 0);
+	warning(s, "\tk check mode: stop each file at the first line which is not beautified (implies t)\n", COPYRIGHT, 0, 0);
 	warning(s, "\tl linefeed mode\n", COPYRIGHT, 0, 0);
+	warning(s, "\tn no backup of modified files (<file>~)\n", COPYRIGHT, 0, 0);
 	warning(s, "\tq quiet mode\n", COPYRIGHT, 0, 0);
 	warning(s, "\tr carriage return mode\n", COPYRIGHT, 0, 0);
 	warning(s, "\ts strip mode\n", COPYRIGHT, 0, 0);
@@ -1520,7 +5577,10 @@ int __stdcall busl_usage(Busl *s, const char *argv0) {
 	warning(s, "\tx xml/html/sgml mode (resets a, g)\n", COPYRIGHT, 0, 0);
 	warning(s, "\tz prepare as zip file (not usable with x)\n", COPYRIGHT, 0, 0);
 	warning(s, "\t@<file> read command line options from file\n", COPYRIGHT, 0, 0);
+	warning(s, "\t=<ext> beautify standard input to standard output, <ext> determines mode\n", COPYRIGHT, 0, 0);
+	warning(s, "\t+<dir> keep beautified code in cache directory <dir>, shared by identical files\n", COPYRIGHT, 0, 0);
 	warning(s, "\t<output-dir> should end with '/' or '\\' (default './')\n", COPYRIGHT, 0, 0);
+	warning(s, "\t<directory> beautify all source files in directory and subdirectories\n", COPYRIGHT, 0, 0);
 	return CHANGED;
 }
 
@@ -1548,6 +5608,16 @@ int __stdcall busl_finish(Busl *s, int changed) {
 		s->first = s->first->next;
 		free(old);
 	}
+	free(s->inbuf);
+	free(s->outbuf);
+	s->inbuf = s->outbuf = 0;
+	s->bufsize = 0;
+	resetstack(s);
+	s->stacksize = 0;
+	savecache(s);
+	setoutcache(s, "");
+	freecheckpoints(s);
+	freediff(s);
 	return s->result;
 }
 
@@ -1555,8 +5625,8 @@ int __stdcall busl_finish(Busl *s, int changed) {
  * constructor.
  */
 Busl *__stdcall busl_create(Busl *s, void (__stdcall* wrt)(void *, const char *), void *output) {
-	if (!s) {
-		s = (Busl *) malloc(sizeof(Busl));
+	if (!s && !(s = (Busl *) malloc(sizeof(Busl)))) {
+		return 0;
 	}
 	memset(s, 0, sizeof(Busl));
 	s->wrt = wrt;
@@ -1573,5 +5643,12 @@ Busl *__stdcall busl_create(Busl *s, void (__stdcall* wrt)(void *, const char *)
  * @param s BUSL status
  */
 void __stdcall busl_delete(Busl *s) {
+	resetstack(s);
+	savecache(s);
+	free(s->outcache);
+	freecheckpoints(s);
+	freediff(s);
+	free(s->inbuf);
+	free(s->outbuf);
 	free((char *) s);
 }
@@ -0,0 +1,664 @@
+/** @file busltest.c
+ * Regression tests for the BUSL library. Each test runs in a directory of its
+ * own, "busl_test.<test>", and is selected by the first command line argument:
+ * busl_test <test>
+ * Copyright (c) 2003-2009, Jan Nijtmans. All rights reserved.
+ */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(_WIN32) || defined(_WIN64)
+#   include <direct.h>
+#   include <sys/utime.h>
+#   define mkdir(dir, mode) _mkdir(dir)
+#   define chdir _chdir
+#else
+#   include <sys/stat.h>
+#   include <unistd.h>
+#   include <utime.h>
+#   include <dirent.h>
+#endif
+#include "busl.h"
+
+/** number of .jsp/.js pairs in the batch test */
+#define PAIRS 8
+
+/** number of times the body of a file in the batch test is repeated */
+#define REPEAT 20000
+
+/** code which is not beautified */
+static const char UGLY[] = "if (a) {\nb = 1;\n      c(d);\n}\n";
+
+/** UGLY beautified */
+static const char PRETTY[] = "if (a) {\n\tb = 1;\n\tc(d);\n}\n";
+
+/** number of failed checks */
+static int failures = 0;
+
+/** messages given by the BUSL status of the test */
+static char messages[65536];
+
+/** length of messages */
+static size_t messageslen = 0;
+
+/**
+ * Count a failed check.
+ *
+ * @param line line number of the check
+ * @param what the check
+ */
+static void __stdcall failed(int line, const char *what) {
+	fprintf(stderr, "busltest.c(%d): check failed: %s\n", line, what);
+	if (messageslen) {
+		fprintf(stderr, "messages:\n%s", messages);
+	}
+	++failures;
+}
+
+#define CHECK(cond) ((cond)? (void) 0: failed(__LINE__, #cond))
+
+/**
+ * Message output function: messages are collected in messages.
+ */
+static void __stdcall collect(void *data, const char *str) {
+	size_t len = strlen(str);
+	(void) data;
+	if (messageslen+len<sizeof(messages)) {
+		memcpy(&messages[messageslen], str, len+1);
+		messageslen += len;
+	}
+}
+
+/**
+ * Create a BUSL status collecting its messages, forgetting earlier messages.
+ *
+ * @return BUSL status
+ */
+static Busl *__stdcall create(void) {
+	Busl *s = busl_create(0, collect, 0);
+	if (!s) {
+		fprintf(stderr, "busl_test: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	messageslen = 0;
+	*messages = '\0';
+	return s;
+}
+
+/**
+ * Beautify files and options like the busl command does.
+ *
+ * @param args files and options, 0-terminated
+ * @return result of busl_finish()
+ */
+static int __stdcall run(const char *const *args) {
+	Busl *s = create();
+	int argc = 0;
+	int result;
+	while (args[argc]) {
+		++argc;
+	}
+	result = busl_finish(s, busl_beautify_batch(s, argc, args));
+	busl_delete(s);
+	return result;
+}
+
+/**
+ * Write a file.
+ *
+ * @param name filename
+ * @param str contents
+ * @param age number of seconds the file was last modified ago, 0 for now
+ */
+static void __stdcall writefile(const char *name, const char *str, long age) {
+	FILE *f = fopen(name, "wb");
+	if (!f || (fwrite(str, 1, strlen(str), f)!=strlen(str)) || fclose(f)) {
+		fprintf(stderr, "busl_test: cannot write %s\n", name);
+		exit(EXIT_FAILURE);
+	}
+	if (age) {
+		struct utimbuf t;
+		t.actime = t.modtime = time(0)-age;
+		utime(name, &t);
+	}
+}
+
+/**
+ * Read a whole file.
+ *
+ * @param name filename
+ * @param len receives the length
+ * @return contents (to be freed), 0 if the file cannot be read
+ */
+static char *__stdcall readfile(const char *name, size_t *len) {
+	FILE *f = fopen(name, "rb");
+	char *p;
+	long size;
+	if (!f) {
+		return 0;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	p = (char *) malloc(size+1);
+	if (p) {
+		*len = fread(p, 1, size, f);
+		p[*len] = '\0';
+	}
+	fclose(f);
+	return p;
+}
+
+/**
+ * Compare a file with the expected contents.
+ *
+ * @param name filename
+ * @param expected expected contents
+ * @param len length of expected contents
+ * @return 1 if it is the same
+ */
+static int __stdcall samefile(const char *name, const char *expected, size_t len) {
+	size_t filelen = 0;
+	char *p = readfile(name, &filelen);
+	int same = p && (filelen==len) && !memcmp(p, expected, len);
+	if (!same) {
+		fprintf(stderr, "busl_test: %s has not the expected contents\n", name);
+	}
+	free(p);
+	return same;
+}
+
+/**
+ * busl_beautify_batch() with "j2": files sharing a temporary and backup
+ * file, like "foo.jsp" and "foo.js" (both using "foo.js$" and "foo.js~"),
+ * must not be beautified at the same time.
+ */
+static void __stdcall testbatch(void) {
+	/* beautified in both files, as xml/html/sgml mode copies text outside of <% %> */
+	static const char body[] = "<%\nif (a) {\nb = 1;\n      c(d);\n}\n%>\n";
+	static const char *const ext[2] = {"jsp", "js"};
+	char name[2*PAIRS][64];
+	char *input[2*PAIRS];
+	char *output[2*PAIRS];
+	size_t outputlen[2*PAIRS];
+	const char *argv[2*PAIRS+2];
+	size_t len = 64+REPEAT*(sizeof(body)-1);
+	int i, k;
+	Busl *s = create();
+
+	argv[0] = "j2";
+	for (i=0; i<2*PAIRS; ++i) {
+		char *p;
+		sprintf(name[i], "pair%d.%s", i/2, ext[i&1]);
+		input[i] = p = (char *) malloc(len);
+		output[i] = (char *) malloc(2*len);
+		if (!p || !output[i]) {
+			fprintf(stderr, "busl_test: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		/* the first line makes the contents of each file different, but all
+		 * files have the same size, so the files of a pair are started together */
+		p += sprintf(p, "// %04d\n", i);
+		for (k=0; k<REPEAT; ++k) {
+			memcpy(p, body, sizeof(body)-1);
+			p += sizeof(body)-1;
+		}
+		*p = '\0';
+		writefile(name[i], input[i], 0);
+		outputlen[i] = 2*len;
+		busl_beautify_buffer(s, name[i], input[i], strlen(input[i]), output[i], &outputlen[i], 0, 0);
+		argv[i+1] = name[i];
+	}
+	argv[2*PAIRS+1] = 0;
+	busl_delete(s);
+	run(argv);
+
+	for (i=0; i<2*PAIRS; ++i) {
+		char tmp[72];
+		CHECK(samefile(name[i], output[i], outputlen[i]));
+		if (i&1) {
+			/* the .js file comes last, so its backup is the one left */
+			sprintf(tmp, "%s~", name[i]);
+			CHECK(samefile(tmp, input[i], strlen(input[i])));
+			sprintf(tmp, "%s$", name[i]);
+			CHECK(remove(tmp)!=0);
+		}
+		free(input[i]);
+		free(output[i]);
+	}
+}
+
+/**
+ * busl_beautify_buffer(): output, flags, truncation and messages.
+ */
+static void __stdcall testbuffer(void) {
+	char output[256];
+	char msg[256];
+	size_t outputlen = sizeof(output);
+	size_t msglen = sizeof(msg);
+	Busl *s = create();
+	int flags = busl_beautify_buffer(s, "x.c", UGLY, strlen(UGLY), output, &outputlen, msg, &msglen);
+	CHECK(flags&CHANGED);
+	CHECK((outputlen==strlen(PRETTY)) && !memcmp(output, PRETTY, outputlen));
+	CHECK(msglen==0);
+
+	outputlen = sizeof(output);
+	msglen = sizeof(msg);
+	flags = busl_beautify_buffer(s, "x.c", PRETTY, strlen(PRETTY), output, &outputlen, msg, &msglen);
+	CHECK(!(flags&CHANGED));
+	CHECK((outputlen==strlen(PRETTY)) && !memcmp(output, PRETTY, outputlen));
+
+	/* the output doesn't fit: truncated, but the full length is returned */
+	memset(output, 0, sizeof(output));
+	outputlen = 4;
+	busl_beautify_buffer(s, "x.c", UGLY, strlen(UGLY), output, &outputlen, msg, &msglen);
+	CHECK(outputlen==strlen(PRETTY));
+	CHECK(!memcmp(output, PRETTY, 4) && !output[4]);
+
+	/* messages are returned, not written */
+	outputlen = sizeof(output);
+	msglen = sizeof(msg);
+	busl_beautify_buffer(s, "x.c", "if (a) {\nb;\n", 12, output, &outputlen, msg, &msglen);
+	CHECK((msglen>0) && (msglen<sizeof(msg)) && strstr(msg, "x.c(3,0): ERROR: } missing at end of file."));
+	CHECK(messageslen==0);
+
+	/* the mode follows from the extension */
+	outputlen = sizeof(output);
+	msglen = sizeof(msg);
+	flags = busl_beautify_buffer(s, "x.html", "<p>\n  x\n</p>\n", 13, output, &outputlen, msg, &msglen);
+	CHECK(flags&XMLMODE);
+	busl_delete(s);
+}
+
+/**
+ * Sink function of busl_beautify_sink(): append to a buffer.
+ */
+static void __stdcall append(void *data, const char *str, size_t len) {
+	char *buf = (char *) data;
+	size_t buflen = strlen(buf);
+	if (buflen+len<1024) {
+		memcpy(&buf[buflen], str, len);
+		buf[buflen+len] = '\0';
+	}
+}
+
+/**
+ * busl_beautify_sink(): the pieces passed to the sink form the same output as
+ * busl_beautify_buffer() gives.
+ */
+static void __stdcall testsink(void) {
+	static const char input[] = "<p>\n<%\nif (a) {\nb = 1;\n}\n%>\n</p>\n";
+	char buf[1024];
+	char output[1024];
+	size_t outputlen = sizeof(output);
+	Busl *s = create();
+	int flags;
+	*buf = '\0';
+	flags = busl_beautify_sink(s, "x.c", UGLY, strlen(UGLY), append, buf, 0, 0);
+	CHECK(flags&CHANGED);
+	CHECK(!strcmp(buf, PRETTY));
+
+	*buf = '\0';
+	flags = busl_beautify_sink(s, "x.jsp", input, strlen(input), append, buf, 0, 0);
+	busl_beautify_buffer(s, "x.jsp", input, strlen(input), output, &outputlen, 0, 0);
+	CHECK(flags&CHANGED);
+	CHECK((strlen(buf)==outputlen) && !memcmp(buf, output, outputlen));
+
+	/* without a sink only the flags are returned */
+	flags = busl_beautify_sink(s, "x.c", UGLY, strlen(UGLY), 0, 0, 0, 0);
+	CHECK(flags&CHANGED);
+	CHECK(messageslen==0);
+	busl_delete(s);
+}
+
+/**
+ * Find lines in beautified code.
+ *
+ * @param code beautified code
+ * @param first first line (1 = first line)
+ * @param last last line
+ * @param len receives the length of the lines
+ * @return start of line first
+ */
+static const char *__stdcall findlines(const char *code, int first, int last, size_t *len) {
+	const char *p = code;
+	const char *q;
+	int line;
+	for (line=1; (line<first) && *p; ++line) {
+		p = strchr(p, '\n')+1;
+	}
+	for (q=p; (line<=last) && *q; ++line) {
+		q = strchr(q, '\n')+1;
+	}
+	*len = (size_t) (q-p);
+	return p;
+}
+
+/**
+ * busl_beautify_range(): the lines returned are the same lines of the whole
+ * input beautified, also after the input is edited.
+ */
+static void __stdcall testrange(void) {
+	static const char *const input[2] = {
+		"int a;\nif (a) {\nb = 1;\nc = 2;\n}\nint d;\n",
+		"int a;\nif (a) {\nb = 1;\nwhile (c) {\nc = 2;\n}\n}\nint d;\n"
+	};
+	char whole[256];
+	char output[256];
+	int i;
+	Busl *s = create();
+	for (i=0; i<2; ++i) {
+		size_t wholelen = sizeof(whole);
+		size_t outputlen = sizeof(output);
+		size_t len;
+		const char *lines;
+		int first = 3;
+		int last = 3;
+		int flags;
+		busl_beautify_buffer(s, "x.c", input[i], strlen(input[i]), whole, &wholelen, 0, 0);
+		whole[wholelen] = '\0';
+		flags = busl_beautify_range(s, "x.c", input[i], strlen(input[i]), &first, &last, output, &outputlen, 0, 0);
+		CHECK(flags&CHANGED);
+		CHECK((first<=3) && (last>=3));
+		lines = findlines(whole, first, last, &len);
+		CHECK((outputlen==len) && !memcmp(output, lines, len));
+	}
+	busl_delete(s);
+}
+
+/**
+ * The "d" option: a unified diff instead of writing, exit code 2 when there
+ * are changes.
+ */
+static void __stdcall testdiff(void) {
+	static const char *const ugly[] = {"d", "x.c", 0};
+	static const char *const pretty[] = {"d", "y.c", 0};
+	writefile("x.c", UGLY, 0);
+	writefile("y.c", PRETTY, 0);
+	CHECK(run(ugly)==2);
+	CHECK(!strcmp(messages, "--- x.c\n+++ x.c\n@@ -1,4 +1,4 @@\n if (a) {\n-b = 1;\n-      c(d);\n+\tb = 1;\n+\tc(d);\n }\n"));
+	CHECK(samefile("x.c", UGLY, strlen(UGLY)));
+	CHECK(run(pretty)==0);
+	CHECK(!strstr(messages, "---"));
+}
+
+/**
+ * The "d" option with CRLF line ends: removed and unchanged lines are given
+ * with CRLF, so the diff can be applied to the file.
+ */
+static void __stdcall testdiffcrlf(void) {
+	static const char *const ugly[] = {"d", "x.c", 0};
+	static const char *const pretty[] = {"d", "y.c", 0};
+	static const char *const mixed[] = {"d", "z.c", 0};
+	writefile("x.c", "if (a) {\r\nb = 1;\r\n      c(d);\r\n}\r\n", 0);
+	writefile("y.c", "if (a) {\r\n\tb = 1;\r\n\tc(d);\r\n}\r\n", 0);
+	writefile("z.c", "if (a) {\nb = 1;\r\n\tc(d);\n}", 0);
+	CHECK(run(ugly)==2);
+	CHECK(!strcmp(messages, "--- x.c\n+++ x.c\n@@ -1,4 +1,4 @@\n if (a) {\r\n-b = 1;\r\n-      c(d);\r\n+\tb = 1;\n+\tc(d);\n }\r\n"));
+	CHECK(run(pretty)==0);
+	CHECK(!strstr(messages, "---"));
+	CHECK(run(mixed)==2);
+	CHECK(!strcmp(messages, "--- z.c\n+++ z.c\n@@ -1,4 +1,4 @@\n if (a) {\n-b = 1;\r\n+\tb = 1;\n \tc(d);\n-}\n\\ No newline at end of file\n+}\n"));
+}
+
+/**
+ * The "k" option: the first line which is not beautified is reported, and
+ * nothing is written.
+ */
+static void __stdcall testcheck(void) {
+	static const char *const ugly[] = {"k", "x.c", 0};
+	static const char *const pretty[] = {"k", "y.c", 0};
+	static const char *const failfast[] = {"k", "e", "x.c", "y.c", "x.c", 0};
+	writefile("x.c", UGLY, 0);
+	writefile("y.c", PRETTY, 0);
+	CHECK(run(ugly)==2);
+	CHECK(strstr(messages, "x.c(2,0): WARNING: not beautified, first change in this line.\n")!=0);
+	CHECK(samefile("x.c", UGLY, strlen(UGLY)));
+	CHECK(run(pretty)==0);
+	CHECK(!strstr(messages, "WARNING"));
+	/* with "e", the second x.c is not beautified */
+	CHECK(run(failfast)==2);
+	CHECK(strstr(messages, "first change") && !strstr(strstr(messages, "first change")+1, "first change"));
+}
+
+/**
+ * The "c" option: files which were clean are skipped, until they are modified.
+ */
+static void __stdcall testcache(void) {
+	static const char *const clean[] = {"c", "t", "x.c", 0};
+	static const char *const nocache[] = {"t", "x.c", 0};
+	static const char ugly[] = "if (a) {\n b = 1;\n c(d);\n}\n";
+	size_t len = 0;
+	char *p;
+	remove(".buslcache");
+	/* modified just now: not remembered, a later change could go unnoticed */
+	writefile("x.c", PRETTY, 0);
+	CHECK(run(clean)==0);
+	writefile("x.c", PRETTY, 100);
+	CHECK(run(clean)==0);
+	p = readfile(".buslcache", &len);
+	CHECK(p && strstr(p, "x.c"));
+	free(p);
+	/* same size and time, so the change is not noticed */
+	CHECK(sizeof(ugly)==sizeof(PRETTY));
+	writefile("x.c", ugly, 100);
+	CHECK(run(clean)==0);
+	CHECK(!strstr(messages, "not written"));
+	CHECK(run(nocache)==0);
+	CHECK(strstr(messages, "x.c$ not written (test mode)")!=0);
+	/* modified later: beautified again */
+	writefile("x.c", ugly, 50);
+	CHECK(run(clean)==0);
+	CHECK(strstr(messages, "x.c$ not written (test mode)")!=0);
+}
+
+/**
+ * The "c" option with "q": a file giving a warning which was suppressed is
+ * not skipped without "q".
+ */
+static void __stdcall testcachequiet(void) {
+	static const char *const quiet[] = {"c", "q", "t", "w.c", 0};
+	static const char *const loud[] = {"c", "t", "w.c", 0};
+	remove(".buslcache");
+	writefile("w.c", "int a;\n}\n", 100);
+	CHECK(run(quiet)==0);
+	CHECK(run(loud)==2);
+	CHECK(strstr(messages, "w.c(2,")!=0);
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+/**
+ * Find the files in a directory.
+ *
+ * @param dir directory
+ * @param name receives the path of the last file found
+ * @param clear remove the files
+ * @return number of files found
+ */
+static int __stdcall findfiles(const char *dir, char *name, int clear) {
+	DIR *d = opendir(dir);
+	struct dirent *entry;
+	int count = 0;
+	while (d && ((entry = readdir(d))!=0)) {
+		if (*entry->d_name!='.') {
+			sprintf(name, "%s/%.200s", dir, entry->d_name);
+			if (clear) {
+				remove(name);
+			}
+			++count;
+		}
+	}
+	if (d) {
+		closedir(d);
+	}
+	return count;
+}
+#endif
+
+/**
+ * The "+<dir>" option: the output of the same input is taken from the output
+ * cache.
+ */
+static void __stdcall testoutcache(void) {
+	static const char *const first[] = {"+cache", "n", "x.c", 0};
+	static const char *const second[] = {"+cache", "n", "y.c", 0};
+	static const char *const off[] = {"+cache", "+", "n", "z.c", 0};
+	mkdir("cache", 0777);
+#if !defined(_WIN32) && !defined(_WIN64)
+	{
+		char name[300];
+		findfiles("cache", name, 1);
+		writefile("x.c", UGLY, 0);
+		CHECK(run(first)==0);
+		CHECK(samefile("x.c", PRETTY, strlen(PRETTY)));
+		CHECK(findfiles("cache", name, 0)==1);
+		{
+			/* change the output in the cache, to see that it is used */
+			size_t len = 0;
+			char *p = readfile(name, &len);
+			char *b = p? strstr(p, "\tb"): 0;
+			CHECK(b!=0);
+			if (b) {
+				b[1] = 'B';
+				writefile(name, p, 0);
+			}
+			free(p);
+		}
+		writefile("y.c", UGLY, 0);
+		CHECK(run(second)==0);
+		CHECK(samefile("y.c", "if (a) {\n\tB = 1;\n\tc(d);\n}\n", strlen(PRETTY)));
+	}
+	{
+		/* identical files beautified at the same time write the same entry */
+		static const char *const parallel[] = {"+cache2", "j4", "n", "p0.c", "p1.c", "p2.c", "p3.c", "p4.c", "p5.c", "p6.c", "p7.c", 0};
+		char name[300];
+		int i;
+		mkdir("cache2", 0777);
+		findfiles("cache2", name, 1);
+		for (i=0; i<8; ++i) {
+			writefile(parallel[i+3], UGLY, 0);
+		}
+		CHECK(run(parallel)==0);
+		for (i=0; i<8; ++i) {
+			CHECK(samefile(parallel[i+3], PRETTY, strlen(PRETTY)));
+		}
+		/* no temporary files left behind */
+		CHECK(findfiles("cache2", name, 0)==1);
+	}
+#else
+	writefile("x.c", UGLY, 0);
+	CHECK(run(first)==0);
+	CHECK(samefile("x.c", PRETTY, strlen(PRETTY)));
+	writefile("y.c", UGLY, 0);
+	CHECK(run(second)==0);
+	CHECK(samefile("y.c", PRETTY, strlen(PRETTY)));
+#endif
+	/* "+" only: no output cache for the next files */
+	writefile("z.c", UGLY, 0);
+	CHECK(run(off)==0);
+	CHECK(samefile("z.c", PRETTY, strlen(PRETTY)));
+}
+
+/**
+ * The "=<ext>" option: standard input beautified to standard output.
+ */
+static void __stdcall testfilter(void) {
+	static const char *const filter[] = {"=c", 0};
+	writefile("in.c", UGLY, 0);
+	if (!freopen("in.c", "rb", stdin) || !freopen("out.c", "wb", stdout)) {
+		failed(__LINE__, "freopen");
+		return;
+	}
+	CHECK(run(filter)==0);
+	fclose(stdout);
+	CHECK(samefile("out.c", PRETTY, strlen(PRETTY)));
+}
+
+/**
+ * The "=<ext>" option with "k": clean standard input is not reported.
+ */
+static void __stdcall testfiltercheck(void) {
+	static const char *const filter[] = {"k", "=c", 0};
+	writefile("clean.c", PRETTY, 0);
+	writefile("ugly.c", UGLY, 0);
+	if (!freopen("clean.c", "rb", stdin)) {
+		failed(__LINE__, "freopen");
+		return;
+	}
+	CHECK(run(filter)==0);
+	CHECK(!strstr(messages, "WARNING"));
+	if (!freopen("ugly.c", "rb", stdin)) {
+		failed(__LINE__, "freopen");
+		return;
+	}
+	CHECK(run(filter)==2);
+	CHECK(strstr(messages, "<stdin>(2,0): WARNING: not beautified, first change in this line.\n")!=0);
+}
+
+/**
+ * A test
+ */
+typedef struct busltest {
+	/** name, given on the command line */
+	const char *name;
+	/** function running the test */
+	void (__stdcall *run)(void);
+} busltest;
+
+static const busltest tests[] = {
+	{"batch", testbatch},
+	{"buffer", testbuffer},
+	{"sink", testsink},
+	{"range", testrange},
+	{"diff", testdiff},
+	{"diffcrlf", testdiffcrlf},
+	{"check", testcheck},
+	{"cache", testcache},
+	{"cachequiet", testcachequiet},
+	{"outcache", testoutcache},
+	{"filter", testfilter},
+	{"filtercheck", testfiltercheck}
+};
+
+/**
+ * Main function of the tests:
+ * busl_test <test>
+ *
+ * @param argc number of command line arguments
+ * @param argv command line arguments
+ * @return 0 when all checks of the test passed
+ */
+int main(int argc, char *argv[]) {
+	char dir[64];
+	int i;
+	for (i=0; (argc==2) && (i<(int) (sizeof(tests)/sizeof(tests[0]))); ++i) {
+		if (!strcmp(argv[1], tests[i].name)) {
+			sprintf(dir, "busl_test.%s", tests[i].name);
+			mkdir(dir, 0777);
+			if (chdir(dir)) {
+				fprintf(stderr, "busl_test: cannot use directory %s\n", dir);
+				return EXIT_FAILURE;
+			}
+			tests[i].run();
+			return failures? EXIT_FAILURE: EXIT_SUCCESS;
+		}
+	}
+	fprintf(stderr, "usage: %s <test>\n", *argv);
+	return EXIT_FAILURE;
+}
@@ -186,9 +186,7 @@ int WINAPI WinMain(HINSTANCE inst, HINSTANCE previnst, LPSTR cmdline, int cmdsho
 		changed = busl_usage(&s, argv[0]); /* prevent de "no sources modified" message */
 	}
 	arg = argv[0];
-	while (--argc) {
-		changed |= busl_beautify(&s, *(++argv));
-	}
+	changed |= busl_beautify_batch(&s, argc-1, (const char *const *) &argv[1]);
 	busl_finish(&s, changed);
 	if (d.msgtxt) {
 		MessageBeep(MB_ICONEXCLAMATION);